@@ -6,9 +6,11 @@
 #define BITCOIN_CHECKQUEUE_H
 
 #include <algorithm>
+#include <deque>
 #include <vector>
 
 #include <boost/foreach.hpp>
+#include <boost/scoped_array.hpp>
 #include <boost/thread/condition_variable.hpp>
 #include <boost/thread/locks.hpp>
 #include <boost/thread/mutex.hpp>
@@ -25,11 +27,22 @@ class CCheckQueueControl;
   * onto the queue, where they are processed by N-1 worker threads. When
   * the master is done adding work, it temporarily joins the worker pool
   * as an N'th worker, until all jobs are done.
+  *
+  * Every worker has its own deque, each protected by its own mutex. Added
+  * batches are spread over the deques of the workers; a worker takes work
+  * from the back of its own deque and, once that is empty, steals from the
+  * front of the others. The shared state is only locked once per batch.
   */
 template <typename T>
 class CCheckQueue
 {
 private:
+    //! A deque of elements to be processed, owned by one worker but open to stealing
+    struct CWorkerQueue {
+        boost::mutex mutex;
+        std::deque<T> queue;
+    };
+
     //! Mutex to protect the inner state
     boost::mutex mutex;
 
@@ -39,15 +52,20 @@ private:
     //! Master thread blocks on this when out of work
     boost::condition_variable condMaster;
 
-    //! The queue of elements to be processed.
-    //! As the order of booleans doesn't matter, it is used as a LIFO (stack)
-    std::vector<T> queue;
+    //! The per-worker queues. The first one belongs to the master.
+    boost::scoped_array<CWorkerQueue> queues;
+
+    //! The number of per-worker queues.
+    unsigned int nQueues;
 
-    //! The number of workers (including the master) that are idle.
-    int nIdle;
+    //! The number of worker threads that have been started, excluding the master.
+    unsigned int nWorkers;
 
-    //! The total number of workers (including the master).
-    int nTotal;
+    //! Incremented whenever added work has been pushed, so idle workers can tell whether they missed any.
+    unsigned int nGeneration;
+
+    //! The worker queue the next added batch starts at, not counting the master's.
+    unsigned int nNextQueue;
 
     //! The temporary evaluation result.
     bool fAllOk;
@@ -65,32 +83,73 @@ private:
     //! The maximum number of elements to be processed in one batch
     unsigned int nBatchSize;
 
+    /**
+     * Move a batch of work from one of the per-worker queues to vChecks. Own work is
+     * taken from the back, stolen work from the front. Batches shrink as the queue
+     * drains, so all workers finish approximately simultaneously.
+     */
+    bool Take(CWorkerQueue& worker, bool fSteal, std::vector<T>& vChecks)
+    {
+        boost::unique_lock<boost::mutex> lock(worker.mutex);
+        if (worker.queue.empty())
+            return false;
+        unsigned int nNow = std::max(1U, std::min(nBatchSize, (unsigned int)worker.queue.size() / 2));
+        vChecks.resize(nNow);
+        for (unsigned int i = 0; i < nNow; i++) {
+            // Swap jobs to the local batch vector instead of copying, to keep the lock short
+            if (fSteal) {
+                vChecks[i].swap(worker.queue.front());
+                worker.queue.pop_front();
+            } else {
+                vChecks[i].swap(worker.queue.back());
+                worker.queue.pop_back();
+            }
+        }
+        return true;
+    }
+
+    /** Find a batch of work for the worker owning queue nQueue, stealing from the other workers if needed. */
+    bool Find(unsigned int nQueue, std::vector<T>& vChecks)
+    {
+        if (Take(queues[nQueue], false, vChecks))
+            return true;
+        for (unsigned int i = 1; i < nQueues; i++)
+            if (Take(queues[(nQueue + i) % nQueues], true, vChecks))
+                return true;
+        return false;
+    }
+
     /** Internal function that does bulk of the verification work. */
     bool Loop(bool fMaster = false)
     {
         boost::condition_variable& cond = fMaster ? condMaster : condWorker;
         std::vector<T> vChecks;
         vChecks.reserve(nBatchSize);
+        unsigned int nQueue = 0;
+        unsigned int nGenerationSeen;
         unsigned int nNow = 0;
         bool fOk = true;
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            if (!fMaster)
+                nQueue = 1 + nWorkers++ % (nQueues - 1);
+            nGenerationSeen = nGeneration;
+        }
         do {
+            bool fFound = Find(nQueue, vChecks);
             {
                 boost::unique_lock<boost::mutex> lock(mutex);
-                // first do the clean-up of the previous loop run (allowing us to do it in the same critsect)
+                // first do the clean-up of the previous batch (allowing us to do it in the same critsect)
                 if (nNow) {
                     fAllOk &= fOk;
                     nTodo -= nNow;
                     if (nTodo == 0 && !fMaster)
                         // We processed the last element; inform the master it can exit and return the result
                         condMaster.notify_one();
-                } else {
-                    // first iteration
-                    nTotal++;
+                    nNow = 0;
                 }
-                // logically, the do loop starts here
-                while (queue.empty()) {
+                if (!fFound) {
                     if ((fMaster || fQuit) && nTodo == 0) {
-                        nTotal--;
                         bool fRet = fAllOk;
                         // reset the status for new work later
                         if (fMaster)
@@ -98,37 +157,31 @@ private:
                         // return the current status
                         return fRet;
                     }
-                    nIdle++;
-                    cond.wait(lock); // wait
-                    nIdle--;
-                }
-                // Decide how many work units to process now.
-                // * Do not try to do everything at once, but aim for increasingly smaller batches so
-                //   all workers finish approximately simultaneously.
-                // * Try to account for idle jobs which will instantly start helping.
-                // * Don't do batches smaller than 1 (duh), or larger than nBatchSize.
-                nNow = std::max(1U, std::min(nBatchSize, (unsigned int)queue.size() / (nTotal + nIdle + 1)));
-                vChecks.resize(nNow);
-                for (unsigned int i = 0; i < nNow; i++) {
-                    // We want the lock on the mutex to be as short as possible, so swap jobs from the global
-                    // queue to the local batch vector instead of copying.
-                    vChecks[i].swap(queue.back());
-                    queue.pop_back();
+                    // Only sleep if no work can have been added since the queues were searched
+                    if (nGenerationSeen == nGeneration || nTodo == 0)
+                        cond.wait(lock); // wait
+                    nGenerationSeen = nGeneration;
+                    continue;
                 }
-                // Check whether we need to do work at all
+                nGenerationSeen = nGeneration;
+                // Check whether we need to do work at all. The batch is still counted in nTodo,
+                // so this cannot be the result of an earlier round.
                 fOk = fAllOk;
             }
             // execute work
             BOOST_FOREACH (T& check, vChecks)
                 if (fOk)
                     fOk = check();
+            nNow = vChecks.size();
             vChecks.clear();
         } while (true);
     }
 
 public:
-    //! Create a new check queue
-    CCheckQueue(unsigned int nBatchSizeIn) : nIdle(0), nTotal(0), fAllOk(true), nTodo(0), fQuit(false), nBatchSize(nBatchSizeIn) {}
+    //! Create a new check queue for at most nMaxWorkers worker threads besides the master
+    CCheckQueue(unsigned int nBatchSizeIn, unsigned int nMaxWorkers) :
+        queues(new CWorkerQueue[std::max(1U, nMaxWorkers) + 1]), nQueues(std::max(1U, nMaxWorkers) + 1),
+        nWorkers(0), nGeneration(0), nNextQueue(0), fAllOk(true), nTodo(0), fQuit(false), nBatchSize(nBatchSizeIn) {}
 
     //! Worker thread
     void Thread()
@@ -145,15 +198,37 @@ public:
     //! Add a batch of checks to the queue
     void Add(std::vector<T>& vChecks)
     {
-        boost::unique_lock<boost::mutex> lock(mutex);
-        BOOST_FOREACH (T& check, vChecks) {
-            queue.push_back(T());
-            check.swap(queue.back());
+        if (vChecks.empty())
+            return;
+        unsigned int nActive, nFirst, nSpread;
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            // Count the checks before they become visible, so workers taking them right away
+            // never make nTodo underflow.
+            nTodo += vChecks.size();
+            // Spread the batch over the queues of the running workers, continuing where the last one ended
+            nActive = std::max(1U, std::min(nWorkers, nQueues - 1));
+            nSpread = std::min((unsigned int)vChecks.size(), nActive);
+            nFirst = nNextQueue % nActive;
+            nNextQueue = (nFirst + nSpread) % nActive;
         }
-        nTodo += vChecks.size();
+        size_t nPos = 0;
+        for (unsigned int i = 0; i < nSpread; i++) {
+            size_t nEnd = vChecks.size() * (i + 1) / nSpread;
+            CWorkerQueue& worker = queues[1 + (nFirst + i) % nActive];
+            boost::unique_lock<boost::mutex> lock(worker.mutex);
+            for (; nPos < nEnd; nPos++) {
+                worker.queue.push_back(T());
+                vChecks[nPos].swap(worker.queue.back());
+            }
+        }
+        // Only announce the work once it is in the queues: a worker that searched them before the
+        // push either sees the new generation and searches again, or is already waiting to be notified.
+        boost::unique_lock<boost::mutex> lock(mutex);
+        nGeneration++;
         if (vChecks.size() == 1)
             condWorker.notify_one();
-        else if (vChecks.size() > 1)
+        else
             condWorker.notify_all();
     }
 
@@ -161,10 +236,14 @@ public:
     {
     }
 
+    /**
+     * Whether there is no outstanding work. Workers that were woken up but found
+     * nothing to do may still be on their way back to sleep; they are harmless.
+     */
     bool IsIdle()
     {
         boost::unique_lock<boost::mutex> lock(mutex);
-        return (nTotal == nIdle && nTodo == 0 && fAllOk == true);
+        return (nTodo == 0 && fAllOk == true);
     }
 
 };
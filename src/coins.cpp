@@ -7,6 +7,7 @@
 #include "memusage.h"
 #include "random.h"
 
+#include <algorithm>
 #include <assert.h>
 
 /**
@@ -42,18 +43,42 @@ bool CCoins::Spend(uint32_t nPos)
 }
 
 bool CCoinsView::GetCoins(const uint256 &txid, CCoins &coins) const { return false; }
+bool CCoinsView::GetCoin(const COutPoint &outpoint, CCoins &coins, CTxOut &txout) const {
+    CCoins tmp;
+    return GetCoins(outpoint.hash, tmp) && tmp.GetOutput(outpoint.n, coins, txout);
+}
+void CCoinsView::GetCoinsBatch(const std::vector<uint256> &vTxid, std::vector<std::pair<uint256, CCoins> > &vCoins) const {
+    BOOST_FOREACH(const uint256 &txid, vTxid) {
+        CCoins coins;
+        if (GetCoins(txid, coins)) {
+            vCoins.push_back(std::make_pair(txid, CCoins()));
+            vCoins.back().second.swap(coins);
+        }
+    }
+}
 bool CCoinsView::HaveCoins(const uint256 &txid) const { return false; }
 uint256 CCoinsView::GetBestBlock() const { return uint256(); }
 bool CCoinsView::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock) { return false; }
+bool CCoinsView::WriteCoins(const CCoinsMap &mapCoins, const uint256 &hashBlock) {
+    CCoinsMap mapDirty;
+    for (CCoinsMap::const_iterator it = mapCoins.begin(); it != mapCoins.end(); it++) {
+        if (it->second.flags & CCoinsCacheEntry::DIRTY) {
+            mapDirty[it->first] = it->second;
+        }
+    }
+    return BatchWrite(mapDirty, hashBlock);
+}
 bool CCoinsView::GetStats(CCoinsStats &stats) const { return false; }
 
 
 CCoinsViewBacked::CCoinsViewBacked(CCoinsView *viewIn) : base(viewIn) { }
 bool CCoinsViewBacked::GetCoins(const uint256 &txid, CCoins &coins) const { return base->GetCoins(txid, coins); }
+bool CCoinsViewBacked::GetCoin(const COutPoint &outpoint, CCoins &coins, CTxOut &txout) const { return base->GetCoin(outpoint, coins, txout); }
 bool CCoinsViewBacked::HaveCoins(const uint256 &txid) const { return base->HaveCoins(txid); }
 uint256 CCoinsViewBacked::GetBestBlock() const { return base->GetBestBlock(); }
 void CCoinsViewBacked::SetBackend(CCoinsView &viewIn) { base = &viewIn; }
 bool CCoinsViewBacked::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock) { return base->BatchWrite(mapCoins, hashBlock); }
+bool CCoinsViewBacked::WriteCoins(const CCoinsMap &mapCoins, const uint256 &hashBlock) { return base->WriteCoins(mapCoins, hashBlock); }
 bool CCoinsViewBacked::GetStats(CCoinsStats &stats) const { return base->GetStats(stats); }
 
 CCoinsKeyHasher::CCoinsKeyHasher() : salt(GetRandHash()) {}
@@ -71,8 +96,10 @@ size_t CCoinsViewCache::DynamicMemoryUsage() const {
 
 CCoinsMap::const_iterator CCoinsViewCache::FetchCoins(const uint256 &txid) const {
     CCoinsMap::iterator it = cacheCoins.find(txid);
-    if (it != cacheCoins.end())
+    if (it != cacheCoins.end()) {
+        it->second.flags |= CCoinsCacheEntry::ACCESSED;
         return it;
+    }
     CCoins tmp;
     if (!base->GetCoins(txid, tmp))
         return cacheCoins.end();
@@ -82,11 +109,49 @@ CCoinsMap::const_iterator CCoinsViewCache::FetchCoins(const uint256 &txid) const
         // The parent only has an empty entry for this txid; we can consider our
         // version as fresh.
         ret->second.flags = CCoinsCacheEntry::FRESH;
+    } else {
+        ret->second.nBaseOutputs = ret->second.coins.vout.size();
     }
     cachedCoinsUsage += memusage::DynamicUsage(ret->second.coins);
     return ret;
 }
 
+void CCoinsViewCache::PrefetchCoins(const std::vector<uint256> &vTxid) const {
+    std::vector<uint256> vMissing;
+    BOOST_FOREACH(const uint256 &txid, vTxid) {
+        if (!cacheCoins.count(txid))
+            vMissing.push_back(txid);
+    }
+    if (vMissing.empty())
+        return;
+    std::sort(vMissing.begin(), vMissing.end());
+    vMissing.erase(std::unique(vMissing.begin(), vMissing.end()), vMissing.end());
+    std::vector<std::pair<uint256, CCoins> > vCoins;
+    vCoins.reserve(vMissing.size());
+    base->GetCoinsBatch(vMissing, vCoins);
+    for (unsigned int i = 0; i < vCoins.size(); i++) {
+        // Insert the entries as FetchCoins does
+        std::pair<CCoinsMap::iterator, bool> ret = cacheCoins.insert(std::make_pair(vCoins[i].first, CCoinsCacheEntry()));
+        if (!ret.second)
+            continue;
+        vCoins[i].second.swap(ret.first->second.coins);
+        if (ret.first->second.coins.IsPruned())
+            ret.first->second.flags = CCoinsCacheEntry::FRESH;
+        else
+            ret.first->second.nBaseOutputs = ret.first->second.coins.vout.size();
+        cachedCoinsUsage += memusage::DynamicUsage(ret.first->second.coins);
+    }
+}
+
+void CCoinsViewCache::GetCoinsBatch(const std::vector<uint256> &vTxid, std::vector<std::pair<uint256, CCoins> > &vCoins) const {
+    PrefetchCoins(vTxid);
+    BOOST_FOREACH(const uint256 &txid, vTxid) {
+        CCoinsMap::const_iterator it = cacheCoins.find(txid);
+        if (it != cacheCoins.end())
+            vCoins.push_back(std::make_pair(txid, it->second.coins));
+    }
+}
+
 bool CCoinsViewCache::GetCoins(const uint256 &txid, CCoins &coins) const {
     CCoinsMap::const_iterator it = FetchCoins(txid);
     if (it != cacheCoins.end()) {
@@ -96,6 +161,13 @@ bool CCoinsViewCache::GetCoins(const uint256 &txid, CCoins &coins) const {
     return false;
 }
 
+bool CCoinsViewCache::GetCoin(const COutPoint &outpoint, CCoins &coins, CTxOut &txout) const {
+    CCoinsMap::const_iterator it = cacheCoins.find(outpoint.hash);
+    if (it != cacheCoins.end())
+        return it->second.coins.GetOutput(outpoint.n, coins, txout);
+    return base->GetCoin(outpoint, coins, txout);
+}
+
 CCoinsModifier CCoinsViewCache::ModifyCoins(const uint256 &txid) {
     assert(!hasModifier);
     std::pair<CCoinsMap::iterator, bool> ret = cacheCoins.insert(std::make_pair(txid, CCoinsCacheEntry()));
@@ -108,6 +180,8 @@ CCoinsModifier CCoinsViewCache::ModifyCoins(const uint256 &txid) {
         } else if (ret.first->second.coins.IsPruned()) {
             // The parent view only has a pruned entry for this; mark it as fresh.
             ret.first->second.flags = CCoinsCacheEntry::FRESH;
+        } else {
+            ret.first->second.nBaseOutputs = ret.first->second.coins.vout.size();
         }
     } else {
         cachedCoinUsage = memusage::DynamicUsage(ret.first->second.coins);
@@ -170,11 +244,15 @@ bool CCoinsViewCache::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlockIn
                     cachedCoinsUsage -= memusage::DynamicUsage(itUs->second.coins);
                     cacheCoins.erase(itUs);
                 } else {
-                    // A normal modification.
+                    // A normal modification. Our entry keeps its base size, as it
+                    // still describes what the grandparent has. Outputs of a child
+                    // entry that was fresh to us were not spends of ours.
                     cachedCoinsUsage -= memusage::DynamicUsage(itUs->second.coins);
                     itUs->second.coins.swap(it->second.coins);
                     cachedCoinsUsage += memusage::DynamicUsage(itUs->second.coins);
                     itUs->second.flags |= CCoinsCacheEntry::DIRTY;
+                    if (it->second.flags & (CCoinsCacheEntry::FRESH | CCoinsCacheEntry::REWRITE))
+                        itUs->second.flags |= CCoinsCacheEntry::REWRITE;
                 }
             }
         }
@@ -185,6 +263,11 @@ bool CCoinsViewCache::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlockIn
     return true;
 }
 
+bool CCoinsViewCache::WriteCoins(const CCoinsMap &mapCoins, const uint256 &hashBlockIn) {
+    // Entries are moved into this cache, so they need a copy to be taken from.
+    return CCoinsView::WriteCoins(mapCoins, hashBlockIn);
+}
+
 bool CCoinsViewCache::Flush() {
     bool fOk = base->BatchWrite(cacheCoins, hashBlock);
     cacheCoins.clear();
@@ -192,6 +275,53 @@ bool CCoinsViewCache::Flush() {
     return fOk;
 }
 
+bool CCoinsViewCache::Sync() {
+    assert(!hasModifier);
+    // The base writes the modified entries straight from our map, without taking them over.
+    bool fOk = base->WriteCoins(cacheCoins, hashBlock);
+    for (CCoinsMap::iterator it = cacheCoins.begin(); it != cacheCoins.end();) {
+        if (it->second.flags & CCoinsCacheEntry::DIRTY) {
+            if (it->second.coins.IsPruned()) {
+                // The base no longer has this entry at all; no need to remember it.
+                cachedCoinsUsage -= memusage::DynamicUsage(it->second.coins);
+                cacheCoins.erase(it++);
+                continue;
+            }
+            // Just written entries are likely to be spent soon; treat them as recently used.
+            it->second.flags = CCoinsCacheEntry::ACCESSED;
+            it->second.nBaseOutputs = it->second.coins.vout.size();
+        }
+        it++;
+    }
+    return fOk;
+}
+
+void CCoinsViewCache::Evict(size_t nMaxUsage) {
+    assert(!hasModifier);
+    if (cacheCoins.empty() || DynamicMemoryUsage() <= nMaxUsage)
+        return;
+    // Freed slots of the map are only released when it is compacted at the end, so
+    // estimate its usage per remaining entry instead of measuring it along the way.
+    size_t nEntryUsage = cacheCoins.DynamicMemoryUsage() / cacheCoins.size();
+    // First evict entries that were not accessed since the last pass (clearing the
+    // mark of all others), then any unmodified ones.
+    for (int nPass = 0; nPass < 2; nPass++) {
+        for (CCoinsMap::iterator it = cacheCoins.begin(); it != cacheCoins.end();) {
+            bool fOver = cachedCoinsUsage + cacheCoins.size() * nEntryUsage > nMaxUsage;
+            if (!fOver && nPass == 1)
+                break;
+            if (fOver && !(it->second.flags & CCoinsCacheEntry::DIRTY) && (nPass == 1 || !(it->second.flags & CCoinsCacheEntry::ACCESSED))) {
+                cachedCoinsUsage -= memusage::DynamicUsage(it->second.coins);
+                cacheCoins.erase(it++);
+                continue;
+            }
+            it->second.flags &= ~CCoinsCacheEntry::ACCESSED;
+            it++;
+        }
+    }
+    cacheCoins.shrink_to_fit();
+}
+
 unsigned int CCoinsViewCache::GetCacheSize() const {
     return cacheCoins.size();
 }
@@ -246,15 +376,35 @@ double CCoinsViewCache::GetPriority(const CTransaction &tx, int nHeight) const
     return tx.ComputePriority(dResult);
 }
 
-CCoinsModifier::CCoinsModifier(CCoinsViewCache& cache_, CCoinsMap::iterator it_, size_t usage) : cache(cache_), it(it_), cachedCoinUsage(usage) {
+CCoinsModifier::CCoinsModifier(CCoinsViewCache& cache_, CCoinsMap::iterator it_, size_t usage) : cache(cache_), it(it_), cachedCoinUsage(usage), fTrackSpends(false) {
     assert(!cache.hasModifier);
     cache.hasModifier = true;
+    const CCoinsCacheEntry &entry = it->second;
+    if (!(entry.flags & (CCoinsCacheEntry::FRESH | CCoinsCacheEntry::REWRITE))) {
+        fTrackSpends = true;
+        vUnspentBefore.resize(entry.coins.vout.size());
+        for (unsigned int i = 0; i < entry.coins.vout.size(); i++)
+            vUnspentBefore[i] = !entry.coins.vout[i].IsNull();
+        fCoinBaseBefore = entry.coins.fCoinBase;
+        nHeightBefore = entry.coins.nHeight;
+        nVersionBefore = entry.coins.nVersion;
+    }
 }
 
 CCoinsModifier::~CCoinsModifier()
 {
     assert(cache.hasModifier);
     cache.hasModifier = false;
+    if (fTrackSpends) {
+        // Writing only has to remove the spent outputs from the base, unless outputs
+        // became unspent (as when undoing a spend) or the whole entry was replaced.
+        const CCoins &coins = it->second.coins;
+        bool fRewrite = coins.fCoinBase != fCoinBaseBefore || coins.nHeight != nHeightBefore || coins.nVersion != nVersionBefore;
+        for (unsigned int i = 0; i < coins.vout.size() && !fRewrite; i++)
+            fRewrite = !coins.vout[i].IsNull() && (i >= vUnspentBefore.size() || !vUnspentBefore[i]);
+        if (fRewrite)
+            it->second.flags |= CCoinsCacheEntry::REWRITE;
+    }
     it->second.coins.Cleanup();
     cache.cachedCoinsUsage -= cachedCoinUsage; // Subtract the old usage
     if ((it->second.flags & CCoinsCacheEntry::FRESH) && it->second.coins.IsPruned()) {
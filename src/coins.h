@@ -7,6 +7,7 @@
 #define BITCOIN_COINS_H
 
 #include "compressor.h"
+#include "flatmap.h"
 #include "memusage.h"
 #include "serialize.h"
 #include "uint256.h"
@@ -245,6 +246,18 @@ public:
         return (nPos < vout.size() && !vout[nPos].IsNull());
     }
 
+    //! copy output nPos to txout, and everything but the outputs to coins, if the output is available
+    bool GetOutput(unsigned int nPos, CCoins &coins, CTxOut &txout) const {
+        if (!IsAvailable(nPos))
+            return false;
+        coins.Clear();
+        coins.fCoinBase = fCoinBase;
+        coins.nHeight = nHeight;
+        coins.nVersion = nVersion;
+        txout = vout[nPos];
+        return true;
+    }
+
     //! check whether the entire CCoins is spent
     //! note that only !IsPruned() CCoins can be serialized
     bool IsPruned() const {
@@ -286,16 +299,39 @@ struct CCoinsCacheEntry
 {
     CCoins coins; // The actual cached data.
     unsigned char flags;
+    uint32_t nBaseOutputs; // The size of vout when the entry last matched the parent view (0 if FRESH).
 
     enum Flags {
         DIRTY = (1 << 0), // This cache entry is potentially different from the version in the parent view.
         FRESH = (1 << 1), // The parent view does not have this entry (or it is pruned).
+        ACCESSED = (1 << 2), // This cache entry was looked up since the last eviction pass.
+        REWRITE = (1 << 3), // Outputs became unspent or other fields changed since the entry last matched the parent view.
     };
 
-    CCoinsCacheEntry() : coins(), flags(0) {}
+    CCoinsCacheEntry() : coins(), flags(0), nBaseOutputs(0) {}
+
+    void swap(CCoinsCacheEntry &to) {
+        coins.swap(to.coins);
+        std::swap(flags, to.flags);
+        std::swap(nBaseOutputs, to.nBaseOutputs);
+    }
 };
 
-typedef boost::unordered_map<uint256, CCoinsCacheEntry, CCoinsKeyHasher> CCoinsMap;
+inline void swap(CCoinsCacheEntry &a, CCoinsCacheEntry &b) { a.swap(b); }
+
+/**
+ * The cache entries live in a flat open-addressing table rather than one heap node
+ * each, see flatmap.h. Pointers to entries remain valid while other entries are
+ * added or removed.
+ *
+ * This only removes the node allocation and bucket pointer of every entry. The
+ * outputs of an entry, and the script of every output, are still separate heap
+ * allocations owned by its CCoins, and make up most of the memory of the cache.
+ * Measured on 64-bit glibc with pay-to-pubkey-hash outputs, an entry takes 193,
+ * 273 or 353 bytes with 1, 2 or 3 outputs, against 216, 296 or 376 bytes in a
+ * boost::unordered_map: about 10% more coins fit in -dbcache, not twice as many.
+ */
+typedef flatmap<uint256, CCoinsCacheEntry, CCoinsKeyHasher> CCoinsMap;
 
 struct CCoinsStats
 {
@@ -318,6 +354,13 @@ public:
     //! Retrieve the CCoins (unspent transaction outputs) for a given txid
     virtual bool GetCoins(const uint256 &txid, CCoins &coins) const;
 
+    //! Retrieve a single unspent output, along with the other fields of the CCoins of its
+    //! transaction, whose outputs are left empty. Only that output needs to be read.
+    virtual bool GetCoin(const COutPoint &outpoint, CCoins &coins, CTxOut &txout) const;
+
+    //! Retrieve the CCoins for several txids at once, appending the ones found to vCoins
+    virtual void GetCoinsBatch(const std::vector<uint256> &vTxid, std::vector<std::pair<uint256, CCoins> > &vCoins) const;
+
     //! Just check whether we have data for a given txid.
     //! This may (but cannot always) return true for fully spent transactions
     virtual bool HaveCoins(const uint256 &txid) const;
@@ -329,6 +372,10 @@ public:
     //! The passed mapCoins can be modified.
     virtual bool BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock);
 
+    //! Do the same bulk modification as BatchWrite, leaving mapCoins untouched.
+    //! By default, the modified entries are copied and handed to BatchWrite.
+    virtual bool WriteCoins(const CCoinsMap &mapCoins, const uint256 &hashBlock);
+
     //! Calculate statistics about the unspent transaction output set
     virtual bool GetStats(CCoinsStats &stats) const;
 
@@ -346,10 +393,12 @@ protected:
 public:
     CCoinsViewBacked(CCoinsView *viewIn);
     bool GetCoins(const uint256 &txid, CCoins &coins) const;
+    bool GetCoin(const COutPoint &outpoint, CCoins &coins, CTxOut &txout) const;
     bool HaveCoins(const uint256 &txid) const;
     uint256 GetBestBlock() const;
     void SetBackend(CCoinsView &viewIn);
     bool BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock);
+    bool WriteCoins(const CCoinsMap &mapCoins, const uint256 &hashBlock);
     bool GetStats(CCoinsStats &stats) const;
 };
 
@@ -367,6 +416,14 @@ private:
     CCoinsViewCache& cache;
     CCoinsMap::iterator it;
     size_t cachedCoinUsage; // Cached memory usage of the CCoins object before modification
+    // Which outputs were unspent before modification, and the other fields, to tell
+    // whether the modification only spends outputs. Only kept if the entry is not marked
+    // FRESH or REWRITE yet.
+    bool fTrackSpends;
+    std::vector<bool> vUnspentBefore;
+    bool fCoinBaseBefore;
+    int nHeightBefore;
+    int nVersionBefore;
     CCoinsModifier(CCoinsViewCache& cache_, CCoinsMap::iterator it_, size_t usage);
 
 public:
@@ -400,10 +457,21 @@ public:
 
     // Standard CCoinsView methods
     bool GetCoins(const uint256 &txid, CCoins &coins) const;
+    //! Does not add the coins of the transaction to the cache, unlike GetCoins
+    bool GetCoin(const COutPoint &outpoint, CCoins &coins, CTxOut &txout) const;
+    void GetCoinsBatch(const std::vector<uint256> &vTxid, std::vector<std::pair<uint256, CCoins> > &vCoins) const;
     bool HaveCoins(const uint256 &txid) const;
     uint256 GetBestBlock() const;
     void SetBestBlock(const uint256 &hashBlock);
     bool BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock);
+    bool WriteCoins(const CCoinsMap &mapCoins, const uint256 &hashBlock);
+
+    /**
+     * Load the coins of all given txids that are not in the cache yet, fetching
+     * them from the base view in a single batch. Afterwards, accessing them does
+     * not have to go down to the base view one by one.
+     */
+    void PrefetchCoins(const std::vector<uint256> &vTxid) const;
 
     /**
      * Return a pointer to CCoins in the cache, or NULL if not found. This is
@@ -426,6 +494,22 @@ public:
      */
     bool Flush();
 
+    /**
+     * Push the modifications applied to this cache to its base, like Flush, but
+     * keep the entries in the cache as unmodified ones, so they can still be
+     * accessed without going to the base.
+     * If false is returned, the state of this cache (and its backing view) will be undefined.
+     */
+    bool Sync();
+
+    /**
+     * Remove unmodified entries until the memory usage of the cache drops to
+     * nMaxUsage. Entries that were not accessed since the previous call are
+     * removed first. This invalidates all pointers returned by AccessCoins, and
+     * must not be called while caches on top of this one hold modified entries.
+     */
+    void Evict(size_t nMaxUsage);
+
     //! Calculate the size of the cache (in number of transactions)
     unsigned int GetCacheSize() const;
 
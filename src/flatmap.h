@@ -0,0 +1,356 @@
+// Copyright (c) 2015 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_FLATMAP_H
+#define BITCOIN_FLATMAP_H
+
+#include "memusage.h"
+
+#include <assert.h>
+#include <new>
+#include <stdint.h>
+#include <utility>
+#include <vector>
+
+template <typename K, typename V, typename Hash>
+class flatmap;
+
+/** Iterator over a flatmap. Value is either the map's value_type or its const version. */
+template <typename Map, typename Value>
+class flatmap_iterator
+{
+private:
+    Map* map;
+    size_t nPos;
+    Value* ptr;
+
+    template <typename M, typename W> friend class flatmap_iterator;
+    template <typename K, typename V, typename Hash> friend class flatmap;
+
+    flatmap_iterator(Map* mapIn, size_t nPosIn, Value* ptrIn) : map(mapIn), nPos(nPosIn), ptr(ptrIn) {}
+
+public:
+    flatmap_iterator() : map(NULL), nPos(0), ptr(NULL) {}
+
+    //! Allow conversion from iterator to const_iterator
+    template <typename M, typename W>
+    flatmap_iterator(const flatmap_iterator<M, W>& other) : map(other.map), nPos(other.nPos), ptr(other.ptr) {}
+
+    Value& operator*() const { return *ptr; }
+    Value* operator->() const { return ptr; }
+
+    flatmap_iterator& operator++()
+    {
+        *this = map->template Next<flatmap_iterator>(nPos + 1);
+        return *this;
+    }
+
+    flatmap_iterator operator++(int)
+    {
+        flatmap_iterator ret = *this;
+        ++*this;
+        return ret;
+    }
+
+    template <typename M, typename W>
+    bool operator==(const flatmap_iterator<M, W>& other) const { return ptr == other.ptr; }
+    template <typename M, typename W>
+    bool operator!=(const flatmap_iterator<M, W>& other) const { return ptr != other.ptr; }
+};
+
+/**
+ * STL-like hash map with open addressing, for maps with many small entries.
+ * Memory the values allocate themselves is not affected.
+ *
+ * The hash table itself only holds a 32-bit tag of each key's hash and the index
+ * of the entry's slot, so a lookup scans a few adjacent buckets in one cache line
+ * before touching a single entry. The entries are stored in large chunks of slots
+ * instead of one heap allocation per node, and are never moved, so pointers and
+ * references to them stay valid until they are erased. Iterators may only be
+ * advanced as long as no element was inserted since they were obtained, but can
+ * always be dereferenced and erased.
+ */
+template <typename K, typename V, typename Hash>
+class flatmap
+{
+public:
+    typedef K key_type;
+    typedef V mapped_type;
+    typedef std::pair<const key_type, mapped_type> value_type;
+    typedef size_t size_type;
+    typedef flatmap_iterator<flatmap, value_type> iterator;
+    typedef flatmap_iterator<const flatmap, const value_type> const_iterator;
+
+private:
+    struct bucket {
+        uint32_t nTag;
+        uint32_t nSlot;
+    };
+
+    static const uint32_t SLOT_EMPTY = 0xFFFFFFFF;
+    static const uint32_t SLOT_DELETED = 0xFFFFFFFE;
+    static const size_t CHUNK_SIZE = 256;
+    static const size_t MIN_BUCKETS = 16;
+
+    Hash hasher;
+    std::vector<bucket> vBuckets;
+    std::vector<value_type*> vChunks;
+    std::vector<uint32_t> vFreeSlots;
+    uint32_t nSlotsUsed;
+    size_type nSize;
+    size_type nDeleted;
+
+    template <typename M, typename W> friend class flatmap_iterator;
+
+    // Not copyable; entries are referred to by address.
+    flatmap(const flatmap&);
+    flatmap& operator=(const flatmap&);
+
+    value_type* Slot(uint32_t nSlot) const
+    {
+        return vChunks[nSlot / CHUNK_SIZE] + nSlot % CHUNK_SIZE;
+    }
+
+    //! Return the first occupied position at or after nPos
+    template <typename It>
+    It Next(size_t nPos) const
+    {
+        while (nPos < vBuckets.size() && vBuckets[nPos].nSlot >= SLOT_DELETED)
+            nPos++;
+        if (nPos == vBuckets.size())
+            return It(const_cast<flatmap*>(this), nPos, NULL);
+        return It(const_cast<flatmap*>(this), nPos, Slot(vBuckets[nPos].nSlot));
+    }
+
+    //! Return the position of key k, or of the empty bucket where the search ended
+    size_t Lookup(const key_type& k, uint32_t nTag) const
+    {
+        size_t nMask = vBuckets.size() - 1;
+        for (size_t nPos = nTag & nMask; ; nPos = (nPos + 1) & nMask) {
+            const bucket& b = vBuckets[nPos];
+            if (b.nSlot == SLOT_EMPTY || (b.nSlot != SLOT_DELETED && b.nTag == nTag && Slot(b.nSlot)->first == k))
+                return nPos;
+        }
+    }
+
+    uint32_t Tag(const key_type& k) const
+    {
+        return (uint32_t)hasher(k);
+    }
+
+    uint32_t AllocateSlot()
+    {
+        if (!vFreeSlots.empty()) {
+            uint32_t nSlot = vFreeSlots.back();
+            vFreeSlots.pop_back();
+            return nSlot;
+        }
+        if (nSlotsUsed == vChunks.size() * CHUNK_SIZE)
+            vChunks.push_back(static_cast<value_type*>(::operator new(sizeof(value_type) * CHUNK_SIZE)));
+        assert(nSlotsUsed < SLOT_DELETED);
+        return nSlotsUsed++;
+    }
+
+    static size_t BucketsFor(size_type nEntries)
+    {
+        size_t nBuckets = MIN_BUCKETS;
+        while (nBuckets < nEntries * 2)
+            nBuckets *= 2;
+        return nBuckets;
+    }
+
+    //! Put a slot into the first free bucket of its probe sequence
+    void Place(uint32_t nTag, uint32_t nSlot)
+    {
+        size_t nMask = vBuckets.size() - 1;
+        size_t nPos = nTag & nMask;
+        while (vBuckets[nPos].nSlot != SLOT_EMPTY)
+            nPos = (nPos + 1) & nMask;
+        vBuckets[nPos].nTag = nTag;
+        vBuckets[nPos].nSlot = nSlot;
+    }
+
+    //! Rebuild the table with at least twice as many buckets as entries, dropping deleted markers
+    void Rehash(size_type nEntries)
+    {
+        std::vector<bucket> vOld;
+        vOld.swap(vBuckets);
+        bucket empty = {0, SLOT_EMPTY};
+        vBuckets.assign(BucketsFor(nEntries), empty);
+        for (size_t i = 0; i < vOld.size(); i++) {
+            if (vOld[i].nSlot < SLOT_DELETED)
+                Place(vOld[i].nTag, vOld[i].nSlot);
+        }
+        nDeleted = 0;
+    }
+
+public:
+    flatmap() : nSlotsUsed(0), nSize(0), nDeleted(0) {}
+    ~flatmap() { clear(); }
+
+    iterator begin() { return Next<iterator>(0); }
+    const_iterator begin() const { return Next<const_iterator>(0); }
+    iterator end() { return iterator(this, vBuckets.size(), NULL); }
+    const_iterator end() const { return const_iterator(this, vBuckets.size(), NULL); }
+    size_type size() const { return nSize; }
+    bool empty() const { return nSize == 0; }
+
+    iterator find(const key_type& k)
+    {
+        if (nSize == 0)
+            return end();
+        size_t nPos = Lookup(k, Tag(k));
+        if (vBuckets[nPos].nSlot == SLOT_EMPTY)
+            return end();
+        return iterator(this, nPos, Slot(vBuckets[nPos].nSlot));
+    }
+
+    const_iterator find(const key_type& k) const
+    {
+        return const_cast<flatmap*>(this)->find(k);
+    }
+
+    size_type count(const key_type& k) const
+    {
+        return find(k) != end();
+    }
+
+    std::pair<iterator, bool> insert(const value_type& x)
+    {
+        if ((nSize + nDeleted + 1) * 8 > vBuckets.size() * 7)
+            Rehash(nSize + 1);
+        uint32_t nTag = Tag(x.first);
+        size_t nPos = Lookup(x.first, nTag);
+        if (vBuckets[nPos].nSlot != SLOT_EMPTY)
+            return std::make_pair(iterator(this, nPos, Slot(vBuckets[nPos].nSlot)), false);
+        // Reuse the first deleted bucket on the probe sequence, if any
+        size_t nMask = vBuckets.size() - 1;
+        for (size_t i = nTag & nMask; i != nPos; i = (i + 1) & nMask) {
+            if (vBuckets[i].nSlot == SLOT_DELETED) {
+                nPos = i;
+                nDeleted--;
+                break;
+            }
+        }
+        uint32_t nSlot = AllocateSlot();
+        value_type* ptr = Slot(nSlot);
+        new (ptr) value_type(x);
+        vBuckets[nPos].nTag = nTag;
+        vBuckets[nPos].nSlot = nSlot;
+        nSize++;
+        return std::make_pair(iterator(this, nPos, ptr), true);
+    }
+
+    mapped_type& operator[](const key_type& k)
+    {
+        return insert(value_type(k, mapped_type())).first->second;
+    }
+
+    void erase(iterator it)
+    {
+        size_t nPos = it.nPos;
+        if (nPos >= vBuckets.size() || vBuckets[nPos].nSlot >= SLOT_DELETED || Slot(vBuckets[nPos].nSlot) != it.ptr) {
+            // The table was rebuilt since the iterator was obtained; look the entry up again.
+            nPos = Lookup(it->first, Tag(it->first));
+        }
+        uint32_t nSlot = vBuckets[nPos].nSlot;
+        assert(nSlot < SLOT_DELETED && Slot(nSlot) == it.ptr);
+        it.ptr->~value_type();
+        vFreeSlots.push_back(nSlot);
+        nSize--;
+        size_t nMask = vBuckets.size() - 1;
+        if (vBuckets[(nPos + 1) & nMask].nSlot == SLOT_EMPTY) {
+            // Nothing probes past this bucket, so it (and deleted buckets before it) can become empty.
+            vBuckets[nPos].nSlot = SLOT_EMPTY;
+            for (nPos = (nPos - 1) & nMask; vBuckets[nPos].nSlot == SLOT_DELETED; nPos = (nPos - 1) & nMask) {
+                vBuckets[nPos].nSlot = SLOT_EMPTY;
+                nDeleted--;
+            }
+        } else {
+            vBuckets[nPos].nSlot = SLOT_DELETED;
+            nDeleted++;
+        }
+    }
+
+    size_type erase(const key_type& k)
+    {
+        iterator it = find(k);
+        if (it == end())
+            return 0;
+        erase(it);
+        return 1;
+    }
+
+    void swap(flatmap& other)
+    {
+        std::swap(hasher, other.hasher);
+        vBuckets.swap(other.vBuckets);
+        vChunks.swap(other.vChunks);
+        vFreeSlots.swap(other.vFreeSlots);
+        std::swap(nSlotsUsed, other.nSlotsUsed);
+        std::swap(nSize, other.nSize);
+        std::swap(nDeleted, other.nDeleted);
+    }
+
+    //! Remove all entries, and release all memory held by the map
+    void clear()
+    {
+        for (size_t i = 0; i < vBuckets.size(); i++) {
+            if (vBuckets[i].nSlot < SLOT_DELETED)
+                Slot(vBuckets[i].nSlot)->~value_type();
+        }
+        for (size_t i = 0; i < vChunks.size(); i++)
+            ::operator delete(vChunks[i]);
+        std::vector<bucket>().swap(vBuckets);
+        std::vector<value_type*>().swap(vChunks);
+        std::vector<uint32_t>().swap(vFreeSlots);
+        nSlotsUsed = 0;
+        nSize = 0;
+        nDeleted = 0;
+    }
+
+    /**
+     * Move all entries into as few chunks as possible, and release the memory
+     * of the slots that were freed by erasing. The values are swapped into their
+     * new place, so mapped_type should have a cheap swap. Unlike all other
+     * operations, this invalidates pointers and references to the entries.
+     */
+    void shrink_to_fit()
+    {
+        if (nSize == 0) {
+            clear();
+            return;
+        }
+        std::vector<value_type*> vOldChunks;
+        vOldChunks.swap(vChunks);
+        std::vector<bucket> vOld;
+        vOld.swap(vBuckets);
+        std::vector<uint32_t>().swap(vFreeSlots);
+        nSlotsUsed = 0;
+        nDeleted = 0;
+        bucket empty = {0, SLOT_EMPTY};
+        vBuckets.assign(BucketsFor(nSize), empty);
+        for (size_t i = 0; i < vOld.size(); i++) {
+            if (vOld[i].nSlot >= SLOT_DELETED)
+                continue;
+            value_type* src = vOldChunks[vOld[i].nSlot / CHUNK_SIZE] + vOld[i].nSlot % CHUNK_SIZE;
+            uint32_t nSlot = AllocateSlot();
+            value_type* dst = new (Slot(nSlot)) value_type(src->first, mapped_type());
+            using std::swap;
+            swap(dst->second, src->second);
+            src->~value_type();
+            Place(vOld[i].nTag, nSlot);
+        }
+        for (size_t i = 0; i < vOldChunks.size(); i++)
+            ::operator delete(vOldChunks[i]);
+    }
+
+    size_t DynamicMemoryUsage() const
+    {
+        return memusage::MallocUsage(sizeof(value_type) * CHUNK_SIZE) * vChunks.size() +
+               memusage::DynamicUsage(vChunks) + memusage::DynamicUsage(vBuckets) + memusage::DynamicUsage(vFreeSlots);
+    }
+};
+
+#endif // BITCOIN_FLATMAP_H
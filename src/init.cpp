@@ -19,6 +19,7 @@
 #include "miner.h"
 #include "net.h"
 #include "rpcserver.h"
+#include "script/sigcache.h"
 #include "script/standard.h"
 #include "scheduler.h"
 #include "txdb.h"
@@ -132,11 +133,31 @@ public:
             abort();
         }
     }
+    bool GetCoin(const COutPoint &outpoint, CCoins &coins, CTxOut &txout) const {
+        try {
+            return CCoinsViewBacked::GetCoin(outpoint, coins, txout);
+        } catch(const std::runtime_error& e) {
+            uiInterface.ThreadSafeMessageBox(_("Error reading from database, shutting down."), "", CClientUIInterface::MSG_ERROR);
+            LogPrintf("Error reading from database: %s\n", e.what());
+            abort();
+        }
+    }
+    void GetCoinsBatch(const std::vector<uint256> &vTxid, std::vector<std::pair<uint256, CCoins> > &vCoins) const {
+        try {
+            base->GetCoinsBatch(vTxid, vCoins);
+        } catch(const std::runtime_error& e) {
+            uiInterface.ThreadSafeMessageBox(_("Error reading from database, shutting down."), "", CClientUIInterface::MSG_ERROR);
+            LogPrintf("Error reading from database: %s\n", e.what());
+            abort();
+        }
+    }
     // Writes do not need similar protection, as failure to write is handled by the caller.
 };
 
 static CCoinsViewDB *pcoinsdbview = NULL;
+static CCoinsViewBackgroundFlush *pcoinswriter = NULL;
 static CCoinsViewErrorCatcher *pcoinscatcher = NULL;
+static CCoinsViewPrefetch *pcoinsprefetch = NULL;
 
 void Shutdown()
 {
@@ -161,6 +182,9 @@ void Shutdown()
     StopNode();
     UnregisterNodeSignals(GetNodeSignals());
 
+    if (GetBoolArg("-persistmempool", DEFAULT_PERSIST_MEMPOOL))
+        DumpMempool();
+
     if (fFeeEstimatesInitialized)
     {
         boost::filesystem::path est_path = GetDataDir() / FEE_ESTIMATES_FILENAME;
@@ -177,10 +201,18 @@ void Shutdown()
         if (pcoinsTip != NULL) {
             FlushStateToDisk();
         }
+        if (pcoinswriter != NULL) {
+            // Normally the writer thread is gone already, and the flush above was synchronous
+            pcoinswriter->Wait();
+        }
         delete pcoinsTip;
         pcoinsTip = NULL;
+        delete pcoinsprefetch;
+        pcoinsprefetch = NULL;
         delete pcoinscatcher;
         pcoinscatcher = NULL;
+        delete pcoinswriter;
+        pcoinswriter = NULL;
         delete pcoinsdbview;
         pcoinsdbview = NULL;
         delete pblocktree;
@@ -269,6 +301,8 @@ std::string HelpMessage(HelpMessageMode mode)
     strUsage += HelpMessageOpt("-?", _("This help message"));
     strUsage += HelpMessageOpt("-alerts", strprintf(_("Receive and display P2P network alerts (default: %u)"), DEFAULT_ALERTS));
     strUsage += HelpMessageOpt("-alertnotify=<cmd>", _("Execute command when a relevant alert is received or we see a really long fork (%s in cmd is replaced by message)"));
+    strUsage += HelpMessageOpt("-blockpipelinedepth=<n>", strprintf(_("Read up to <n> blocks and their inputs in the background ahead of connecting them (0 to %d, default: %d)"),
+        MAX_BLOCK_PIPELINE_DEPTH, DEFAULT_BLOCK_PIPELINE_DEPTH));
     strUsage += HelpMessageOpt("-blocknotify=<cmd>", _("Execute command when the best block changes (%s in cmd is replaced by block hash)"));
     strUsage += HelpMessageOpt("-checkblocks=<n>", strprintf(_("How many blocks to check at startup (default: %u, 0 = all)"), 288));
     strUsage += HelpMessageOpt("-checklevel=<n>", strprintf(_("How thorough the block verification of -checkblocks is (0-4, default: %u)"), 3));
@@ -281,7 +315,13 @@ std::string HelpMessage(HelpMessageMode mode)
     }
     strUsage += HelpMessageOpt("-datadir=<dir>", _("Specify data directory"));
     strUsage += HelpMessageOpt("-dbcache=<n>", strprintf(_("Set database cache size in megabytes (%d to %d, default: %d)"), nMinDbCache, nMaxDbCache, nDefaultDbCache));
+    strUsage += HelpMessageOpt("-dbcachekeep=<n>", strprintf(_("When the in-memory UTXO set is full, only write modified entries and keep <n> percent of it cached (0 to %u, 0 = write and empty the whole cache, default: %u)"),
+        MAX_COINS_CACHE_KEEP, DEFAULT_COINS_CACHE_KEEP));
     strUsage += HelpMessageOpt("-loadblock=<file>", _("Imports blocks from external blk000??.dat file") + " " + _("on startup"));
+    strUsage += HelpMessageOpt("-maxmempool=<n>", strprintf(_("Keep the transaction memory pool below <n> megabytes (default: %u)"), DEFAULT_MAX_MEMPOOL_SIZE));
+    strUsage += HelpMessageOpt("-mempoolexpiry=<n>", strprintf(_("Do not keep transactions in the mempool longer than <n> hours (default: %u)"), DEFAULT_MEMPOOL_EXPIRY));
+    strUsage += HelpMessageOpt("-persistmempool", strprintf(_("Whether to save the mempool on shutdown and load on restart (default: %u)"), DEFAULT_PERSIST_MEMPOOL));
+    strUsage += HelpMessageOpt("-dumpmempoolinterval=<n>", strprintf(_("Also save the mempool every <n> minutes, 0 to only save it on shutdown (default: %u)"), DEFAULT_DUMP_MEMPOOL_INTERVAL));
     strUsage += HelpMessageOpt("-maxorphantx=<n>", strprintf(_("Keep at most <n> unconnectable transactions in memory (default: %u)"), DEFAULT_MAX_ORPHAN_TRANSACTIONS));
     strUsage += HelpMessageOpt("-par=<n>", strprintf(_("Set the number of script verification threads (%u to %d, 0 = auto, <0 = leave that many cores free, default: %d)"),
         -(int)boost::thread::hardware_concurrency(), MAX_SCRIPTCHECK_THREADS, DEFAULT_SCRIPTCHECK_THREADS));
@@ -296,6 +336,8 @@ std::string HelpMessage(HelpMessageMode mode)
     strUsage += HelpMessageOpt("-sysperms", _("Create new files with system default permissions, instead of umask 077 (only effective with disabled wallet functionality)"));
 #endif
     strUsage += HelpMessageOpt("-txindex", strprintf(_("Maintain a full transaction index, used by the getrawtransaction rpc call (default: %u)"), 0));
+    strUsage += HelpMessageOpt("-addrindex", strprintf(_("Maintain an address index, used by the searchrawtransactions, listallunspent and getallbalance rpc calls; when enabled on an existing node, it is built in the background (default: %u)"), 0));
+    strUsage += HelpMessageOpt("-addrsummary", strprintf(_("Maintain a summary of the history of each address in the address index, used by the getaddresssummary rpc call; toggling it rebuilds the address index (default: %u)"), 0));
 
     strUsage += HelpMessageGroup(_("Connection options:"));
     strUsage += HelpMessageOpt("-addnode=<ip>", _("Add a node to connect to and attempt to keep the connection open"));
@@ -382,9 +424,14 @@ std::string HelpMessage(HelpMessageMode mode)
     strUsage += HelpMessageOpt("-logtimestamps", strprintf(_("Prepend debug output with timestamp (default: %u)"), 1));
     if (showDebug)
     {
+        strUsage += HelpMessageOpt("-limitancestorcount=<n>", strprintf("Do not accept transactions if number of in-mempool ancestors is <n> or more (default: %u)", DEFAULT_ANCESTOR_LIMIT));
+        strUsage += HelpMessageOpt("-limitancestorsize=<n>", strprintf("Do not accept transactions whose size with all in-mempool ancestors exceeds <n> kilobytes (default: %u)", DEFAULT_ANCESTOR_SIZE_LIMIT));
+        strUsage += HelpMessageOpt("-limitdescendantcount=<n>", strprintf("Do not accept transactions if any ancestor would have <n> or more in-mempool descendants (default: %u)", DEFAULT_DESCENDANT_LIMIT));
+        strUsage += HelpMessageOpt("-limitdescendantsize=<n>", strprintf("Do not accept transactions if any ancestor would have more than <n> kilobytes of in-mempool descendants (default: %u)", DEFAULT_DESCENDANT_SIZE_LIMIT));
         strUsage += HelpMessageOpt("-limitfreerelay=<n>", strprintf("Continuously rate-limit free transactions to <n>*1000 bytes per minute (default: %u)", 15));
         strUsage += HelpMessageOpt("-relaypriority", strprintf("Require high priority for relaying free or low-fee transactions (default: %u)", 1));
-        strUsage += HelpMessageOpt("-maxsigcachesize=<n>", strprintf("Limit size of signature cache to <n> entries (default: %u)", 50000));
+        strUsage += HelpMessageOpt("-maxsigcachemb=<n>", strprintf("Limit size of signature cache to <n> MiB (default: %u)", DEFAULT_MAX_SIG_CACHE_SIZE));
+        strUsage += HelpMessageOpt("-maxsigcachesize=<n>", "Limit size of signature cache to <n> entries (overrides -maxsigcachemb)");
     }
     strUsage += HelpMessageOpt("-minrelaytxfee=<amt>", strprintf(_("Fees (in BTC/Kb) smaller than this are considered zero fee for relaying (default: %s)"), FormatMoney(::minRelayTxFee.GetFeePerK())));
     strUsage += HelpMessageOpt("-printtoconsole", _("Send trace/debug info to console instead of debug.log file"));
@@ -572,6 +619,9 @@ void ThreadImport(std::vector<boost::filesystem::path> vImportFiles)
         LogPrintf("Stopping after block import\n");
         StartShutdown();
     }
+
+    if (GetBoolArg("-persistmempool", DEFAULT_PERSIST_MEMPOOL))
+        LoadMempool();
 }
 
 /** Sanity checks
@@ -787,6 +837,8 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
     else if (nScriptCheckThreads > MAX_SCRIPTCHECK_THREADS)
         nScriptCheckThreads = MAX_SCRIPTCHECK_THREADS;
 
+    nBlockPipelineDepth = std::max(0, std::min((int)GetArg("-blockpipelinedepth", DEFAULT_BLOCK_PIPELINE_DEPTH), MAX_BLOCK_PIPELINE_DEPTH));
+
     fServer = GetBoolArg("-server", false);
 
     // block pruning; get the amount of disk space (in MB) to allot for block & undo files
@@ -826,6 +878,13 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
             return InitError(strprintf(_("Invalid amount for -minrelaytxfee=<amount>: '%s'"), mapArgs["-minrelaytxfee"]));
     }
 
+    // The mempool has to hold a good number of maximum size packages, or
+    // trimming it would evict everything else for every one of them
+    int64_t nMempoolSizeLimit = GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000;
+    int64_t nMempoolDescendantSizeLimit = GetArg("-limitdescendantsize", DEFAULT_DESCENDANT_SIZE_LIMIT) * 1000;
+    if (nMempoolSizeLimit < 0 || nMempoolSizeLimit < nMempoolDescendantSizeLimit * 40)
+        return InitError(strprintf(_("-maxmempool must be at least %d MB"), GetArg("-limitdescendantsize", DEFAULT_DESCENDANT_SIZE_LIMIT) / 25));
+
 #ifdef ENABLE_WALLET
     if (mapArgs.count("-mintxfee"))
     {
@@ -924,8 +983,11 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
 
     LogPrintf("Using %u threads for script verification\n", nScriptCheckThreads);
     if (nScriptCheckThreads) {
-        for (int i=0; i<nScriptCheckThreads-1; i++)
+        for (int i=0; i<nScriptCheckThreads-1; i++) {
             threadGroup.create_thread(&ThreadScriptCheck);
+            // as many threads read the inputs of a block from the coin database
+            threadGroup.create_thread(&ThreadCoinsRead);
+        }
     }
 
     // Start the lightweight task scheduler thread
@@ -1108,6 +1170,7 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
     int64_t nCoinDBCache = std::min(nTotalCache / 2, (nTotalCache / 4) + (1 << 23)); // use 25%-50% of the remainder for disk cache
     nTotalCache -= nCoinDBCache;
     nCoinCacheUsage = nTotalCache; // the rest goes to in-memory cache
+    nCoinCacheKeep = std::min((unsigned int)std::max(GetArg("-dbcachekeep", DEFAULT_COINS_CACHE_KEEP), (int64_t)0), MAX_COINS_CACHE_KEEP);
     LogPrintf("Cache configuration:\n");
     LogPrintf("* Using %.1fMiB for block index database\n", nBlockTreeDBCache * (1.0 / 1024 / 1024));
     LogPrintf("* Using %.1fMiB for chain state database\n", nCoinDBCache * (1.0 / 1024 / 1024));
@@ -1125,14 +1188,23 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
             try {
                 UnloadBlockIndex();
                 delete pcoinsTip;
+                delete pcoinsprefetch;
                 delete pcoinsdbview;
+                delete pcoinswriter;
                 delete pcoinscatcher;
                 delete pblocktree;
 
                 pblocktree = new CBlockTreeDB(nBlockTreeDBCache, false, fReindex);
                 pcoinsdbview = new CCoinsViewDB(nCoinDBCache, false, fReindex);
-                pcoinscatcher = new CCoinsViewErrorCatcher(pcoinsdbview);
-                pcoinsTip = new CCoinsViewCache(pcoinscatcher);
+                pcoinswriter = new CCoinsViewBackgroundFlush(pcoinsdbview);
+                pcoinscatcher = new CCoinsViewErrorCatcher(pcoinswriter);
+                pcoinsprefetch = new CCoinsViewPrefetch(pcoinscatcher, std::max(nBlockPipelineDepth, 1) * MAX_PREFETCH_COINS_PER_BLOCK);
+                pcoinsTip = new CCoinsViewCache(pcoinsprefetch);
+
+                if (!pcoinsdbview->Upgrade()) {
+                    strLoadError = _("Error upgrading chainstate database");
+                    break;
+                }
 
                 if (fReindex) {
                     pblocktree->WriteReindexing(true);
@@ -1163,11 +1235,12 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
                     break;
                 }
 
-                // Check for changed -addrindex state
-                if (fAddrIndex != GetBoolArg("-addrindex", false)) {
-                    strLoadError = _("You need to rebuild the database using -reindex to change -addrindex");
+                // Enable or disable the address index, which is built in the background
+                if (!InitAddrIndex(GetBoolArg("-addrindex", false), GetBoolArg("-addrsummary", false))) {
+                    strLoadError = _("Error initializing address index");
                     break;
                 }
+                mempool.setAddrIndex(fAddrIndex);
 
                 // Check for changed -prune state.  What we are concerned about is a user who has pruned blocks
                 // in the past, but is now trying to run unpruned.
@@ -1402,7 +1475,19 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
         BOOST_FOREACH(string strFile, mapMultiArgs["-loadblock"])
             vImportFiles.push_back(strFile);
     }
+    // Chainstate writes happen in the background from now on
+    threadGroup.create_thread(boost::bind(&ThreadCoinsWrite, pcoinswriter));
+    if (nBlockPipelineDepth > 0)
+        threadGroup.create_thread(boost::bind(&ThreadBlockPipeline, pcoinsprefetch));
     threadGroup.create_thread(boost::bind(&ThreadImport, vImportFiles));
+    if (fAddrIndex) {
+        // address identifiers are extracted by as many threads as scripts are verified
+        if (nScriptCheckThreads) {
+            for (int i=0; i<nScriptCheckThreads-1; i++)
+                threadGroup.create_thread(&ThreadAddrIndexExtract);
+        }
+        threadGroup.create_thread(&ThreadAddrIndex);
+    }
     if (chainActive.Tip() == NULL) {
         LogPrintf("Waiting for genesis block to be imported...\n");
         while (!fRequestShutdown && chainActive.Tip() == NULL)
@@ -1436,6 +1521,11 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
                                          boost::ref(cs_main), boost::cref(pindexBestHeader), nPowTargetSpacing);
     scheduler.scheduleEvery(f, nPowTargetSpacing);
 
+    // Save the mempool periodically as well, so it survives a crash
+    int64_t nDumpMempoolInterval = GetArg("-dumpmempoolinterval", DEFAULT_DUMP_MEMPOOL_INTERVAL);
+    if (GetBoolArg("-persistmempool", DEFAULT_PERSIST_MEMPOOL) && nDumpMempoolInterval > 0)
+        scheduler.scheduleEvery(&DumpMempool, nDumpMempoolInterval * 60);
+
 #ifdef ENABLE_WALLET
     // Generate coins in the background
     if (pwalletMain)
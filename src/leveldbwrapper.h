@@ -59,6 +59,16 @@ public:
 
         batch.Delete(slKey);
     }
+
+    void EraseRaw(const leveldb::Slice& slKey)
+    {
+        batch.Delete(slKey);
+    }
+
+    void Clear()
+    {
+        batch.Clear();
+    }
 };
 
 class CLevelDBWrapper
@@ -168,6 +178,12 @@ public:
     {
         return pdb->NewIterator(iteroptions);
     }
+
+    //! Iterator for reading a few neighbouring entries, which uses the block cache like Read does
+    leveldb::Iterator* NewReadIterator() const
+    {
+        return pdb->NewIterator(readoptions);
+    }
 };
 
 #endif // BITCOIN_LEVELDBWRAPPER_H
@@ -52,16 +52,19 @@ int64_t nTimeBestReceived = 0;
 CWaitableCriticalSection csBestBlock;
 CConditionVariable cvBlockChange;
 int nScriptCheckThreads = 0;
+int nBlockPipelineDepth = 0;
 bool fImporting = false;
 bool fReindex = false;
 bool fTxIndex = false;
 bool fAddrIndex = false;
+bool fAddrSummary = false;
 bool fHavePruned = false;
 bool fPruneMode = false;
 bool fIsBareMultisigStd = true;
 bool fCheckBlockIndex = false;
 bool fCheckpointsEnabled = true;
 size_t nCoinCacheUsage = 5000 * 300;
+unsigned int nCoinCacheKeep = DEFAULT_COINS_CACHE_KEEP;
 uint64_t nPruneTarget = 0;
 bool fAlerts = DEFAULT_ALERTS;
 
@@ -908,8 +911,17 @@ CAmount GetMinRelayFee(const CTransaction& tx, unsigned int nBytes, bool fAllowF
 }
 
 
-bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransaction &tx, bool fLimitFree,
-                        bool* pfMissingInputs, bool fRejectAbsurdFee)
+/** Expire old transactions from the mempool, and trim it to its size limit */
+static void LimitMempoolSize(CTxMemPool& pool, size_t limit, unsigned long age)
+{
+    int expired = pool.Expire(GetTime() - age);
+    if (expired != 0)
+        LogPrint("mempool", "Expired %i transactions from the memory pool\n", expired);
+    pool.TrimToSize(limit);
+}
+
+bool AcceptToMemoryPoolWithTime(CTxMemPool& pool, CValidationState &state, const CTransaction &tx, bool fLimitFree,
+                                bool* pfMissingInputs, int64_t nAcceptTime, bool fRejectAbsurdFee, bool fOverrideMempoolLimit)
 {
     AssertLockHeld(cs_main);
     if (pfMissingInputs)
@@ -1016,7 +1028,7 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransa
         CAmount nFees = nValueIn-nValueOut;
         double dPriority = view.GetPriority(tx, chainActive.Height());
 
-        CTxMemPoolEntry entry(tx, nFees, GetTime(), dPriority, chainActive.Height(), mempool.HasNoInputsOf(tx));
+        CTxMemPoolEntry entry(tx, nFees, nAcceptTime, dPriority, chainActive.Height(), mempool.HasNoInputsOf(tx));
         unsigned int nSize = entry.GetTxSize();
 
         // Don't accept it if it can't get into a block
@@ -1026,6 +1038,18 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransa
                                       hash.ToString(), nFees, txMinFee),
                              REJECT_INSUFFICIENTFEE, "insufficient fee");
 
+        // Once the pool has been full, don't accept transactions paying less than what was evicted
+        if (!fOverrideMempoolLimit) {
+            double dPriorityDelta = 0;
+            CAmount nFeeDelta = 0;
+            pool.ApplyDeltas(hash, dPriorityDelta, nFeeDelta);
+            CAmount mempoolRejectFee = pool.GetMinFee(GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000).GetFee(nSize);
+            if (mempoolRejectFee > 0 && nFees + nFeeDelta < mempoolRejectFee)
+                return state.DoS(0, error("AcceptToMemoryPool: mempool min fee not met %s, %d < %d",
+                                          hash.ToString(), nFees + nFeeDelta, mempoolRejectFee),
+                                 REJECT_INSUFFICIENTFEE, "mempool min fee not met");
+        }
+
         // Require that free transactions have sufficient priority to be mined in the next block.
         if (GetBoolArg("-relaypriority", true) && nFees < ::minRelayTxFee.GetFee(nSize) && !AllowFree(view.GetPriority(tx, chainActive.Height() + 1))) {
             return state.DoS(0, false, REJECT_INSUFFICIENTFEE, "insufficient priority");
@@ -1060,9 +1084,22 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransa
                          hash.ToString(),
                          nFees, ::minRelayTxFee.GetFee(nSize) * 10000);
 
+        // Calculate in-mempool ancestors, up to a limit. Long chains of unconfirmed
+        // transactions make every change to them expensive to track.
+        CTxMemPool::setEntries setAncestors;
+        size_t nLimitAncestors = GetArg("-limitancestorcount", DEFAULT_ANCESTOR_LIMIT);
+        size_t nLimitAncestorSize = GetArg("-limitancestorsize", DEFAULT_ANCESTOR_SIZE_LIMIT)*1000;
+        size_t nLimitDescendants = GetArg("-limitdescendantcount", DEFAULT_DESCENDANT_LIMIT);
+        size_t nLimitDescendantSize = GetArg("-limitdescendantsize", DEFAULT_DESCENDANT_SIZE_LIMIT)*1000;
+        std::string errString;
+        if (!pool.CalculateMemPoolAncestors(entry, setAncestors, nLimitAncestors, nLimitAncestorSize, nLimitDescendants, nLimitDescendantSize, errString))
+            return state.DoS(0, error("AcceptToMemoryPool: %s %s", hash.ToString(), errString),
+                             REJECT_NONSTANDARD, "too-long-mempool-chain");
+
         // Check against previous transactions
         // This is done last to help prevent CPU exhaustion denial-of-service attacks.
-        if (!CheckInputs(tx, state, view, true, STANDARD_SCRIPT_VERIFY_FLAGS, true))
+        PrecomputedTransactionData txdata(tx);
+        if (!CheckInputs(tx, state, view, true, STANDARD_SCRIPT_VERIFY_FLAGS, true, NULL, &txdata))
         {
             return error("AcceptToMemoryPool: ConnectInputs failed %s", hash.ToString());
         }
@@ -1076,13 +1113,21 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransa
         // There is a similar check in CreateNewBlock() to prevent creating
         // invalid blocks, however allowing such transactions into the mempool
         // can be exploited as a DoS attack.
-        if (!CheckInputs(tx, state, view, true, MANDATORY_SCRIPT_VERIFY_FLAGS, true))
+        if (!CheckInputs(tx, state, view, true, MANDATORY_SCRIPT_VERIFY_FLAGS, true, NULL, &txdata))
         {
             return error("AcceptToMemoryPool: BUG! PLEASE REPORT THIS! ConnectInputs failed against MANDATORY but not STANDARD flags %s", hash.ToString());
         }
+        entry.SetInputsVerified(nSigOps);
 
         // Store transaction in memory
-        pool.addUnchecked(hash, entry, !IsInitialBlockDownload());
+        pool.addUnchecked(hash, entry, setAncestors, !IsInitialBlockDownload(), &view);
+
+        // Make room for it, unless the caller trims the pool itself
+        if (!fOverrideMempoolLimit) {
+            LimitMempoolSize(pool, GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000, GetArg("-mempoolexpiry", DEFAULT_MEMPOOL_EXPIRY) * 60 * 60);
+            if (!pool.exists(hash))
+                return state.DoS(0, false, REJECT_INSUFFICIENTFEE, "mempool full");
+        }
     }
 
     SyncWithWallets(tx, NULL);
@@ -1090,6 +1135,12 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransa
     return true;
 }
 
+bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransaction &tx, bool fLimitFree,
+                        bool* pfMissingInputs, bool fRejectAbsurdFee, bool fOverrideMempoolLimit)
+{
+    return AcceptToMemoryPoolWithTime(pool, state, tx, fLimitFree, pfMissingInputs, GetTime(), fRejectAbsurdFee, fOverrideMempoolLimit);
+}
+
 bool ReadTransaction(CTransaction& tx, const CDiskTxPos& pos, uint256& hashBlock) {
     CAutoFile file(OpenBlockFile(pos, true), SER_DISK, CLIENT_VERSION);
     if (file.IsNull())
@@ -1106,8 +1157,67 @@ bool ReadTransaction(CTransaction& tx, const CDiskTxPos& pos, uint256& hashBlock
     return true;
 }
 
-bool FindTransactionsByDestination(const CTxDestination& dest, std::set<CExtDiskTxPos>& setpos) {
-    uint160 addrid;
+/** Orders indexes into a vector of transaction positions by the position on disk */
+struct CompareTxPosIndex
+{
+    const std::vector<CDiskTxPos>& vpos;
+    CompareTxPosIndex(const std::vector<CDiskTxPos>& vposIn) : vpos(vposIn) {}
+
+    bool operator()(size_t a, size_t b) const
+    {
+        return vpos[a] < vpos[b];
+    }
+};
+
+bool ReadTransactions(const std::vector<CDiskTxPos>& vpos, std::vector<CTransaction>& vtx, std::vector<uint256>& vhashBlock) {
+    vtx.resize(vpos.size());
+    vhashBlock.resize(vpos.size());
+
+    // Read in the order of the files and positions within, so that every file is opened
+    // once, every block header is read once, and reading proceeds forward within a file
+    std::vector<size_t> vOrder(vpos.size());
+    for (size_t i = 0; i < vOrder.size(); i++)
+        vOrder[i] = i;
+    std::sort(vOrder.begin(), vOrder.end(), CompareTxPosIndex(vpos));
+
+    size_t i = 0;
+    while (i < vOrder.size()) {
+        const int nFile = vpos[vOrder[i]].nFile;
+        CAutoFile file(OpenBlockFile(CDiskBlockPos(nFile, 0), true), SER_DISK, CLIENT_VERSION);
+        if (file.IsNull())
+            return error("%s: OpenBlockFile failed", __func__);
+        try {
+            for (; i < vOrder.size() && vpos[vOrder[i]].nFile == nFile; i++) {
+                const CDiskTxPos& pos = vpos[vOrder[i]];
+                if (i > 0 && vpos[vOrder[i-1]] == pos) {
+                    // Same transaction as before
+                    vtx[vOrder[i]] = vtx[vOrder[i-1]];
+                    vhashBlock[vOrder[i]] = vhashBlock[vOrder[i-1]];
+                    continue;
+                }
+                if (i > 0 && vpos[vOrder[i-1]].nFile == nFile && vpos[vOrder[i-1]].nPos == pos.nPos) {
+                    // Same block as before
+                    vhashBlock[vOrder[i]] = vhashBlock[vOrder[i-1]];
+                } else {
+                    CBlockHeader header;
+                    if (fseek(file.Get(), pos.nPos, SEEK_SET))
+                        return error("%s: fseek failed", __func__);
+                    file >> header;
+                    vhashBlock[vOrder[i]] = header.GetHash();
+                }
+                if (fseek(file.Get(), pos.nPos + ::GetSerializeSize(CBlockHeader(), SER_DISK, CLIENT_VERSION) + pos.nTxOffset, SEEK_SET))
+                    return error("%s: fseek failed", __func__);
+                file >> vtx[vOrder[i]];
+            }
+        } catch (const std::exception& e) {
+            return error("%s: Deserialize or I/O error - %s", __func__, e.what());
+        }
+    }
+    return true;
+}
+
+/** Map a destination to the identifier it is stored under in the address index */
+static bool GetAddrIndexId(const CTxDestination& dest, uint160& addrid) {
     const CKeyID *pkeyid = boost::get<CKeyID>(&dest);
     if (pkeyid)
         addrid = static_cast<uint160>(*pkeyid);
@@ -1116,7 +1226,12 @@ bool FindTransactionsByDestination(const CTxDestination& dest, std::set<CExtDisk
         if (pscriptid)
             addrid = static_cast<uint160>(*pscriptid);
     }
-    if (addrid.IsNull())
+    return !addrid.IsNull();
+}
+
+bool FindTransactionsByDestination(const CTxDestination& dest, std::set<CExtDiskTxPos>& setpos) {
+    uint160 addrid;
+    if (!GetAddrIndexId(dest, addrid))
         return false;
 
     LOCK(cs_main);
@@ -1129,6 +1244,62 @@ bool FindTransactionsByDestination(const CTxDestination& dest, std::set<CExtDisk
     return true;
 }
 
+static bool GetAddrIndexIds(const std::set<CTxDestination>& setDest, std::vector<uint160>& vAddrIds)
+{
+    vAddrIds.reserve(setDest.size());
+    BOOST_FOREACH(const CTxDestination& dest, setDest) {
+        uint160 addrid;
+        if (!GetAddrIndexId(dest, addrid))
+            return false;
+        vAddrIds.push_back(addrid);
+    }
+    return true;
+}
+
+bool FindTransactionsByDestination(const std::set<CTxDestination>& setDest, std::vector<CExtDiskTxPos>& vpos, const CExtDiskTxPos& posStart, size_t nMaxResults) {
+    std::vector<uint160> vAddrIds;
+    if (!GetAddrIndexIds(setDest, vAddrIds))
+        return false;
+
+    LOCK(cs_main);
+    if (!fAddrIndex)
+        return false;
+    return pblocktree->ReadAddrIndex(vAddrIds, vpos, posStart, nMaxResults);
+}
+
+bool FindMempoolTransactionsByDestination(const std::set<CTxDestination>& setDest, std::vector<CTransaction>& vtx) {
+    std::vector<uint160> vAddrIds;
+    if (!GetAddrIndexIds(setDest, vAddrIds))
+        return false;
+
+    mempool.queryAddrIndex(vAddrIds, vtx);
+    return true;
+}
+
+bool FindUnspentByDestination(const std::set<CTxDestination>& setDest, std::vector<std::pair<COutPoint, CAddrUnspentValue> >& vUnspent) {
+    std::vector<uint160> vAddrIds;
+    if (!GetAddrIndexIds(setDest, vAddrIds))
+        return false;
+
+    LOCK(cs_main);
+    if (!fAddrIndex)
+        return false;
+    return pblocktree->ReadAddrUnspentIndex(vAddrIds, vUnspent);
+}
+
+bool GetAddrSummaryByDestination(const CTxDestination& dest, CAddrSummary& summary) {
+    uint160 addrid;
+    if (!GetAddrIndexId(dest, addrid))
+        return false;
+
+    LOCK(cs_main);
+    if (!fAddrSummary)
+        return false;
+    if (!pblocktree->ReadAddrSummary(addrid, summary))
+        summary.SetNull();
+    return true;
+}
+
 /** Return transaction in tx, and if it was found inside a block, its hash is placed in hashBlock */
 bool GetTransaction(const uint256 &hash, CTransaction &txOut, uint256 &hashBlock, bool fAllowSlow)
 {
@@ -1447,13 +1618,13 @@ void UpdateCoins(const CTransaction& tx, CValidationState &state, CCoinsViewCach
 
 bool CScriptCheck::operator()() {
     const CScript &scriptSig = ptxTo->vin[nIn].scriptSig;
-    if (!VerifyScript(scriptSig, scriptPubKey, nFlags, CachingTransactionSignatureChecker(ptxTo, nIn, cacheStore), &error)) {
+    if (!VerifyScript(scriptSig, scriptPubKey, nFlags, CachingTransactionSignatureChecker(ptxTo, nIn, cacheStore, txdata), &error)) {
         return ::error("CScriptCheck(): %s:%d VerifySignature failed: %s", ptxTo->GetHash().ToString(), nIn, ScriptErrorString(error));
     }
     return true;
 }
 
-bool CheckInputs(const CTransaction& tx, CValidationState &state, const CCoinsViewCache &inputs, bool fScriptChecks, unsigned int flags, bool cacheStore, std::vector<CScriptCheck> *pvChecks)
+bool CheckInputs(const CTransaction& tx, CValidationState &state, const CCoinsViewCache &inputs, bool fScriptChecks, unsigned int flags, bool cacheStore, std::vector<CScriptCheck> *pvChecks, const PrecomputedTransactionData* txdata)
 {
     if (!tx.IsCoinBase())
     {
@@ -1522,7 +1693,7 @@ bool CheckInputs(const CTransaction& tx, CValidationState &state, const CCoinsVi
                 assert(coins);
 
                 // Verify signature
-                CScriptCheck check(*coins, tx, i, flags, cacheStore);
+                CScriptCheck check(*coins, tx, i, flags, cacheStore, txdata);
                 if (pvChecks) {
                     pvChecks->push_back(CScriptCheck());
                     check.swap(pvChecks->back());
@@ -1535,7 +1706,7 @@ bool CheckInputs(const CTransaction& tx, CValidationState &state, const CCoinsVi
                         // avoid splitting the network between upgraded and
                         // non-upgraded nodes.
                         CScriptCheck check(*coins, tx, i,
-                                flags & ~STANDARD_NOT_MANDATORY_VERIFY_FLAGS, cacheStore);
+                                flags & ~STANDARD_NOT_MANDATORY_VERIFY_FLAGS, cacheStore, txdata);
                         if (check())
                             return state.Invalid(false, REJECT_NONSTANDARD, strprintf("non-mandatory-script-verify-flag (%s)", ScriptErrorString(check.GetScriptError())));
                     }
@@ -1664,6 +1835,290 @@ static bool ApplyTxInUndo(const CTxInUndo& undo, CCoinsViewCache& view, const CO
     return fClean;
 }
 
+/**
+ * Last block of the active chain whose effects are included in the address index,
+ * or NULL if no block was indexed yet. Protected by cs_main.
+ */
+static CBlockIndex* pindexAddrIndex = NULL;
+/** Whether an address index in an outdated format must be erased before it can be built. Protected by cs_main. */
+static bool fAddrIndexWipe = false;
+
+/** Whether the address index includes the effects of all blocks up to and including pindex */
+static bool AddrIndexIsAt(const CBlockIndex* pindex)
+{
+    if (fAddrIndexWipe)
+        return false;
+    // The genesis block is never connected, so it has no entries
+    if (pindexAddrIndex == NULL)
+        return pindex == NULL || pindex->nHeight == 0;
+    return pindexAddrIndex == pindex;
+}
+
+// Index either: a) every data push >= 8 bytes,  b) if no such pushes, the entire script
+void ExtractAddrIds(const CScript &script, std::vector<uint160> &out) {
+    CScript::const_iterator pc = script.begin();
+    CScript::const_iterator pend = script.end();
+    std::vector<unsigned char> data;
+    opcodetype opcode;
+    bool fHaveData = false;
+    while (pc < pend) {
+        script.GetOp(pc, opcode, data);
+        if (0 <= opcode && opcode <= OP_PUSHDATA4 && data.size() >= 8) { // data element
+            uint160 addrid;
+            if (data.size() <= 20) {
+                memcpy(&addrid, &data[0], data.size());
+            } else {
+                addrid = Hash160(data);
+            }
+            out.push_back(addrid);
+            fHaveData = true;
+        }
+    }
+    if (!fHaveData) {
+        uint160 addrid = Hash160(script);
+        out.push_back(addrid);
+    }
+}
+
+/** Address identifiers of the spent and created outputs of a transaction */
+struct CTxAddrIds
+{
+    std::vector<std::vector<uint160> > vPrevout;
+    std::vector<std::vector<uint160> > vOut;
+};
+
+void static ExtractAddrIds(const CTransaction &tx, const CTxUndo *ptxundo, CTxAddrIds &addrIds) {
+    if (ptxundo) {
+        addrIds.vPrevout.resize(ptxundo->vprevout.size());
+        for (unsigned int j = 0; j < ptxundo->vprevout.size(); j++)
+            ExtractAddrIds(ptxundo->vprevout[j].txout.scriptPubKey, addrIds.vPrevout[j]);
+    }
+    addrIds.vOut.resize(tx.vout.size());
+    for (unsigned int n = 0; n < tx.vout.size(); n++)
+        ExtractAddrIds(tx.vout[n].scriptPubKey, addrIds.vOut[n]);
+}
+
+/** Closure representing the extraction of the address identifiers of one transaction */
+class CAddrIdsCheck
+{
+private:
+    const CTransaction *ptx;
+    const CTxUndo *ptxundo;
+    CTxAddrIds *pAddrIds;
+
+public:
+    CAddrIdsCheck(): ptx(NULL), ptxundo(NULL), pAddrIds(NULL) {}
+    CAddrIdsCheck(const CTransaction &txIn, const CTxUndo *ptxundoIn, CTxAddrIds &addrIdsIn) :
+        ptx(&txIn), ptxundo(ptxundoIn), pAddrIds(&addrIdsIn) { }
+
+    bool operator()() {
+        ExtractAddrIds(*ptx, ptxundo, *pAddrIds);
+        return true;
+    }
+
+    void swap(CAddrIdsCheck &check) {
+        std::swap(ptx, check.ptx);
+        std::swap(ptxundo, check.ptxundo);
+        std::swap(pAddrIds, check.pAddrIds);
+    }
+};
+
+static CCheckQueue<CAddrIdsCheck> addrindexqueue(128, MAX_SCRIPTCHECK_THREADS);
+
+void ThreadAddrIndexExtract() {
+    RenameThread("bitcoin-addrex");
+    addrindexqueue.Thread();
+}
+
+/**
+ * Extract the address identifiers of all transactions of a block, in parallel if there
+ * are script verification threads. The undo data must contain all transactions but the coinbase.
+ */
+void static ExtractAddrIds(const CBlock &block, const CBlockUndo &blockundo, std::vector<CTxAddrIds> &vTxAddrIds) {
+    vTxAddrIds.resize(block.vtx.size());
+    CCheckQueueControl<CAddrIdsCheck> control(nScriptCheckThreads ? &addrindexqueue : NULL);
+    std::vector<CAddrIdsCheck> vChecks;
+    vChecks.reserve(block.vtx.size());
+    for (unsigned int i = 0; i < block.vtx.size(); i++) {
+        const CTxUndo *ptxundo = i > 0 ? &blockundo.vtxundo[i-1] : NULL;
+        if (nScriptCheckThreads)
+            vChecks.push_back(CAddrIdsCheck(block.vtx[i], ptxundo, vTxAddrIds[i]));
+        else
+            ExtractAddrIds(block.vtx[i], ptxundo, vTxAddrIds[i]);
+    }
+    control.Add(vChecks);
+    control.Wait();
+}
+
+/** Collect the address index entries of a block from the extracted address identifiers of its transactions */
+void static BuildAddrIndex(const CBlock &block, const std::vector<CTxAddrIds> &vTxAddrIds, const CBlockIndex *pindex, std::vector<std::pair<uint160, CExtDiskTxPos> > &out) {
+    CExtDiskTxPos pos(CDiskTxPos(pindex->GetBlockPos(), GetSizeOfCompactSize(block.vtx.size())), pindex->nHeight);
+    out.reserve(out.size() + 4 * block.vtx.size());
+    for (unsigned int i = 0; i < block.vtx.size(); i++) {
+        const CTxAddrIds &addrIds = vTxAddrIds[i];
+        BOOST_FOREACH(const std::vector<uint160> &vAddrIds, addrIds.vPrevout)
+            BOOST_FOREACH(const uint160 &addrid, vAddrIds)
+                out.push_back(std::make_pair(addrid, pos));
+        BOOST_FOREACH(const std::vector<uint160> &vAddrIds, addrIds.vOut)
+            BOOST_FOREACH(const uint160 &addrid, vAddrIds)
+                out.push_back(std::make_pair(addrid, pos));
+        pos.nTxOffset += ::GetSerializeSize(block.vtx[i], SER_DISK, CLIENT_VERSION);
+    }
+}
+
+/** Collect the changes of a connected block to the unspent outputs of addresses */
+void static ConnectAddrUnspentIndex(const CBlock &block, const std::vector<CTxAddrIds> &vTxAddrIds, const CBlockIndex *pindex, CAddrUnspentMap &mapUnspent) {
+    for (unsigned int i = 0; i < block.vtx.size(); i++) {
+        const CTransaction &tx = block.vtx[i];
+        const CTxAddrIds &addrIds = vTxAddrIds[i];
+        for (unsigned int j = 0; j < addrIds.vPrevout.size(); j++)
+            BOOST_FOREACH(const uint160 &addrid, addrIds.vPrevout[j])
+                mapUnspent[CAddrUnspentKey(addrid, tx.vin[j].prevout)].SetNull();
+        const uint256 &hash = tx.GetHash();
+        for (unsigned int n = 0; n < tx.vout.size(); n++) {
+            const CTxOut &txout = tx.vout[n];
+            if (txout.scriptPubKey.IsUnspendable())
+                continue;
+            BOOST_FOREACH(const uint160 &addrid, addrIds.vOut[n])
+                mapUnspent[CAddrUnspentKey(addrid, COutPoint(hash, n))] = CAddrUnspentValue(txout, pindex->nHeight);
+        }
+    }
+}
+
+/** Get the summary of an address identifier, reading it from the database if it is not in mapSummary yet */
+CAddrSummary static &GetAddrSummary(CAddrSummaryMap &mapSummary, const uint160 &addrid) {
+    CAddrSummaryMap::iterator it = mapSummary.find(addrid);
+    if (it == mapSummary.end()) {
+        it = mapSummary.insert(std::make_pair(addrid, CAddrSummary())).first;
+        if (!pblocktree->ReadAddrSummary(addrid, it->second))
+            it->second.SetNull();
+    }
+    return it->second;
+}
+
+bool GetAddrSummaryCredit(const CScript &script, const std::vector<uint160> &vAddrIds, uint160 &addrid) {
+    // Unspendable outputs would never be sent again, and inflate the balance
+    if (vAddrIds.empty() || script.IsUnspendable())
+        return false;
+    for (unsigned int i = 1; i < vAddrIds.size(); i++)
+        if (vAddrIds[i] != vAddrIds[0])
+            return false;
+    addrid = vAddrIds[0];
+    return true;
+}
+
+/**
+ * Add (nSign = 1) or subtract (nSign = -1) the amounts of a block to the summaries of
+ * addresses, and collect the identifiers of each transaction in vsetTxAddrIds.
+ */
+void static UpdateAddrSummaryAmounts(const CBlock &block, const CBlockUndo &blockundo, const std::vector<CTxAddrIds> &vTxAddrIds, int nSign, CAddrSummaryMap &mapSummary, std::vector<std::set<uint160> > &vsetTxAddrIds) {
+    vsetTxAddrIds.resize(block.vtx.size());
+    for (unsigned int i = 0; i < block.vtx.size(); i++) {
+        const CTransaction &tx = block.vtx[i];
+        const CTxAddrIds &addrIds = vTxAddrIds[i];
+        uint160 addrid;
+        for (unsigned int j = 0; j < addrIds.vPrevout.size(); j++) {
+            const CTxOut &txout = blockundo.vtxundo[i-1].vprevout[j].txout;
+            if (GetAddrSummaryCredit(txout.scriptPubKey, addrIds.vPrevout[j], addrid))
+                GetAddrSummary(mapSummary, addrid).nSent += nSign * txout.nValue;
+            vsetTxAddrIds[i].insert(addrIds.vPrevout[j].begin(), addrIds.vPrevout[j].end());
+        }
+        for (unsigned int n = 0; n < tx.vout.size(); n++) {
+            if (GetAddrSummaryCredit(tx.vout[n].scriptPubKey, addrIds.vOut[n], addrid))
+                GetAddrSummary(mapSummary, addrid).nReceived += nSign * tx.vout[n].nValue;
+            vsetTxAddrIds[i].insert(addrIds.vOut[n].begin(), addrIds.vOut[n].end());
+        }
+    }
+}
+
+/** Apply a connected block to the summaries of addresses */
+void static ConnectAddrSummaries(const CBlock &block, const CBlockUndo &blockundo, const std::vector<CTxAddrIds> &vTxAddrIds, int nHeight, CAddrSummaryMap &mapSummary) {
+    std::vector<std::set<uint160> > vsetTxAddrIds;
+    UpdateAddrSummaryAmounts(block, blockundo, vTxAddrIds, 1, mapSummary, vsetTxAddrIds);
+    BOOST_FOREACH(const std::set<uint160> &setAddrIds, vsetTxAddrIds) {
+        BOOST_FOREACH(const uint160 &addrid, setAddrIds) {
+            CAddrSummary &summary = GetAddrSummary(mapSummary, addrid);
+            if (summary.nTxCount == 0)
+                summary.nFirstHeight = nHeight;
+            summary.nTxCount++;
+            summary.nLastHeight = nHeight;
+        }
+    }
+}
+
+/**
+ * Revert a disconnected block from the summaries of addresses. The address index entries
+ * below the height of the block are used to find the new last height of an address.
+ */
+bool static DisconnectAddrSummaries(const CBlock &block, const CBlockUndo &blockundo, const std::vector<CTxAddrIds> &vTxAddrIds, int nHeight, CAddrSummaryMap &mapSummary) {
+    std::vector<std::set<uint160> > vsetTxAddrIds;
+    UpdateAddrSummaryAmounts(block, blockundo, vTxAddrIds, -1, mapSummary, vsetTxAddrIds);
+    std::set<uint160> setAddrIds;
+    BOOST_FOREACH(const std::set<uint160> &setTxAddrIds, vsetTxAddrIds) {
+        BOOST_FOREACH(const uint160 &addrid, setTxAddrIds) {
+            GetAddrSummary(mapSummary, addrid).nTxCount--;
+            setAddrIds.insert(addrid);
+        }
+    }
+    BOOST_FOREACH(const uint160 &addrid, setAddrIds) {
+        CAddrSummary &summary = GetAddrSummary(mapSummary, addrid);
+        if (summary.nTxCount == 0) {
+            summary.SetNull();
+        } else if (summary.nLastHeight >= nHeight) {
+            if (!pblocktree->ReadAddrIndexLastHeight(addrid, nHeight, summary.nLastHeight))
+                return error("%s: no address index entry before height %d", __func__, nHeight);
+        }
+    }
+    return true;
+}
+
+/**
+ * Collect the changes of a disconnected block to the unspent outputs of addresses.
+ * The view must already reflect the disconnection, so that the heights of restored
+ * outputs can be looked up.
+ */
+void static DisconnectAddrUnspentIndex(const CBlock &block, const CBlockUndo &blockundo, const std::vector<CTxAddrIds> &vTxAddrIds, const CCoinsViewCache &view, CAddrUnspentMap &mapUnspent) {
+    for (int i = block.vtx.size() - 1; i >= 0; i--) {
+        const CTransaction &tx = block.vtx[i];
+        const CTxAddrIds &addrIds = vTxAddrIds[i];
+        const uint256 &hash = tx.GetHash();
+        for (unsigned int n = 0; n < tx.vout.size(); n++) {
+            if (tx.vout[n].scriptPubKey.IsUnspendable())
+                continue;
+            BOOST_FOREACH(const uint160 &addrid, addrIds.vOut[n])
+                mapUnspent[CAddrUnspentKey(addrid, COutPoint(hash, n))].SetNull();
+        }
+        if (i > 0) {
+            const CTxUndo &txundo = blockundo.vtxundo[i-1];
+            for (unsigned int j = tx.vin.size(); j-- > 0;) {
+                const COutPoint &out = tx.vin[j].prevout;
+                const CTxInUndo &undo = txundo.vprevout[j];
+                const CCoins *coins = view.AccessCoins(out.hash);
+                unsigned int nHeight = coins ? coins->nHeight : undo.nHeight;
+                BOOST_FOREACH(const uint160 &addrid, addrIds.vPrevout[j])
+                    mapUnspent[CAddrUnspentKey(addrid, out)] = CAddrUnspentValue(undo.txout, nHeight);
+            }
+        }
+    }
+}
+
+/**
+ * Remove the entries of a block from the address index, and revert its changes to the unspent
+ * outputs and summaries of addresses. The view must not include the block anymore.
+ */
+bool static DisconnectAddrIndex(const CBlock &block, const CBlockUndo &blockundo, const CBlockIndex *pindex, const CCoinsViewCache &view) {
+    std::vector<CTxAddrIds> vTxAddrIds;
+    ExtractAddrIds(block, blockundo, vTxAddrIds);
+    std::vector<std::pair<uint160, CExtDiskTxPos> > vPosAddrid;
+    BuildAddrIndex(block, vTxAddrIds, pindex, vPosAddrid);
+    CAddrUnspentMap mapAddrUnspent;
+    DisconnectAddrUnspentIndex(block, blockundo, vTxAddrIds, view, mapAddrUnspent);
+    CAddrSummaryMap mapAddrSummary;
+    if (fAddrSummary && !DisconnectAddrSummaries(block, blockundo, vTxAddrIds, pindex->nHeight, mapAddrSummary))
+        return false;
+    return pblocktree->WriteAddrIndex(std::vector<std::pair<uint160, CExtDiskTxPos> >(), vPosAddrid, mapAddrUnspent, mapAddrSummary, pindex->pprev->GetBlockHash());
+}
+
 bool DisconnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex, CCoinsViewCache& view, bool* pfClean)
 {
     assert(pindex->GetBlockHash() == view.GetBestBlock());
@@ -1724,6 +2179,13 @@ bool DisconnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex
     // move best block pointer to prevout block
     view.SetBestBlock(pindex->pprev->GetBlockHash());
 
+    // Only update the address index when actually disconnecting, not while verifying the database
+    if (fAddrIndex && !pfClean && AddrIndexIsAt(pindex)) {
+        if (!DisconnectAddrIndex(block, blockUndo, pindex, view))
+            return AbortNode(state, "Failed to write address index");
+        pindexAddrIndex = pindex->pprev;
+    }
+
     if (pfClean) {
         *pfClean = fClean;
         return true;
@@ -1757,39 +2219,16 @@ void static FlushBlockFile(bool fFinalize = false)
 
 bool FindUndoPos(CValidationState &state, int nFile, CDiskBlockPos &pos, unsigned int nAddSize);
 
-static CCheckQueue<CScriptCheck> scriptcheckqueue(128);
+static CCheckQueue<CScriptCheck> scriptcheckqueue(128, MAX_SCRIPTCHECK_THREADS);
+
+/** Number of checks ConnectBlock collects before handing them to a check queue at once */
+static const unsigned int CHECK_QUEUE_SUBMIT_SIZE = 128;
 
 void ThreadScriptCheck() {
     RenameThread("bitcoin-scriptch");
     scriptcheckqueue.Thread();
 }
 
-// Index either: a) every data push >= 8 bytes,  b) if no such pushes, the entire script
-void static BuildAddrIndex(const CScript &script, const CExtDiskTxPos &pos, std::vector<std::pair<uint160, CExtDiskTxPos> > &out) {
-    CScript::const_iterator pc = script.begin();
-    CScript::const_iterator pend = script.end();
-    std::vector<unsigned char> data;
-    opcodetype opcode;
-    bool fHaveData = false;
-    while (pc < pend) {
-        script.GetOp(pc, opcode, data);
-        if (0 <= opcode && opcode <= OP_PUSHDATA4 && data.size() >= 8) { // data element
-            uint160 addrid;
-            if (data.size() <= 20) {
-                memcpy(&addrid, &data[0], data.size());
-            } else {
-                addrid = Hash160(data);
-            }
-            out.push_back(std::make_pair(addrid, pos));
-            fHaveData = true;
-        }
-    }
-    if (!fHaveData) {
-        uint160 addrid = Hash160(script);
-        out.push_back(std::make_pair(addrid, pos));
-    }
-}
-
 //
 // Called periodically asynchronously; alerts if it smells like
 // we're being fed a bad chain (blocks being generated much
@@ -1917,19 +2356,47 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
 
     CBlockUndo blockundo;
 
+    // Blocks the address index has not caught up with yet are left to ThreadAddrIndex
+    bool fUpdateAddrIndex = fAddrIndex && !fJustCheck && AddrIndexIsAt(pindex->pprev);
+    std::vector<CTxAddrIds> vTxAddrIds;
+    if (fUpdateAddrIndex)
+        vTxAddrIds.resize(block.vtx.size());
+
+    // Script checks refer to the data precomputed from their transaction, so it has to
+    // outlive the queue control, which waits for outstanding checks when destroyed
+    std::vector<PrecomputedTransactionData> txdata(block.vtx.size());
     CCheckQueueControl<CScriptCheck> control(fScriptChecks && nScriptCheckThreads ? &scriptcheckqueue : NULL);
+    CCheckQueueControl<CAddrIdsCheck> controlAddrIds(fUpdateAddrIndex && nScriptCheckThreads ? &addrindexqueue : NULL);
+
+    std::vector<CScriptCheck> vChecks;
+    std::vector<CAddrIdsCheck> vAddrIdsChecks;
+
+    // Fetch the coins spent by the block up front, so the database reads happen in parallel
+    {
+        std::set<uint256> setCreated;
+        std::vector<uint256> vTxidSpent;
+        BOOST_FOREACH(const CTransaction& tx, block.vtx) {
+            setCreated.insert(tx.GetHash());
+            if (tx.IsCoinBase())
+                continue;
+            BOOST_FOREACH(const CTxIn& txin, tx.vin) {
+                if (!setCreated.count(txin.prevout.hash))
+                    vTxidSpent.push_back(txin.prevout.hash);
+            }
+        }
+        view.PrefetchCoins(vTxidSpent);
+    }
 
     int64_t nTimeStart = GetTimeMicros();
     CAmount nFees = 0;
     int nInputs = 0;
     unsigned int nSigOps = 0;
-    CExtDiskTxPos pos(CDiskTxPos(pindex->GetBlockPos(), GetSizeOfCompactSize(block.vtx.size())), pindex->nHeight);
+    CDiskTxPos pos(pindex->GetBlockPos(), GetSizeOfCompactSize(block.vtx.size()));
     std::vector<std::pair<uint256, CDiskTxPos> > vPosTxid;
-    std::vector<std::pair<uint160, CExtDiskTxPos> > vPosAddrid;
     if (fTxIndex)
         vPosTxid.reserve(block.vtx.size());
-    if (fAddrIndex)
-        vPosAddrid.reserve(4 * block.vtx.size());
+    // The address identifiers are extracted while the block is being connected, which
+    // relies on the undo data of a transaction not moving after it has been connected
     blockundo.vtxundo.reserve(block.vtx.size() - 1);
     for (unsigned int i = 0; i < block.vtx.size(); i++)
     {
@@ -1960,25 +2427,18 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
 
             nFees += view.GetValueIn(tx)-tx.GetValueOut();
 
-            std::vector<CScriptCheck> vChecks;
-            if (!CheckInputs(tx, state, view, fScriptChecks, flags, false, nScriptCheckThreads ? &vChecks : NULL))
+            if (fScriptChecks)
+                txdata[i].Init(tx);
+            if (!CheckInputs(tx, state, view, fScriptChecks, flags, false, nScriptCheckThreads ? &vChecks : NULL, &txdata[i]))
                 return false;
-            control.Add(vChecks);
+            if (vChecks.size() >= CHECK_QUEUE_SUBMIT_SIZE) {
+                control.Add(vChecks);
+                vChecks.clear();
+            }
         }
 
         if (fTxIndex)
             vPosTxid.push_back(std::make_pair(tx.GetHash(), pos));
-        if (fAddrIndex) {
-            if (!tx.IsCoinBase()) {
-                BOOST_FOREACH(const CTxIn &txin, tx.vin) {
-                    CCoins coins;
-                    view.GetCoins(txin.prevout.hash, coins);
-                    BuildAddrIndex(coins.vout[txin.prevout.n].scriptPubKey, pos, vPosAddrid);
-                }
-            }
-            BOOST_FOREACH(const CTxOut &txout, tx.vout)
-                BuildAddrIndex(txout.scriptPubKey, pos, vPosAddrid);
-        }
 
         CTxUndo undoDummy;
         if (i > 0) {
@@ -1986,8 +2446,24 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
         }
         UpdateCoins(tx, state, view, i == 0 ? undoDummy : blockundo.vtxundo.back(), pindex->nHeight);
 
+        if (fUpdateAddrIndex) {
+            CAddrIdsCheck check(tx, i == 0 ? NULL : &blockundo.vtxundo.back(), vTxAddrIds[i]);
+            if (nScriptCheckThreads) {
+                vAddrIdsChecks.push_back(CAddrIdsCheck());
+                check.swap(vAddrIdsChecks.back());
+                if (vAddrIdsChecks.size() >= CHECK_QUEUE_SUBMIT_SIZE) {
+                    controlAddrIds.Add(vAddrIdsChecks);
+                    vAddrIdsChecks.clear();
+                }
+            } else {
+                check();
+            }
+        }
+
         pos.nTxOffset += ::GetSerializeSize(tx, SER_DISK, CLIENT_VERSION);
     }
+    control.Add(vChecks);
+    controlAddrIds.Add(vAddrIdsChecks);
     int64_t nTime1 = GetTimeMicros(); nTimeConnect += nTime1 - nTimeStart;
     LogPrint("bench", "      - Connect %u transactions: %.2fms (%.3fms/tx, %.3fms/txin) [%.2fs]\n", (unsigned)block.vtx.size(), 0.001 * (nTime1 - nTimeStart), 0.001 * (nTime1 - nTimeStart) / block.vtx.size(), nInputs <= 1 ? 0 : 0.001 * (nTime1 - nTimeStart) / (nInputs-1), nTimeConnect * 0.000001);
 
@@ -2002,6 +2478,9 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
         return state.DoS(100, false);
     int64_t nTime2 = GetTimeMicros(); nTimeVerify += nTime2 - nTimeStart;
     LogPrint("bench", "    - Verify %u txins: %.2fms (%.3fms/txin) [%.2fs]\n", nInputs - 1, 0.001 * (nTime2 - nTimeStart), nInputs <= 1 ? 0 : 0.001 * (nTime2 - nTimeStart) / (nInputs-1), nTimeVerify * 0.000001);
+    uint64_t nSigCacheHits, nSigCacheMisses;
+    GetSignatureCacheStats(nSigCacheHits, nSigCacheMisses);
+    LogPrint("bench", "    - Signature cache: %d hits, %d misses\n", nSigCacheHits, nSigCacheMisses);
 
     if (fJustCheck)
         return true;
@@ -2028,9 +2507,19 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
     if (fTxIndex)
         if (!pblocktree->WriteTxIndex(vPosTxid))
             return AbortNode(state, "Failed to write transaction index");
-    if (fAddrIndex)
-        if (!pblocktree->AddAddrIndex(vPosAddrid))
+    if (fUpdateAddrIndex) {
+        controlAddrIds.Wait();
+        std::vector<std::pair<uint160, CExtDiskTxPos> > vPosAddrid;
+        CAddrUnspentMap mapAddrUnspent;
+        CAddrSummaryMap mapAddrSummary;
+        BuildAddrIndex(block, vTxAddrIds, pindex, vPosAddrid);
+        ConnectAddrUnspentIndex(block, vTxAddrIds, pindex, mapAddrUnspent);
+        if (fAddrSummary)
+            ConnectAddrSummaries(block, blockundo, vTxAddrIds, pindex->nHeight, mapAddrSummary);
+        if (!pblocktree->WriteAddrIndex(vPosAddrid, std::vector<std::pair<uint160, CExtDiskTxPos> >(), mapAddrUnspent, mapAddrSummary, pindex->GetBlockHash()))
             return AbortNode(state, "Failed to write address index");
+        pindexAddrIndex = pindex;
+    }
 
     // add this block to the view's block chain
     view.SetBestBlock(pindex->GetBlockHash());
@@ -2143,8 +2632,16 @@ bool static FlushStateToDisk(CValidationState &state, FlushStateMode mode) {
         if (!CheckDiskSpace(128 * 2 * 2 * pcoinsTip->GetCacheSize()))
             return state.Error("out of disk space");
         // Flush the chainstate (which may refer to block index entries).
-        if (!pcoinsTip->Flush())
-            return AbortNode(state, "Failed to write to coin database");
+        if (nCoinCacheKeep == 0) {
+            if (!pcoinsTip->Flush())
+                return AbortNode(state, "Failed to write to coin database");
+        } else {
+            // Only write what was modified, and keep the warm part of the cache around.
+            if (!pcoinsTip->Sync())
+                return AbortNode(state, "Failed to write to coin database");
+            if (fCacheLarge || fCacheCritical)
+                pcoinsTip->Evict(nCoinCacheUsage / 100 * nCoinCacheKeep);
+        }
         nLastFlush = nNow;
     }
     if ((mode == FLUSH_STATE_ALWAYS || mode == FLUSH_STATE_PERIODIC) && nNow > nLastSetChain + (int64_t)DATABASE_WRITE_INTERVAL * 1000000) {
@@ -2235,9 +2732,11 @@ bool static DisconnectTip(CValidationState &state) {
         // ignore validation errors in resurrected transactions
         list<CTransaction> removed;
         CValidationState stateDummy;
-        if (tx.IsCoinBase() || !AcceptToMemoryPool(mempool, stateDummy, tx, false, NULL))
+        if (tx.IsCoinBase() || !AcceptToMemoryPool(mempool, stateDummy, tx, false, NULL, false, true))
             mempool.remove(tx, removed, true);
     }
+    // Trim once all of them are back, so that the fee rates of the whole packages count
+    LimitMempoolSize(mempool, GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000, GetArg("-mempoolexpiry", DEFAULT_MEMPOOL_EXPIRY) * 60 * 60);
     mempool.removeCoinbaseSpends(pcoinsTip, pindexDelete->nHeight);
     mempool.check(pcoinsTip);
     // Update chainActive and related variables.
@@ -2260,16 +2759,134 @@ static int64_t nTimePostConnect = 0;
  * Connect a new block to chainActive. pblock is either NULL or a pointer to a CBlock
  * corresponding to pindexNew, to bypass loading it again from disk.
  */
+/** A block that is read ahead of being connected */
+struct CPipelineBlock {
+    uint256 hash;
+    CDiskBlockPos pos;
+    //! The block, once it has been read
+    boost::shared_ptr<CBlock> pblock;
+
+    CPipelineBlock(const uint256& hashIn, const CDiskBlockPos& posIn) : hash(hashIn), pos(posIn) {}
+};
+
+static boost::mutex csBlockPipeline;
+static boost::condition_variable condBlockPipeline;
+/** The blocks to read ahead, in the order they are going to be connected (protected by csBlockPipeline) */
+static std::list<CPipelineBlock> listBlockPipeline;
+
+/**
+ * Schedule the first nBlockPipelineDepth of vpindex, which are given in the order they
+ * are going to be connected, to be read ahead. Blocks that were read already are kept.
+ */
+void static ScheduleBlockPipeline(const std::vector<CBlockIndex*>& vpindex) {
+    AssertLockHeld(cs_main);
+    if (nBlockPipelineDepth <= 0)
+        return;
+    boost::unique_lock<boost::mutex> lock(csBlockPipeline);
+    std::list<CPipelineBlock> listNew;
+    for (unsigned int i = 0; i < vpindex.size() && listNew.size() < (size_t)nBlockPipelineDepth; i++) {
+        const CBlockIndex* pindex = vpindex[i];
+        if (!(pindex->nStatus & BLOCK_HAVE_DATA))
+            break;
+        std::list<CPipelineBlock>::iterator it = listBlockPipeline.begin();
+        while (it != listBlockPipeline.end() && it->hash != pindex->GetBlockHash())
+            it++;
+        if (it != listBlockPipeline.end())
+            listNew.splice(listNew.end(), listBlockPipeline, it);
+        else
+            listNew.push_back(CPipelineBlock(pindex->GetBlockHash(), pindex->GetBlockPos()));
+    }
+    listBlockPipeline.swap(listNew);
+    condBlockPipeline.notify_all();
+}
+
+/** Take a block out of the pipeline. Returns NULL if it has not been read (yet), in which case it is not read anymore. */
+boost::shared_ptr<CBlock> static TakePipelineBlock(const uint256& hash) {
+    boost::shared_ptr<CBlock> pblock;
+    boost::unique_lock<boost::mutex> lock(csBlockPipeline);
+    for (std::list<CPipelineBlock>::iterator it = listBlockPipeline.begin(); it != listBlockPipeline.end(); it++) {
+        if (it->hash == hash) {
+            pblock = it->pblock;
+            listBlockPipeline.erase(it);
+            break;
+        }
+    }
+    return pblock;
+}
+
+/** Prefetch the coins spent by a block that were not created by the block itself */
+void static PrefetchBlockInputs(const CBlock& block, CCoinsViewPrefetch* pcoinsPrefetch) {
+    std::set<uint256> setSeen;
+    BOOST_FOREACH(const CTransaction& tx, block.vtx)
+        setSeen.insert(tx.GetHash());
+    BOOST_FOREACH(const CTransaction& tx, block.vtx) {
+        boost::this_thread::interruption_point();
+        if (tx.IsCoinBase())
+            continue;
+        BOOST_FOREACH(const CTxIn& txin, tx.vin) {
+            if (setSeen.insert(txin.prevout.hash).second)
+                pcoinsPrefetch->Prefetch(txin.prevout.hash);
+        }
+    }
+}
+
+void ThreadBlockPipeline(CCoinsViewPrefetch* pcoinsPrefetch) {
+    RenameThread("bitcoin-pipeline");
+    while (true) {
+        // Wait for a block that has not been read yet
+        uint256 hash;
+        CDiskBlockPos pos;
+        {
+            boost::unique_lock<boost::mutex> lock(csBlockPipeline);
+            std::list<CPipelineBlock>::iterator it;
+            while (true) {
+                for (it = listBlockPipeline.begin(); it != listBlockPipeline.end() && it->pblock; it++);
+                if (it != listBlockPipeline.end())
+                    break;
+                condBlockPipeline.wait(lock);
+            }
+            hash = it->hash;
+            pos = it->pos;
+        }
+
+        boost::shared_ptr<CBlock> pblock(new CBlock());
+        bool fRead = ReadBlockFromDisk(*pblock, pos) && pblock->GetHash() == hash;
+        bool fScheduled = false;
+        {
+            // The block may have been taken or rescheduled in the meantime
+            boost::unique_lock<boost::mutex> lock(csBlockPipeline);
+            for (std::list<CPipelineBlock>::iterator it = listBlockPipeline.begin(); it != listBlockPipeline.end(); it++) {
+                if (it->hash == hash) {
+                    if (fRead)
+                        it->pblock = pblock;
+                    else
+                        listBlockPipeline.erase(it);
+                    fScheduled = true;
+                    break;
+                }
+            }
+        }
+        if (fRead && fScheduled)
+            PrefetchBlockInputs(*pblock, pcoinsPrefetch);
+    }
+}
+
 bool static ConnectTip(CValidationState &state, CBlockIndex *pindexNew, CBlock *pblock) {
     assert(pindexNew->pprev == chainActive.Tip());
     mempool.check(pcoinsTip);
-    // Read block from disk.
+    // Read block from disk, unless it was read ahead.
     int64_t nTime1 = GetTimeMicros();
     CBlock block;
+    boost::shared_ptr<CBlock> pblockPipeline;
     if (!pblock) {
-        if (!ReadBlockFromDisk(block, pindexNew))
-            return AbortNode(state, "Failed to read block");
-        pblock = &block;
+        pblockPipeline = TakePipelineBlock(pindexNew->GetBlockHash());
+        if (pblockPipeline) {
+            pblock = pblockPipeline.get();
+        } else {
+            if (!ReadBlockFromDisk(block, pindexNew))
+                return AbortNode(state, "Failed to read block");
+            pblock = &block;
+        }
     }
     // Apply the block atomically to the chain state.
     int64_t nTime2 = GetTimeMicros(); nTimeReadFromDisk += nTime2 - nTime1;
@@ -2422,6 +3039,14 @@ static bool ActivateBestChainStep(CValidationState &state, CBlockIndex *pindexMo
     }
     nHeight = nTargetHeight;
 
+    // Read the blocks after the one passed in ahead of connecting them
+    std::vector<CBlockIndex*> vpindexPipeline;
+    BOOST_REVERSE_FOREACH(CBlockIndex *pindexConnect, vpindexToConnect) {
+        if (!pblock || pindexConnect != pindexMostWork)
+            vpindexPipeline.push_back(pindexConnect);
+    }
+    ScheduleBlockPipeline(vpindexPipeline);
+
     // Connect new blocks.
     BOOST_REVERSE_FOREACH(CBlockIndex *pindexConnect, vpindexToConnect) {
         if (!ConnectTip(state, pindexConnect, pindexConnect == pindexMostWork ? pblock : NULL)) {
@@ -3473,6 +4098,160 @@ void UnloadBlockIndex()
     fHavePruned = false;
 }
 
+bool InitAddrIndex(bool fEnable, bool fSummary)
+{
+    LOCK(cs_main);
+    pindexAddrIndex = NULL;
+    fAddrIndexWipe = false;
+    if (fAddrIndex != fEnable) {
+        // Entries are kept when disabling, so that the index can resume where it stopped
+        if (!pblocktree->WriteFlag("addrindex", fEnable))
+            return error("%s: failed to write address index flag", __func__);
+        fAddrIndex = fEnable;
+        LogPrintf("%s: address index %s\n", __func__, fAddrIndex ? "enabled" : "disabled");
+    }
+    fAddrSummary = fAddrIndex && fSummary;
+    if (!fAddrIndex)
+        return true;
+
+    // Summaries depend on the entire history of an address, so toggling them rebuilds the index
+    bool fSummaryStored = false;
+    pblocktree->ReadFlag("addrsummary", fSummaryStored);
+    if (fSummaryStored != fAddrSummary) {
+        if (!pblocktree->WriteFlag("addrsummary", fAddrSummary))
+            return error("%s: failed to write address summary flag", __func__);
+        LogPrintf("%s: address summaries %s, the address index will be rebuilt\n", __func__, fAddrSummary ? "enabled" : "disabled");
+        fAddrIndexWipe = true;
+        return true;
+    }
+
+    int nVersion = 0;
+    if (!pblocktree->ReadAddrIndexVersion(nVersion))
+        return error("%s: failed to read address index version", __func__);
+    if (nVersion != nAddrIndexVersion) {
+        LogPrintf("%s: address index has version %d, it will be rebuilt in version %d\n", __func__, nVersion, nAddrIndexVersion);
+        fAddrIndexWipe = true;
+        return true;
+    }
+
+    uint256 hashBest;
+    if (!pblocktree->ReadAddrIndexBestBlock(hashBest))
+        return true;
+    BlockMap::iterator mi = mapBlockIndex.find(hashBest);
+    if (mi == mapBlockIndex.end()) {
+        LogPrintf("%s: address index is at an unknown block, it will be rebuilt\n", __func__);
+        fAddrIndexWipe = true;
+        return true;
+    }
+    CBlockIndex* pindex = mi->second;
+    const CBlockIndex* pindexFork = chainActive.FindFork(pindex);
+    if (pindexFork == NULL) {
+        LogPrintf("%s: address index is at a block without a common ancestor, it will be rebuilt\n", __func__);
+        fAddrIndexWipe = true;
+        return true;
+    }
+    if (pindex != pindexFork) {
+        // The index includes blocks that are not in the active chain: it was written ahead of the
+        // chain state, or a reorganization was interrupted by an unclean shutdown. Remove them down
+        // to the fork point, as they may not be reconnected, and the summaries are not idempotent.
+        LogPrintf("%s: address index is at height %d outside the active chain, rolling back to height %d\n", __func__, pindex->nHeight, pindexFork->nHeight);
+        for (; pindex != pindexFork; pindex = pindex->pprev) {
+            CBlock block;
+            CBlockUndo blockundo;
+            CDiskBlockPos pos = pindex->GetUndoPos();
+            if (!ReadBlockFromDisk(block, pindex) || pos.IsNull() || !UndoReadFromDisk(blockundo, pos, pindex->pprev->GetBlockHash())) {
+                LogPrintf("%s: failed to read block %s to roll back, the address index will be rebuilt\n", __func__, pindex->GetBlockHash().ToString());
+                fAddrIndexWipe = true;
+                return true;
+            }
+            if (!DisconnectAddrIndex(block, blockundo, pindex, *pcoinsTip))
+                return error("%s: failed to roll back address index", __func__);
+        }
+    }
+    pindexAddrIndex = pindex;
+    LogPrintf("%s: address index is at height %d\n", __func__, pindexAddrIndex->nHeight);
+    return true;
+}
+
+int GetAddrIndexHeight()
+{
+    LOCK(cs_main);
+    if (fAddrIndexWipe)
+        return -1;
+    return pindexAddrIndex ? pindexAddrIndex->nHeight : 0;
+}
+
+void ThreadAddrIndex()
+{
+    RenameThread("bitcoin-addrindex");
+
+    bool fWipe;
+    {
+        LOCK(cs_main);
+        fWipe = fAddrIndexWipe;
+    }
+    if (fWipe) {
+        // No entries are written until the wipe is complete, so this does not need cs_main
+        LogPrintf("%s: erasing outdated address index\n", __func__);
+        if (!pblocktree->EraseAddrIndex() || !pblocktree->WriteAddrIndexVersion(nAddrIndexVersion)) {
+            AbortNode("Failed to erase address index");
+            return;
+        }
+        LOCK(cs_main);
+        pindexAddrIndex = NULL;
+        fAddrIndexWipe = false;
+    }
+
+    int64_t nLastLog = 0;
+    while (true) {
+        boost::this_thread::interruption_point();
+
+        LOCK(cs_main);
+        if (AddrIndexIsAt(chainActive.Tip())) {
+            LogPrintf("%s: address index synced at height %d\n", __func__, chainActive.Height());
+            return;
+        }
+
+        // Index blocks in small steps, so that validation and RPC can proceed in between
+        std::vector<std::pair<uint160, CExtDiskTxPos> > vPosAddrid;
+        CAddrUnspentMap mapAddrUnspent;
+        CAddrSummaryMap mapAddrSummary;
+        CBlockIndex* pindex = pindexAddrIndex;
+        int64_t nStart = GetTimeMillis();
+        while (pindex != chainActive.Tip() && vPosAddrid.size() < 100000 && GetTimeMillis() - nStart < 100) {
+            CBlockIndex* pindexNext = pindex ? chainActive.Next(pindex) : chainActive[1];
+            CBlock block;
+            if (!ReadBlockFromDisk(block, pindexNext)) {
+                AbortNode(strprintf("Failed to read block %s for address index", pindexNext->GetBlockHash().ToString()));
+                return;
+            }
+            CBlockUndo blockundo;
+            CDiskBlockPos pos = pindexNext->GetUndoPos();
+            if (pos.IsNull() || !UndoReadFromDisk(blockundo, pos, pindexNext->pprev->GetBlockHash())) {
+                AbortNode(strprintf("Failed to read undo data of block %s for address index", pindexNext->GetBlockHash().ToString()));
+                return;
+            }
+            std::vector<CTxAddrIds> vTxAddrIds;
+            ExtractAddrIds(block, blockundo, vTxAddrIds);
+            BuildAddrIndex(block, vTxAddrIds, pindexNext, vPosAddrid);
+            ConnectAddrUnspentIndex(block, vTxAddrIds, pindexNext, mapAddrUnspent);
+            if (fAddrSummary)
+                ConnectAddrSummaries(block, blockundo, vTxAddrIds, pindexNext->nHeight, mapAddrSummary);
+            pindex = pindexNext;
+        }
+        if (!pblocktree->WriteAddrIndex(vPosAddrid, std::vector<std::pair<uint160, CExtDiskTxPos> >(), mapAddrUnspent, mapAddrSummary, pindex->GetBlockHash())) {
+            AbortNode("Failed to write address index");
+            return;
+        }
+        pindexAddrIndex = pindex;
+
+        if (GetTimeMillis() - nLastLog > 10000) {
+            LogPrintf("%s: address index syncing, at height %d of %d\n", __func__, pindex->nHeight, chainActive.Height());
+            nLastLog = GetTimeMillis();
+        }
+    }
+}
+
 bool LoadBlockIndex()
 {
     // Load block index from databases
@@ -3498,6 +4277,8 @@ bool InitBlockIndex() {
     pblocktree->WriteFlag("txindex", fTxIndex);
     fAddrIndex = GetBoolArg("-addrindex", false);
     pblocktree->WriteFlag("addrindex", fAddrIndex);
+    if (fAddrIndex)
+        pblocktree->WriteAddrIndexVersion(nAddrIndexVersion);
     LogPrintf("Initializing databases...\n");
 
     // Only add the genesis block if not reindexing (in which case we reuse the one already on disk)
@@ -3817,6 +4598,210 @@ void static CheckBlockIndex()
     assert(nNodes == forward.size());
 }
 
+//////////////////////////////////////////////////////////////////////////////
+//
+// Mempool persistence
+//
+
+static const char* MEMPOOL_FILENAME = "mempool.dat";
+static const uint64_t MEMPOOL_DUMP_VERSION = 1;
+//! Number of saved transactions whose scripts are verified together when loading
+static const unsigned int MEMPOOL_LOAD_BATCH_SIZE = 1000;
+//! Set once the saved mempool has been loaded completely, so a shutdown during the load doesn't overwrite it
+static volatile bool fMempoolLoaded = false;
+
+/** Orders mempool entries so that every transaction comes after its in-mempool ancestors */
+struct CompareTxMemPoolEntryByAncestorCount
+{
+    bool operator()(const CTxMemPoolEntry* a, const CTxMemPoolEntry* b) const
+    {
+        return a->GetCountWithAncestors() < b->GetCountWithAncestors();
+    }
+};
+
+void DumpMempool()
+{
+    if (!fMempoolLoaded) {
+        LogPrintf("%s: The saved mempool was not loaded completely, not overwriting it\n", __func__);
+        return;
+    }
+
+    int64_t nStart = GetTimeMicros();
+    std::map<uint256, std::pair<double, CAmount> > mapDeltas;
+    std::vector<std::pair<CTransaction, int64_t> > vinfo;
+    {
+        LOCK(mempool.cs);
+        std::vector<const CTxMemPoolEntry*> entries;
+        entries.reserve(mempool.mapTx.size());
+        BOOST_FOREACH(const CTxMemPoolEntry& entry, mempool.mapTx)
+            entries.push_back(&entry);
+        std::sort(entries.begin(), entries.end(), CompareTxMemPoolEntryByAncestorCount());
+
+        mapDeltas = mempool.mapDeltas;
+        vinfo.reserve(entries.size());
+        BOOST_FOREACH(const CTxMemPoolEntry* entry, entries)
+            vinfo.push_back(std::make_pair(entry->GetTx(), entry->GetTime()));
+    }
+
+    boost::filesystem::path pathTmp = GetDataDir() / (std::string(MEMPOOL_FILENAME) + ".new");
+    try {
+        CAutoFile file(fopen(pathTmp.string().c_str(), "wb"), SER_DISK, CLIENT_VERSION);
+        if (file.IsNull()) {
+            LogPrintf("%s: Failed to open %s\n", __func__, pathTmp.string());
+            return;
+        }
+        uint64_t nTx = vinfo.size();
+        file << MEMPOOL_DUMP_VERSION;
+        file << mapDeltas;
+        file << nTx;
+        for (unsigned int i = 0; i < vinfo.size(); i++)
+            file << vinfo[i].first << vinfo[i].second;
+        FileCommit(file.Get());
+        file.fclose();
+        RenameOver(pathTmp, GetDataDir() / MEMPOOL_FILENAME);
+        LogPrintf("Dumped %u mempool transactions: %.2fms\n", nTx, (GetTimeMicros() - nStart) * 0.001);
+    } catch (const std::exception& e) {
+        LogPrintf("%s: Failed to dump mempool: %s. Continuing anyway.\n", __func__, e.what());
+    }
+}
+
+//! Add the script checks of tx, whose inputs are in view, to control
+static void AddScriptChecks(const CTransaction& tx, const CCoinsViewCache& view, PrecomputedTransactionData* txdata, CCheckQueueControl<CScriptCheck>& control)
+{
+    std::vector<CScriptCheck> vChecks;
+    for (unsigned int i = 0; i < tx.vin.size(); i++) {
+        const CCoins* coins = view.AccessCoins(tx.vin[i].prevout.hash);
+        vChecks.push_back(CScriptCheck());
+        CScriptCheck check(*coins, tx, i, STANDARD_SCRIPT_VERIFY_FLAGS, true, txdata);
+        check.swap(vChecks.back());
+    }
+    control.Add(vChecks);
+}
+
+/**
+ * Verify the scripts of a batch of transactions on the script check threads.
+ * The result doesn't matter: the valid signatures end up in the signature cache,
+ * so that AcceptToMemoryPool, which verifies one transaction at a time, can
+ * skip them. Transactions may spend outputs of earlier ones in the batch.
+ */
+static void PreVerifyScripts(const std::vector<CTransaction>& vtx)
+{
+    AssertLockHeld(cs_main);
+    if (nScriptCheckThreads == 0)
+        return;
+
+    CCoinsView dummy;
+    CCoinsViewCache view(&dummy);
+    LOCK(mempool.cs);
+    CCoinsViewMemPool viewMemPool(pcoinsTip, mempool);
+    view.SetBackend(viewMemPool);
+
+    // The checks copy the spent outputs, which stay in view while later
+    // transactions add theirs, so the checks can be made once all are added.
+    std::vector<const CTransaction*> vtxChecked;
+    std::vector<PrecomputedTransactionData> vtxdata;
+    vtxChecked.reserve(vtx.size());
+    vtxdata.reserve(vtx.size());
+    BOOST_FOREACH(const CTransaction& tx, vtx) {
+        if (!view.HaveInputs(tx))
+            continue;
+        vtxChecked.push_back(&tx);
+        vtxdata.push_back(PrecomputedTransactionData(tx));
+        view.ModifyCoins(tx.GetHash())->FromTx(tx, MEMPOOL_HEIGHT);
+    }
+
+    {
+        CCheckQueueControl<CScriptCheck> control(&scriptcheckqueue);
+        for (unsigned int i = 0; i < vtxChecked.size(); i++)
+            AddScriptChecks(*vtxChecked[i], view, &vtxdata[i], control);
+        if (control.Wait())
+            return;
+    }
+
+    // A failed check makes the queue skip the ones still waiting, of any
+    // transaction. Verify each transaction on its own instead, so that only
+    // the rest of a failing one is skipped; the checks that already passed
+    // are found in the signature cache.
+    for (unsigned int i = 0; i < vtxChecked.size(); i++) {
+        CCheckQueueControl<CScriptCheck> control(&scriptcheckqueue);
+        AddScriptChecks(*vtxChecked[i], view, &vtxdata[i], control);
+        control.Wait();
+    }
+}
+
+static bool ReadMempool()
+{
+    int64_t nExpiryTimeout = GetArg("-mempoolexpiry", DEFAULT_MEMPOOL_EXPIRY) * 60 * 60;
+    boost::filesystem::path path = GetDataDir() / MEMPOOL_FILENAME;
+    CAutoFile file(fopen(path.string().c_str(), "rb"), SER_DISK, CLIENT_VERSION);
+    // Allowed to fail as this file IS missing on first startup.
+    if (file.IsNull())
+        return false;
+
+    int64_t nStart = GetTimeMillis();
+    int64_t nNow = GetTime();
+    unsigned int nAccepted = 0, nFailed = 0, nExpired = 0;
+    try {
+        uint64_t nVersion;
+        file >> nVersion;
+        if (nVersion != MEMPOOL_DUMP_VERSION)
+            return error("%s: Unknown mempool file version %u", __func__, nVersion);
+
+        // Prioritisations first, so they count when the transactions are accepted
+        std::map<uint256, std::pair<double, CAmount> > mapDeltas;
+        file >> mapDeltas;
+        for (std::map<uint256, std::pair<double, CAmount> >::const_iterator it = mapDeltas.begin(); it != mapDeltas.end(); it++)
+            mempool.PrioritiseTransaction(it->first, it->first.ToString(), it->second.first, it->second.second);
+
+        uint64_t nTx;
+        file >> nTx;
+        std::vector<CTransaction> vtx;
+        std::vector<int64_t> vTime;
+        while (nTx > 0) {
+            vtx.clear();
+            vTime.clear();
+            while (nTx > 0 && vtx.size() < MEMPOOL_LOAD_BATCH_SIZE) {
+                CTransaction tx;
+                int64_t nTime;
+                file >> tx >> nTime;
+                nTx--;
+                if (nTime + nExpiryTimeout > nNow) {
+                    vtx.push_back(tx);
+                    vTime.push_back(nTime);
+                } else {
+                    nExpired++;
+                }
+            }
+
+            LOCK(cs_main);
+            PreVerifyScripts(vtx);
+            for (unsigned int i = 0; i < vtx.size(); i++) {
+                CValidationState state;
+                if (AcceptToMemoryPoolWithTime(mempool, state, vtx[i], true, NULL, vTime[i]))
+                    nAccepted++;
+                else
+                    nFailed++;
+            }
+            if (ShutdownRequested())
+                return false;
+        }
+    } catch (const std::exception& e) {
+        LogPrintf("%s: Failed to deserialize mempool data on disk: %s. Continuing anyway.\n", __func__, e.what());
+        return false;
+    }
+
+    LogPrintf("Imported mempool transactions from disk: %u successes, %u failed, %u expired: %dms\n",
+              nAccepted, nFailed, nExpired, GetTimeMillis() - nStart);
+    return true;
+}
+
+bool LoadMempool()
+{
+    bool fLoaded = ReadMempool();
+    fMempoolLoaded = !ShutdownRequested();
+    return fLoaded;
+}
+
 //////////////////////////////////////////////////////////////////////////////
 //
 // CAlert
@@ -40,6 +40,7 @@
 class CBlockIndex;
 class CBlockTreeDB;
 class CBloomFilter;
+class CCoinsViewPrefetch;
 class CInv;
 class CScriptCheck;
 class CValidationInterface;
@@ -60,6 +61,22 @@ static const unsigned int MAX_STANDARD_TX_SIZE = 100000;
 static const unsigned int MAX_P2SH_SIGOPS = 15;
 /** The maximum number of sigops we're willing to relay/mine in a single tx */
 static const unsigned int MAX_STANDARD_TX_SIGOPS = MAX_BLOCK_SIGOPS/5;
+/** Default for -limitancestorcount, max number of in-mempool ancestors */
+static const unsigned int DEFAULT_ANCESTOR_LIMIT = 25;
+/** Default for -limitancestorsize, maximum kilobytes of tx + all in-mempool ancestors */
+static const unsigned int DEFAULT_ANCESTOR_SIZE_LIMIT = 101;
+/** Default for -limitdescendantcount, max number of in-mempool descendants */
+static const unsigned int DEFAULT_DESCENDANT_LIMIT = 25;
+/** Default for -limitdescendantsize, maximum kilobytes of in-mempool descendants */
+static const unsigned int DEFAULT_DESCENDANT_SIZE_LIMIT = 101;
+/** Default for -maxmempool, maximum megabytes of mempool memory usage */
+static const unsigned int DEFAULT_MAX_MEMPOOL_SIZE = 300;
+/** Default for -mempoolexpiry, expiration time for mempool transactions in hours */
+static const unsigned int DEFAULT_MEMPOOL_EXPIRY = 72;
+/** Default for -persistmempool, whether to save the mempool on shutdown and load it on restart */
+static const bool DEFAULT_PERSIST_MEMPOOL = true;
+/** Default for -dumpmempoolinterval, minutes between saves of the mempool besides the one on shutdown (0 = none) */
+static const unsigned int DEFAULT_DUMP_MEMPOOL_INTERVAL = 0;
 /** Default for -maxorphantx, maximum number of orphan transactions kept in memory */
 static const unsigned int DEFAULT_MAX_ORPHAN_TRANSACTIONS = 100;
 /** The maximum size of a blk?????.dat file (since 0.8) */
@@ -69,9 +86,19 @@ static const unsigned int BLOCKFILE_CHUNK_SIZE = 0x1000000; // 16 MiB
 /** The pre-allocation chunk size for rev?????.dat files (since 0.8) */
 static const unsigned int UNDOFILE_CHUNK_SIZE = 0x100000; // 1 MiB
 /** Maximum number of script-checking threads allowed */
-static const int MAX_SCRIPTCHECK_THREADS = 16;
+static const int MAX_SCRIPTCHECK_THREADS = 32;
 /** -par default (number of script-checking threads, 0 = auto) */
 static const int DEFAULT_SCRIPTCHECK_THREADS = 0;
+/** -blockpipelinedepth default (number of blocks read ahead of being connected) */
+static const int DEFAULT_BLOCK_PIPELINE_DEPTH = 4;
+/** Maximum -blockpipelinedepth, as no more blocks are scheduled for connection at once */
+static const int MAX_BLOCK_PIPELINE_DEPTH = 32;
+/** Number of coins that may be prefetched for each block of the pipeline depth */
+static const int MAX_PREFETCH_COINS_PER_BLOCK = 20000;
+/** -dbcachekeep default (percentage of -dbcache kept warm when the coins cache is full) */
+static const unsigned int DEFAULT_COINS_CACHE_KEEP = 70;
+/** Maximum -dbcachekeep, so a full cache does not need to be written again right away */
+static const unsigned int MAX_COINS_CACHE_KEEP = 80;
 /** Number of blocks that can be requested at any given time from a single peer. */
 static const int MAX_BLOCKS_IN_TRANSIT_PER_PEER = 16;
 /** Timeout in seconds during which a peer must stall block download progress before being disconnected. */
@@ -109,12 +136,15 @@ extern CConditionVariable cvBlockChange;
 extern bool fImporting;
 extern bool fReindex;
 extern int nScriptCheckThreads;
+extern int nBlockPipelineDepth;
 extern bool fTxIndex;
 extern bool fAddrIndex;
+extern bool fAddrSummary;
 extern bool fIsBareMultisigStd;
 extern bool fCheckBlockIndex;
 extern bool fCheckpointsEnabled;
 extern size_t nCoinCacheUsage;
+extern unsigned int nCoinCacheKeep;
 extern CFeeRate minRelayTxFee;
 extern bool fAlerts;
 
@@ -172,6 +202,23 @@ FILE* OpenUndoFile(const CDiskBlockPos &pos, bool fReadOnly = false);
 boost::filesystem::path GetBlockPosFilename(const CDiskBlockPos &pos, const char *prefix);
 /** Import blocks from an external file */
 bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos *dbp = NULL);
+/** Extract the identifiers a script is stored under in the address index */
+void ExtractAddrIds(const CScript& script, std::vector<uint160>& out);
+/**
+ * Get the identifier whose summary is credited with the amount of an output, given the
+ * identifiers of its script. Only spendable scripts with a single identifier are credited,
+ * so the balances of several identifiers never hold the same coins.
+ */
+bool GetAddrSummaryCredit(const CScript& script, const std::vector<uint160>& vAddrIds, uint160& addrid);
+/**
+ * Enable or disable the address index and its per-address summaries, and determine where
+ * ThreadAddrIndex resumes building it. Toggling the summaries rebuilds the index.
+ */
+bool InitAddrIndex(bool fEnable, bool fSummary);
+/** Height up to which the address index is built, or -1 if an outdated index is still being erased */
+int GetAddrIndexHeight();
+/** Build the address index in the background, until it caught up with the active chain */
+void ThreadAddrIndex();
 /** Initialize a new block tree database + block data on disk */
 bool InitBlockIndex();
 /** Load the block tree and coins database from disk */
@@ -189,6 +236,10 @@ bool ProcessMessages(CNode* pfrom);
 bool SendMessages(CNode* pto, bool fSendTrickle);
 /** Run an instance of the script checking thread */
 void ThreadScriptCheck();
+/** Run an instance of the address identifier extraction thread */
+void ThreadAddrIndexExtract();
+/** Read the blocks that are about to be connected and prefetch their inputs into pcoinsPrefetch */
+void ThreadBlockPipeline(CCoinsViewPrefetch* pcoinsPrefetch);
 /** Try to detect Partition (network isolation) attacks against us */
 void PartitionCheck(bool (*initialDownloadCheck)(), CCriticalSection& cs, const CBlockIndex *const &bestHeader, int64_t nPowTargetSpacing);
 /** Check whether we are doing an initial block download (synchronizing from disk or network) */
@@ -236,7 +287,20 @@ void PruneAndFlush();
 
 /** (try to) add transaction to memory pool **/
 bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransaction &tx, bool fLimitFree,
-                        bool* pfMissingInputs, bool fRejectAbsurdFee=false);
+                        bool* pfMissingInputs, bool fRejectAbsurdFee=false, bool fOverrideMempoolLimit=false);
+
+/** (try to) add transaction to memory pool, as if it had arrived at nAcceptTime **/
+bool AcceptToMemoryPoolWithTime(CTxMemPool& pool, CValidationState &state, const CTransaction &tx, bool fLimitFree,
+                                bool* pfMissingInputs, int64_t nAcceptTime, bool fRejectAbsurdFee=false, bool fOverrideMempoolLimit=false);
+
+/**
+ * Write the mempool, with entry times and prioritisations, to mempool.dat in the data directory.
+ * Does nothing until LoadMempool has completed, so that a shutdown during the load leaves the file intact.
+ */
+void DumpMempool();
+
+/** Add the transactions saved by DumpMempool to the mempool, returning false if there were none or the load was interrupted */
+bool LoadMempool();
 
 
 struct CNodeStateStats {
@@ -325,6 +389,111 @@ struct CExtDiskTxPos : public CDiskTxPos
 };
 
 
+/** Key of an unspent output in the address index */
+struct CAddrUnspentKey
+{
+    uint160 addrid;
+    COutPoint outpoint;
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion) {
+        READWRITE(addrid);
+        READWRITE(outpoint);
+    }
+
+    CAddrUnspentKey(const uint160 &addridIn, const COutPoint &outpointIn) : addrid(addridIn), outpoint(outpointIn) {
+    }
+
+    CAddrUnspentKey() {
+    }
+
+    friend bool operator<(const CAddrUnspentKey &a, const CAddrUnspentKey &b) {
+        if (a.addrid < b.addrid) return true;
+        if (b.addrid < a.addrid) return false;
+        return a.outpoint < b.outpoint;
+    }
+};
+
+/** Unspent output in the address index; a null output marks an output that is no longer unspent */
+struct CAddrUnspentValue
+{
+    CTxOut txout;
+    unsigned int nHeight;
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion) {
+        READWRITE(VARINT(nHeight));
+        READWRITE(REF(CTxOutCompressor(REF(txout))));
+    }
+
+    CAddrUnspentValue(const CTxOut &txoutIn, unsigned int nHeightIn) : txout(txoutIn), nHeight(nHeightIn) {
+    }
+
+    CAddrUnspentValue() {
+        SetNull();
+    }
+
+    void SetNull() {
+        txout.SetNull();
+        nHeight = 0;
+    }
+
+    bool IsNull() const {
+        return txout.IsNull();
+    }
+};
+
+typedef std::map<CAddrUnspentKey, CAddrUnspentValue> CAddrUnspentMap;
+
+/**
+ * Aggregated history of an address identifier in the address index. Outputs are counted
+ * once per identifier, even if their script contains it several times. Amounts are only
+ * credited as GetAddrSummaryCredit determines: multisig and other scripts with several
+ * identifiers count as transactions of each, but their amounts count for none, and
+ * unspendable outputs are not received.
+ */
+struct CAddrSummary
+{
+    uint64_t nTxCount;
+    CAmount nReceived;
+    CAmount nSent;
+    int nFirstHeight;
+    int nLastHeight;
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion) {
+        READWRITE(VARINT(nTxCount));
+        READWRITE(VARINT(nReceived));
+        READWRITE(VARINT(nSent));
+        READWRITE(VARINT(nFirstHeight));
+        READWRITE(VARINT(nLastHeight));
+    }
+
+    CAddrSummary() {
+        SetNull();
+    }
+
+    void SetNull() {
+        nTxCount = 0;
+        nReceived = 0;
+        nSent = 0;
+        nFirstHeight = 0;
+        nLastHeight = 0;
+    }
+
+    bool IsNull() const {
+        return nTxCount == 0;
+    }
+};
+
+typedef std::map<uint160, CAddrSummary> CAddrSummaryMap;
+
 CAmount GetMinRelayFee(const CTransaction& tx, unsigned int nBytes, bool fAllowFree);
 
 /**
@@ -366,10 +535,12 @@ unsigned int GetP2SHSigOpCount(const CTransaction& tx, const CCoinsViewCache& ma
 /**
  * Check whether all inputs of this transaction are valid (no double spends, scripts & sigs, amounts)
  * This does not modify the UTXO set. If pvChecks is not NULL, script checks are pushed onto it
- * instead of being performed inline.
+ * instead of being performed inline. If txdata is not NULL, the script checks use it to compute
+ * signature hashes, and it must outlive them.
  */
 bool CheckInputs(const CTransaction& tx, CValidationState &state, const CCoinsViewCache &view, bool fScriptChecks,
-                 unsigned int flags, bool cacheStore, std::vector<CScriptCheck> *pvChecks = NULL);
+                 unsigned int flags, bool cacheStore, std::vector<CScriptCheck> *pvChecks = NULL,
+                 const PrecomputedTransactionData* txdata = NULL);
 
 /** Apply the effects of this transaction on the UTXO set represented by view */
 void UpdateCoins(const CTransaction& tx, CValidationState &state, CCoinsViewCache &inputs, int nHeight);
@@ -398,6 +569,7 @@ bool CheckFinalTx(const CTransaction &tx);
 /** 
  * Closure representing one script verification
  * Note that this stores references to the spending transaction 
+ * and to the data precomputed from it
  */
 class CScriptCheck
 {
@@ -408,12 +580,13 @@ private:
     unsigned int nFlags;
     bool cacheStore;
     ScriptError error;
+    const PrecomputedTransactionData *txdata;
 
 public:
-    CScriptCheck(): ptxTo(0), nIn(0), nFlags(0), cacheStore(false), error(SCRIPT_ERR_UNKNOWN_ERROR) {}
-    CScriptCheck(const CCoins& txFromIn, const CTransaction& txToIn, unsigned int nInIn, unsigned int nFlagsIn, bool cacheIn) :
+    CScriptCheck(): ptxTo(0), nIn(0), nFlags(0), cacheStore(false), error(SCRIPT_ERR_UNKNOWN_ERROR), txdata(0) {}
+    CScriptCheck(const CCoins& txFromIn, const CTransaction& txToIn, unsigned int nInIn, unsigned int nFlagsIn, bool cacheIn, const PrecomputedTransactionData* txdataIn = NULL) :
         scriptPubKey(txFromIn.vout[txToIn.vin[nInIn].prevout.n].scriptPubKey),
-        ptxTo(&txToIn), nIn(nInIn), nFlags(nFlagsIn), cacheStore(cacheIn), error(SCRIPT_ERR_UNKNOWN_ERROR) { }
+        ptxTo(&txToIn), nIn(nInIn), nFlags(nFlagsIn), cacheStore(cacheIn), error(SCRIPT_ERR_UNKNOWN_ERROR), txdata(txdataIn) { }
 
     bool operator()();
 
@@ -424,6 +597,7 @@ public:
         std::swap(nFlags, check.nFlags);
         std::swap(cacheStore, check.cacheStore);
         std::swap(error, check.error);
+        std::swap(txdata, check.txdata);
     }
 
     ScriptError GetScriptError() const { return error; }
@@ -433,9 +607,19 @@ public:
 /** Functions for disk access for blocks */
 bool WriteBlockToDisk(CBlock& block, CDiskBlockPos& pos, const CMessageHeader::MessageStartChars& messageStart);
 bool ReadTransaction(CTransaction& tx, const CDiskTxPos& pos, uint256& hashBlock);
+/** Read the transactions at the given positions, in the same order, with the hashes of the blocks they are in */
+bool ReadTransactions(const std::vector<CDiskTxPos>& vpos, std::vector<CTransaction>& vtx, std::vector<uint256>& vhashBlock);
 bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos);
 bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex);
 bool FindTransactionsByDestination(const CTxDestination& dest, std::set<CExtDiskTxPos>& setpos);
+/** Find at most nMaxResults transactions of any of setDest in height order, starting at posStart (inclusive) */
+bool FindTransactionsByDestination(const std::set<CTxDestination>& setDest, std::vector<CExtDiskTxPos>& vpos, const CExtDiskTxPos& posStart, size_t nMaxResults);
+/** Find the transactions in the memory pool associated with any of setDest, in the order they entered the pool */
+bool FindMempoolTransactionsByDestination(const std::set<CTxDestination>& setDest, std::vector<CTransaction>& vtx);
+/** Find the unspent outputs associated with any of setDest, without accessing the block files */
+bool FindUnspentByDestination(const std::set<CTxDestination>& setDest, std::vector<std::pair<COutPoint, CAddrUnspentValue> >& vUnspent);
+/** Read the aggregated history of dest; a null summary is returned if it has none */
+bool GetAddrSummaryByDestination(const CTxDestination& dest, CAddrSummary& summary);
 
 
 /** Functions for validating blocks and updating the block tree */
@@ -443,7 +627,8 @@ bool FindTransactionsByDestination(const CTxDestination& dest, std::set<CExtDisk
 /** Undo the effects of this block (with given index) on the UTXO set represented by coins.
  *  In case pfClean is provided, operation will try to be tolerant about errors, and *pfClean
  *  will be true if no problems were found. Otherwise, the return value will be false in case
- *  of problems. Note that in any case, coins may be modified. */
+ *  of problems. Note that in any case, coins may be modified. The address index is only
+ *  updated if pfClean is not provided. */
 bool DisconnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex, CCoinsViewCache& coins, bool* pfClean = NULL);
 
 /** Apply the effects of this block (with given index) on the UTXO set represented by coins */
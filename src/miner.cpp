@@ -21,6 +21,9 @@
 #include "wallet/wallet.h"
 #endif
 
+#include <limits>
+
+#include <boost/scoped_ptr.hpp>
 #include <boost/thread.hpp>
 #include <boost/tuple/tuple.hpp>
 
@@ -31,53 +34,363 @@ using namespace std;
 // BitcoinMiner
 //
 
-//
-// Unconfirmed transactions in the memory pool often depend on other
-// transactions in the memory pool. When we select transactions from the
-// pool, we select by highest priority or fee rate, so we might consider
-// transactions that depend on transactions that aren't yet in the block.
-// The COrphan class keeps track of these 'temporary orphans' while
-// CreateBlock is figuring out which transactions to include.
-//
-class COrphan
+uint64_t nLastBlockTx = 0;
+uint64_t nLastBlockSize = 0;
+
+//! Seconds after which a block template is selected from the whole pool again
+static const int64_t BLOCK_TEMPLATE_MAX_AGE = 60;
+
+// The high-priority part of the block is filled by priority:
+typedef boost::tuple<double, CFeeRate, CTxMemPool::txiter> TxPriority;
+class TxPriorityCompare
 {
 public:
-    const CTransaction* ptx;
-    set<uint256> setDependsOn;
-    CFeeRate feeRate;
-    double dPriority;
-
-    COrphan(const CTransaction* ptxIn) : ptx(ptxIn), feeRate(0), dPriority(0)
+    bool operator()(const TxPriority& a, const TxPriority& b)
     {
+        if (a.get<0>() == b.get<0>())
+            return a.get<1>() < b.get<1>();
+        return a.get<0>() < b.get<0>();
     }
 };
 
-uint64_t nLastBlockTx = 0;
-uint64_t nLastBlockSize = 0;
+// The rest by the fee rate of the packages that transactions form with their
+// ancestors that are not in the block yet:
+struct CPackageScore
+{
+    CTxMemPool::txiter it;
+    uint64_t nSizeWithAncestors;
+    CAmount nModFeesWithAncestors;
 
-// We want to sort transactions by priority and fee rate, so:
-typedef boost::tuple<double, CFeeRate, const CTransaction*> TxPriority;
-class TxPriorityCompare
+    CPackageScore(CTxMemPool::txiter itIn, uint64_t nSizeIn, CAmount nFeesIn) :
+        it(itIn), nSizeWithAncestors(nSizeIn), nModFeesWithAncestors(nFeesIn) {}
+};
+
+static CPackageScore PackageFromIndex(CTxMemPool::indexed_transaction_set::index<ancestor_score>::type::iterator mi)
 {
-    bool byFee;
+    return CPackageScore(mempool.mapTx.project<0>(mi), mi->GetSizeWithAncestors(), mi->GetModFeesWithAncestors());
+}
+
+class PackageScoreCompare
+{
+public:
+    //! Whether a has a lower package fee rate than b
+    bool operator()(const CPackageScore& a, const CPackageScore& b) const
+    {
+        double f1 = (double)a.nModFeesWithAncestors * b.nSizeWithAncestors;
+        double f2 = (double)b.nModFeesWithAncestors * a.nSizeWithAncestors;
+        if (f1 == f2)
+            return b.it->GetTx().GetHash() < a.it->GetTx().GetHash();
+        return f1 < f2;
+    }
+};
 
+/**
+ * The block template kept between calls to CreateNewBlock. It is selected from the
+ * whole memory pool when the tip or the size settings change, or once it is
+ * BLOCK_TEMPLATE_MAX_AGE seconds old. In between, the transactions that enter the
+ * pool are appended to it if they fit, and the ones that leave it are removed with
+ * their descendants, keeping the selected set and the running size, sigop and fee
+ * totals current. Unconfirmed transactions in the memory pool often depend on
+ * other transactions in the pool; one is only added after all of its in-mempool
+ * ancestors.
+ */
+class CBlockAssembler
+{
 public:
-    TxPriorityCompare(bool _byFee) : byFee(_byFee) { }
+    CBlockTemplate tmpl;
+    boost::scoped_ptr<CCoinsViewCache> view;
+    const CBlockIndex* pindexPrev;
+    int nHeight;
+    unsigned int nBlockMaxSize;
+    unsigned int nBlockPrioritySize;
+    unsigned int nBlockMinSize;
+    int64_t nTimeSelected;
+
+    uint64_t nBlockSize;
+    uint64_t nBlockTx;
+    int nBlockSigOps;
+    CAmount nFees;
+
+    //! Transactions in the template
+    std::set<uint256> setInBlock;
+    //! Transactions that entered the pool, and ones in the template that left it, since the last call
+    std::vector<uint256> vAdded;
+    std::set<uint256> setRemoved;
+
+    //! While selecting: mempool entries in the block, and ones that cannot be added to it
+    CTxMemPool::setEntries inBlock;
+    CTxMemPool::setEntries failed;
+    //! Ancestor totals, not counting ancestors in the block, of entries with ancestors in the block
+    std::map<CTxMemPool::txiter, std::pair<uint64_t, CAmount>, CTxMemPool::CompareIteratorByHash> mapModified;
+    //! Heap of the packages in mapModified. Entries are pushed again when their totals change.
+    vector<CPackageScore> vecModified;
+
+    CBlockAssembler() :
+        pindexPrev(NULL), nHeight(0), nBlockMaxSize(0), nBlockPrioritySize(0), nBlockMinSize(0), nTimeSelected(0),
+        nBlockSize(0), nBlockTx(0), nBlockSigOps(0), nFees(0) {}
+
+    /** Whether the template can be brought up to date instead of selected again */
+    bool IsCurrent(const CBlockIndex* pindexPrevIn, unsigned int nBlockMaxSizeIn, unsigned int nBlockPrioritySizeIn, unsigned int nBlockMinSizeIn) const
+    {
+        return pindexPrev == pindexPrevIn && nHeight == pindexPrevIn->nHeight + 1 &&
+            nBlockMaxSize == nBlockMaxSizeIn && nBlockPrioritySize == nBlockPrioritySizeIn && nBlockMinSize == nBlockMinSizeIn &&
+            GetTime() - nTimeSelected < BLOCK_TEMPLATE_MAX_AGE;
+    }
 
-    bool operator()(const TxPriority& a, const TxPriority& b)
+    /** Start an empty template on top of pindexPrevIn, with a placeholder for the coinbase */
+    void Reset(const CBlockIndex* pindexPrevIn, unsigned int nBlockMaxSizeIn, unsigned int nBlockPrioritySizeIn, unsigned int nBlockMinSizeIn)
     {
-        if (byFee)
+        tmpl = CBlockTemplate();
+        tmpl.block.nTime = GetAdjustedTime();
+        tmpl.block.vtx.push_back(CTransaction());
+        tmpl.vTxFees.push_back(-1); // updated at end
+        tmpl.vTxSigOps.push_back(-1); // updated at end
+        view.reset(new CCoinsViewCache(pcoinsTip));
+        pindexPrev = pindexPrevIn;
+        nHeight = pindexPrevIn->nHeight + 1;
+        nBlockMaxSize = nBlockMaxSizeIn;
+        nBlockPrioritySize = nBlockPrioritySizeIn;
+        nBlockMinSize = nBlockMinSizeIn;
+        nTimeSelected = GetTime();
+        nBlockSize = 1000;
+        nBlockTx = 0;
+        nBlockSigOps = 100;
+        nFees = 0;
+        setInBlock.clear();
+        vAdded.clear();
+        setRemoved.clear();
+    }
+
+    /** Make the next call select the template again */
+    void Invalidate()
+    {
+        pindexPrev = NULL;
+        vAdded.clear();
+        setRemoved.clear();
+    }
+
+    /** Drop the state that refers to mempool entries, which may not outlive the call */
+    void EndSelection()
+    {
+        inBlock.clear();
+        failed.clear();
+        mapModified.clear();
+        vecModified.clear();
+    }
+
+    void EntryAdded(const CTxMemPoolEntry& entry)
+    {
+        if (!pindexPrev)
+            return;
+        // Nobody is asking for templates; don't queue up the pool's traffic
+        if (GetTime() - nTimeSelected >= BLOCK_TEMPLATE_MAX_AGE) {
+            Invalidate();
+            return;
+        }
+        vAdded.push_back(entry.GetTx().GetHash());
+    }
+
+    void EntryRemoved(const CTxMemPoolEntry& entry)
+    {
+        const uint256& hash = entry.GetTx().GetHash();
+        if (pindexPrev && setInBlock.count(hash))
+            setRemoved.insert(hash);
+    }
+
+    /** Apply the changes to the pool since the last call to a template that is still current */
+    void Update()
+    {
+        if (!setRemoved.empty())
+            RemoveTransactions();
+
+        // The new transactions go at the end, if their in-mempool parents are in the
+        // template and they pass the fee rule of the packages in a full selection.
+        BOOST_FOREACH(const uint256& hash, vAdded)
         {
-            if (a.get<1>() == b.get<1>())
-                return a.get<0>() < b.get<0>();
-            return a.get<1>() < b.get<1>();
+            CTxMemPool::txiter it = mempool.mapTx.find(hash);
+            if (it == mempool.mapTx.end() || setInBlock.count(hash))
+                continue;
+            bool fParentsInBlock = true;
+            BOOST_FOREACH(const CTxMemPool::txiter& parentit, mempool.GetMemPoolParents(it))
+                fParentsInBlock = fParentsInBlock && setInBlock.count(parentit->GetTx().GetHash());
+            if (!fParentsInBlock)
+                continue;
+
+            CFeeRate feeRate(it->GetModifiedFee(), it->GetTxSize());
+            double dPriorityDelta = 0;
+            CAmount nFeeDelta = 0;
+            mempool.ApplyDeltas(hash, dPriorityDelta, nFeeDelta);
+            if ((dPriorityDelta <= 0) && (nFeeDelta <= 0) && (feeRate < ::minRelayTxFee) && (nBlockSize + it->GetTxSize() >= nBlockMinSize))
+                continue;
+
+            TestAndAdd(it);
         }
+        vAdded.clear();
+        EndSelection();
+    }
+
+    /** Add a mempool entry whose in-mempool ancestors are all in the block, if it fits and is valid */
+    bool TestAndAdd(CTxMemPool::txiter it)
+    {
+        const CTransaction& tx = it->GetTx();
+        if (tx.IsCoinBase() || !IsFinalTx(tx, nHeight, tmpl.block.nTime))
+            return Fail(it);
+
+        // Size limits
+        unsigned int nTxSize = it->GetTxSize();
+        if (nBlockSize + nTxSize >= nBlockMaxSize)
+            return Fail(it);
+
+        // Legacy limits on sigOps:
+        unsigned int nTxSigOps = GetLegacySigOpCount(tx);
+        if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
+            return Fail(it);
+
+        if (!view->HaveInputs(tx))
+            return Fail(it);
+
+        CAmount nTxFees = view->GetValueIn(tx)-tx.GetValueOut();
+
+        // The sigop count and the validity of the scripts only depend on the outputs
+        // spent, so they are remembered by the mempool entry once known. The
+        // remaining checks depend on the height and are cheap.
+        bool fInputsVerified = it->InputsVerified();
+        if (fInputsVerified)
+            nTxSigOps = it->GetSigOpCount();
         else
+            nTxSigOps += GetP2SHSigOpCount(tx, *view);
+        if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
+            return Fail(it);
+
+        // Note that flags: we don't want to set mempool/IsStandard()
+        // policy here, but we still have to ensure that the block we
+        // create only contains transactions that are valid in new blocks.
+        CValidationState state;
+        if (fInputsVerified) {
+            if (!CheckInputs(tx, state, *view, false, MANDATORY_SCRIPT_VERIFY_FLAGS, true))
+                return Fail(it);
+        } else {
+            PrecomputedTransactionData txdata(tx);
+            if (!CheckInputs(tx, state, *view, true, MANDATORY_SCRIPT_VERIFY_FLAGS, true, NULL, &txdata))
+                return Fail(it);
+            mempool.mapTx.modify(it, set_inputs_verified(nTxSigOps));
+        }
+
+        UpdateCoins(tx, state, *view, nHeight);
+
+        // Added
+        Append(tx, nTxSize, nTxFees, nTxSigOps);
+        inBlock.insert(it);
+
+        // The packages of the descendants shrink
+        CTxMemPool::setEntries setDescendants;
+        mempool.CalculateDescendants(it, setDescendants);
+        setDescendants.erase(it);
+        BOOST_FOREACH(const CTxMemPool::txiter& descendantit, setDescendants) {
+            std::pair<uint64_t, CAmount>& modified = mapModified[descendantit];
+            if (modified.first == 0)
+                modified = std::make_pair(descendantit->GetSizeWithAncestors(), descendantit->GetModFeesWithAncestors());
+            modified.first -= nTxSize;
+            modified.second -= it->GetModifiedFee();
+            vecModified.push_back(CPackageScore(descendantit, modified.first, modified.second));
+            std::push_heap(vecModified.begin(), vecModified.end(), PackageScoreCompare());
+        }
+        return true;
+    }
+
+    /** Whether a package can still be added, and its totals are current */
+    bool IsCandidate(const CPackageScore& package) const
+    {
+        if (inBlock.count(package.it) || failed.count(package.it))
+            return false;
+        std::map<CTxMemPool::txiter, std::pair<uint64_t, CAmount>, CTxMemPool::CompareIteratorByHash>::const_iterator mit = mapModified.find(package.it);
+        if (mit == mapModified.end())
+            return true;
+        return mit->second.first == package.nSizeWithAncestors && mit->second.second == package.nModFeesWithAncestors;
+    }
+
+private:
+    bool Fail(CTxMemPool::txiter it)
+    {
+        failed.insert(it);
+        return false;
+    }
+
+    void Append(const CTransaction& tx, unsigned int nTxSize, CAmount nTxFees, unsigned int nTxSigOps)
+    {
+        tmpl.block.vtx.push_back(tx);
+        tmpl.vTxFees.push_back(nTxFees);
+        tmpl.vTxSigOps.push_back(nTxSigOps);
+        nBlockSize += nTxSize;
+        ++nBlockTx;
+        nBlockSigOps += nTxSigOps;
+        nFees += nTxFees;
+        setInBlock.insert(tx.GetHash());
+    }
+
+    /**
+     * Remove the transactions in setRemoved, and the ones in the template that spend
+     * their outputs, and play the rest again on a fresh view of the tip. The scripts
+     * were checked when they were added and are not checked again.
+     */
+    void RemoveTransactions()
+    {
+        std::vector<CTransaction> vtx;
+        std::vector<CAmount> vTxFees;
+        std::vector<int64_t> vTxSigOps;
+        vtx.swap(tmpl.block.vtx);
+        vTxFees.swap(tmpl.vTxFees);
+        vTxSigOps.swap(tmpl.vTxSigOps);
+        tmpl.block.vtx.push_back(vtx[0]);
+        tmpl.vTxFees.push_back(vTxFees[0]);
+        tmpl.vTxSigOps.push_back(vTxSigOps[0]);
+
+        view.reset(new CCoinsViewCache(pcoinsTip));
+        nBlockSize = 1000;
+        nBlockTx = 0;
+        nBlockSigOps = 100;
+        nFees = 0;
+        setInBlock.clear();
+        for (unsigned int i = 1; i < vtx.size(); i++)
         {
-            if (a.get<0>() == b.get<0>())
-                return a.get<1>() < b.get<1>();
-            return a.get<0>() < b.get<0>();
+            const CTransaction& tx = vtx[i];
+            bool fRemove = setRemoved.count(tx.GetHash());
+            BOOST_FOREACH(const CTxIn& txin, tx.vin)
+                fRemove = fRemove || setRemoved.count(txin.prevout.hash);
+            if (fRemove) {
+                setRemoved.insert(tx.GetHash());
+                continue;
+            }
+            CValidationState state;
+            UpdateCoins(tx, state, *view, nHeight);
+            Append(tx, ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION), vTxFees[i], vTxSigOps[i]);
         }
+        setRemoved.clear();
+    }
+};
+
+//! The template of the last call to CreateNewBlock, guarded by mempool.cs
+static CBlockAssembler blockassembler;
+
+static void BlockAssemblerEntryAdded(const CTxMemPoolEntry& entry)
+{
+    blockassembler.EntryAdded(entry);
+}
+
+static void BlockAssemblerEntryRemoved(const CTxMemPoolEntry& entry)
+{
+    blockassembler.EntryRemoved(entry);
+}
+
+//! Orders packages by their number of ancestors, so parents come before their children
+class CompareTxIterByAncestorCount
+{
+public:
+    bool operator()(const CTxMemPool::txiter& a, const CTxMemPool::txiter& b) const
+    {
+        if (a->GetCountWithAncestors() != b->GetCountWithAncestors())
+            return a->GetCountWithAncestors() < b->GetCountWithAncestors();
+        return a->GetTx().GetHash() < b->GetTx().GetHash();
     }
 };
 
@@ -90,6 +403,150 @@ void UpdateTime(CBlockHeader* pblock, const Consensus::Params& consensusParams,
         pblock->nBits = GetNextWorkRequired(pindexPrev, pblock, consensusParams);
 }
 
+/**
+ * Select a template from the whole memory pool into an empty assembler. The fee and
+ * priority of every transaction are kept up to date by its mempool entry, so only
+ * the transactions that make it into the block need their inputs looked up.
+ */
+static void SelectTransactions(CBlockAssembler& assembler, bool fPrintPriority)
+{
+    const int nHeight = assembler.nHeight;
+    const unsigned int nBlockMaxSize = assembler.nBlockMaxSize;
+    const unsigned int nBlockPrioritySize = assembler.nBlockPrioritySize;
+    const unsigned int nBlockMinSize = assembler.nBlockMinSize;
+
+    if (nBlockPrioritySize > 0) {
+        // This vector will be sorted into a priority queue. Transactions with
+        // in-mempool parents wait until all of those are in the block.
+        vector<TxPriority> vecPriority;
+        std::map<CTxMemPool::txiter, std::pair<size_t, TxPriority>, CTxMemPool::CompareIteratorByHash> mapWaiting;
+        vecPriority.reserve(mempool.mapTx.size());
+        for (CTxMemPool::txiter mi = mempool.mapTx.begin(); mi != mempool.mapTx.end(); ++mi)
+        {
+            double dPriority = mi->GetPriority(nHeight);
+            CAmount nFee = mi->GetFee();
+            mempool.ApplyDeltas(mi->GetTx().GetHash(), dPriority, nFee);
+            TxPriority priority(dPriority, CFeeRate(nFee, mi->GetTxSize()), mi);
+            size_t nParents = mempool.GetMemPoolParents(mi).size();
+            if (nParents)
+                mapWaiting.insert(std::make_pair(mi, std::make_pair(nParents, priority)));
+            else
+                vecPriority.push_back(priority);
+        }
+
+        TxPriorityCompare comparer;
+        std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
+
+        while (!vecPriority.empty())
+        {
+            // Take highest priority transaction off the priority queue:
+            double dPriority = vecPriority.front().get<0>();
+            CFeeRate feeRate = vecPriority.front().get<1>();
+            CTxMemPool::txiter it = vecPriority.front().get<2>();
+            std::pop_heap(vecPriority.begin(), vecPriority.end(), comparer);
+            vecPriority.pop_back();
+
+            // Prioritise by fee once past the priority size or we run out of high-priority
+            // transactions:
+            if ((assembler.nBlockSize + it->GetTxSize() >= nBlockPrioritySize) || !AllowFree(dPriority))
+                break;
+
+            if (!assembler.TestAndAdd(it))
+                continue;
+
+            if (fPrintPriority)
+            {
+                LogPrintf("priority %.1f fee %s txid %s\n",
+                    dPriority, feeRate.ToString(), it->GetTx().GetHash().ToString());
+            }
+
+            // Add transactions that depend on this one to the priority queue
+            BOOST_FOREACH(const CTxMemPool::txiter& childit, mempool.GetMemPoolChildren(it))
+            {
+                std::map<CTxMemPool::txiter, std::pair<size_t, TxPriority>, CTxMemPool::CompareIteratorByHash>::iterator itWaiting = mapWaiting.find(childit);
+                if (itWaiting != mapWaiting.end() && --itWaiting->second.first == 0)
+                {
+                    vecPriority.push_back(itWaiting->second.second);
+                    std::push_heap(vecPriority.begin(), vecPriority.end(), comparer);
+                    mapWaiting.erase(itWaiting);
+                }
+            }
+        }
+    }
+
+    // Fill the rest of the block by package fee rate, so a child paying for its
+    // parents pulls them in. Packages with ancestors in the block are kept in a
+    // heap with their reduced totals; the others are taken from the mempool's
+    // index of the ancestor totals, which is already in the right order.
+    CTxMemPool::indexed_transaction_set::index<ancestor_score>::type& byScore = mempool.mapTx.get<ancestor_score>();
+    CTxMemPool::indexed_transaction_set::index<ancestor_score>::type::iterator mi = byScore.begin();
+    PackageScoreCompare scoreComparer;
+    vector<CPackageScore>& vecModified = assembler.vecModified;
+
+    while (true)
+    {
+        // Skip the candidates that were added, failed, or have been superseded
+        while (mi != byScore.end() && !assembler.IsCandidate(PackageFromIndex(mi)))
+            ++mi;
+        while (!vecModified.empty() && !assembler.IsCandidate(vecModified.front()))
+        {
+            std::pop_heap(vecModified.begin(), vecModified.end(), scoreComparer);
+            vecModified.pop_back();
+        }
+        if (mi == byScore.end() && vecModified.empty())
+            break;
+
+        bool fModified = !vecModified.empty() && (mi == byScore.end() || scoreComparer(PackageFromIndex(mi), vecModified.front()));
+        CPackageScore package = fModified ? vecModified.front() : PackageFromIndex(mi);
+        if (fModified)
+        {
+            std::pop_heap(vecModified.begin(), vecModified.end(), scoreComparer);
+            vecModified.pop_back();
+        }
+        else
+            ++mi;
+        CTxMemPool::txiter it = package.it;
+
+        if (assembler.nBlockSize + package.nSizeWithAncestors >= nBlockMaxSize)
+            continue;
+
+        // Skip free transactions if we're past the minimum block size:
+        CFeeRate feeRate(package.nModFeesWithAncestors, package.nSizeWithAncestors);
+        double dPriorityDelta = 0;
+        CAmount nFeeDelta = 0;
+        mempool.ApplyDeltas(it->GetTx().GetHash(), dPriorityDelta, nFeeDelta);
+        if ((dPriorityDelta <= 0) && (nFeeDelta <= 0) && (feeRate < ::minRelayTxFee) && (assembler.nBlockSize + package.nSizeWithAncestors >= nBlockMinSize))
+            continue;
+
+        // The ancestors not in the block go first
+        CTxMemPool::setEntries setAncestors;
+        uint64_t nNoLimit = std::numeric_limits<uint64_t>::max();
+        std::string dummy;
+        mempool.CalculateMemPoolAncestors(*it, setAncestors, nNoLimit, nNoLimit, nNoLimit, nNoLimit, dummy, false);
+        vector<CTxMemPool::txiter> vecPackage(1, it);
+        BOOST_FOREACH(const CTxMemPool::txiter& ancestorit, setAncestors)
+            if (!assembler.inBlock.count(ancestorit))
+                vecPackage.push_back(ancestorit);
+        std::sort(vecPackage.begin(), vecPackage.end(), CompareTxIterByAncestorCount());
+
+        BOOST_FOREACH(const CTxMemPool::txiter& packageit, vecPackage)
+        {
+            if (assembler.failed.count(packageit) || !assembler.TestAndAdd(packageit))
+            {
+                // Its descendants in the package cannot be added either
+                assembler.failed.insert(it);
+                break;
+            }
+            if (fPrintPriority)
+            {
+                LogPrintf("package fee %s txid %s\n",
+                    feeRate.ToString(), packageit->GetTx().GetHash().ToString());
+            }
+        }
+    }
+    assembler.EndSelection();
+}
+
 CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn)
 {
     const CChainParams& chainparams = Params();
@@ -99,11 +556,6 @@ CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn)
         return NULL;
     CBlock *pblock = &pblocktemplate->block; // pointer for convenience
 
-    // -regtest only: allow overriding block.nVersion with
-    // -blockversion=N to test forking scenarios
-    if (Params().MineBlocksOnDemand())
-        pblock->nVersion = GetArg("-blockversion", pblock->nVersion);
-
     // Create coinbase tx
     CMutableTransaction txNew;
     txNew.vin.resize(1);
@@ -111,11 +563,6 @@ CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn)
     txNew.vout.resize(1);
     txNew.vout[0].scriptPubKey = scriptPubKeyIn;
 
-    // Add dummy coinbase tx as first transaction
-    pblock->vtx.push_back(CTransaction());
-    pblocktemplate->vTxFees.push_back(-1); // updated at end
-    pblocktemplate->vTxSigOps.push_back(-1); // updated at end
-
     // Largest block you're willing to create:
     unsigned int nBlockMaxSize = GetArg("-blockmaxsize", DEFAULT_BLOCK_MAX_SIZE);
     // Limit to betweeen 1K and MAX_BLOCK_SIZE-1K for sanity:
@@ -132,191 +579,37 @@ CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn)
     nBlockMinSize = std::min(nBlockMaxSize, nBlockMinSize);
 
     // Collect memory pool transactions into the block
-    CAmount nFees = 0;
-
     {
         LOCK2(cs_main, mempool.cs);
         CBlockIndex* pindexPrev = chainActive.Tip();
         const int nHeight = pindexPrev->nHeight + 1;
-        pblock->nTime = GetAdjustedTime();
-        CCoinsViewCache view(pcoinsTip);
-
-        // Priority order to process transactions
-        list<COrphan> vOrphan; // list memory doesn't move
-        map<uint256, vector<COrphan*> > mapDependers;
+        CBlockAssembler& assembler = blockassembler;
         bool fPrintPriority = GetBoolArg("-printpriority", false);
 
-        // This vector will be sorted into a priority queue:
-        vector<TxPriority> vecPriority;
-        vecPriority.reserve(mempool.mapTx.size());
-        for (map<uint256, CTxMemPoolEntry>::iterator mi = mempool.mapTx.begin();
-             mi != mempool.mapTx.end(); ++mi)
-        {
-            const CTransaction& tx = mi->second.GetTx();
-            if (tx.IsCoinBase() || !IsFinalTx(tx, nHeight, pblock->nTime))
-                continue;
-
-            COrphan* porphan = NULL;
-            double dPriority = 0;
-            CAmount nTotalIn = 0;
-            bool fMissingInputs = false;
-            BOOST_FOREACH(const CTxIn& txin, tx.vin)
-            {
-                // Read prev transaction
-                if (!view.HaveCoins(txin.prevout.hash))
-                {
-                    // This should never happen; all transactions in the memory
-                    // pool should connect to either transactions in the chain
-                    // or other transactions in the memory pool.
-                    if (!mempool.mapTx.count(txin.prevout.hash))
-                    {
-                        LogPrintf("ERROR: mempool transaction missing input\n");
-                        if (fDebug) assert("mempool transaction missing input" == 0);
-                        fMissingInputs = true;
-                        if (porphan)
-                            vOrphan.pop_back();
-                        break;
-                    }
-
-                    // Has to wait for dependencies
-                    if (!porphan)
-                    {
-                        // Use list for automatic deletion
-                        vOrphan.push_back(COrphan(&tx));
-                        porphan = &vOrphan.back();
-                    }
-                    mapDependers[txin.prevout.hash].push_back(porphan);
-                    porphan->setDependsOn.insert(txin.prevout.hash);
-                    nTotalIn += mempool.mapTx[txin.prevout.hash].GetTx().vout[txin.prevout.n].nValue;
-                    continue;
-                }
-                const CCoins* coins = view.AccessCoins(txin.prevout.hash);
-                assert(coins);
-
-                CAmount nValueIn = coins->vout[txin.prevout.n].nValue;
-                nTotalIn += nValueIn;
-
-                int nConf = nHeight - coins->nHeight;
-
-                dPriority += (double)nValueIn * nConf;
-            }
-            if (fMissingInputs) continue;
-
-            // Priority is sum(valuein * age) / modified_txsize
-            unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
-            dPriority = tx.ComputePriority(dPriority, nTxSize);
-
-            uint256 hash = tx.GetHash();
-            mempool.ApplyDeltas(hash, dPriority, nTotalIn);
-
-            CFeeRate feeRate(nTotalIn-tx.GetValueOut(), nTxSize);
-
-            if (porphan)
-            {
-                porphan->dPriority = dPriority;
-                porphan->feeRate = feeRate;
-            }
-            else
-                vecPriority.push_back(TxPriority(dPriority, feeRate, &mi->second.GetTx()));
+        // The template follows the pool from the first call on
+        static bool fListening = false;
+        if (!fListening) {
+            mempool.NotifyEntryAdded.connect(&BlockAssemblerEntryAdded);
+            mempool.NotifyEntryRemoved.connect(&BlockAssemblerEntryRemoved);
+            fListening = true;
         }
 
-        // Collect transactions into block
-        uint64_t nBlockSize = 1000;
-        uint64_t nBlockTx = 0;
-        int nBlockSigOps = 100;
-        bool fSortedByFee = (nBlockPrioritySize <= 0);
-
-        TxPriorityCompare comparer(fSortedByFee);
-        std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
-
-        while (!vecPriority.empty())
-        {
-            // Take highest priority transaction off the priority queue:
-            double dPriority = vecPriority.front().get<0>();
-            CFeeRate feeRate = vecPriority.front().get<1>();
-            const CTransaction& tx = *(vecPriority.front().get<2>());
-
-            std::pop_heap(vecPriority.begin(), vecPriority.end(), comparer);
-            vecPriority.pop_back();
-
-            // Size limits
-            unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
-            if (nBlockSize + nTxSize >= nBlockMaxSize)
-                continue;
-
-            // Legacy limits on sigOps:
-            unsigned int nTxSigOps = GetLegacySigOpCount(tx);
-            if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
-                continue;
-
-            // Skip free transactions if we're past the minimum block size:
-            const uint256& hash = tx.GetHash();
-            double dPriorityDelta = 0;
-            CAmount nFeeDelta = 0;
-            mempool.ApplyDeltas(hash, dPriorityDelta, nFeeDelta);
-            if (fSortedByFee && (dPriorityDelta <= 0) && (nFeeDelta <= 0) && (feeRate < ::minRelayTxFee) && (nBlockSize + nTxSize >= nBlockMinSize))
-                continue;
-
-            // Prioritise by fee once past the priority size or we run out of high-priority
-            // transactions:
-            if (!fSortedByFee &&
-                ((nBlockSize + nTxSize >= nBlockPrioritySize) || !AllowFree(dPriority)))
-            {
-                fSortedByFee = true;
-                comparer = TxPriorityCompare(fSortedByFee);
-                std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
-            }
-
-            if (!view.HaveInputs(tx))
-                continue;
-
-            CAmount nTxFees = view.GetValueIn(tx)-tx.GetValueOut();
-
-            nTxSigOps += GetP2SHSigOpCount(tx, view);
-            if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
-                continue;
-
-            // Note that flags: we don't want to set mempool/IsStandard()
-            // policy here, but we still have to ensure that the block we
-            // create only contains transactions that are valid in new blocks.
-            CValidationState state;
-            if (!CheckInputs(tx, state, view, true, MANDATORY_SCRIPT_VERIFY_FLAGS, true))
-                continue;
-
-            UpdateCoins(tx, state, view, nHeight);
-
-            // Added
-            pblock->vtx.push_back(tx);
-            pblocktemplate->vTxFees.push_back(nTxFees);
-            pblocktemplate->vTxSigOps.push_back(nTxSigOps);
-            nBlockSize += nTxSize;
-            ++nBlockTx;
-            nBlockSigOps += nTxSigOps;
-            nFees += nTxFees;
+        if (assembler.IsCurrent(pindexPrev, nBlockMaxSize, nBlockPrioritySize, nBlockMinSize)) {
+            assembler.Update();
+        } else {
+            assembler.Reset(pindexPrev, nBlockMaxSize, nBlockPrioritySize, nBlockMinSize);
+            SelectTransactions(assembler, fPrintPriority);
+        }
+        *pblocktemplate = assembler.tmpl;
 
-            if (fPrintPriority)
-            {
-                LogPrintf("priority %.1f fee %s txid %s\n",
-                    dPriority, feeRate.ToString(), tx.GetHash().ToString());
-            }
+        // -regtest only: allow overriding block.nVersion with
+        // -blockversion=N to test forking scenarios
+        if (Params().MineBlocksOnDemand())
+            pblock->nVersion = GetArg("-blockversion", pblock->nVersion);
 
-            // Add transactions that depend on this one to the priority queue
-            if (mapDependers.count(hash))
-            {
-                BOOST_FOREACH(COrphan* porphan, mapDependers[hash])
-                {
-                    if (!porphan->setDependsOn.empty())
-                    {
-                        porphan->setDependsOn.erase(hash);
-                        if (porphan->setDependsOn.empty())
-                        {
-                            vecPriority.push_back(TxPriority(porphan->dPriority, porphan->feeRate, porphan->ptx));
-                            std::push_heap(vecPriority.begin(), vecPriority.end(), comparer);
-                        }
-                    }
-                }
-            }
-        }
+        uint64_t nBlockSize = assembler.nBlockSize;
+        uint64_t nBlockTx = assembler.nBlockTx;
+        CAmount nFees = assembler.nFees;
 
         nLastBlockTx = nBlockTx;
         nLastBlockSize = nBlockSize;
@@ -336,8 +629,10 @@ CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn)
         pblocktemplate->vTxSigOps[0] = GetLegacySigOpCount(pblock->vtx[0]);
 
         CValidationState state;
-        if (!TestBlockValidity(state, *pblock, pindexPrev, false, false))
+        if (!TestBlockValidity(state, *pblock, pindexPrev, false, false)) {
+            assembler.Invalidate();
             throw std::runtime_error("CreateNewBlock(): TestBlockValidity failed");
+        }
     }
 
     return pblocktemplate.release();
@@ -25,7 +25,12 @@ struct CBlockTemplate
 
 /** Run the miner threads */
 void GenerateBitcoins(bool fGenerate, CWallet* pwallet, int nThreads);
-/** Generate a new block, without valid proof-of-work */
+/**
+ * Generate a new block, without valid proof-of-work. The transactions come from a
+ * template kept between calls: it is selected from the whole memory pool when the
+ * tip or the block size settings change, or once it is a minute old, and otherwise
+ * follows the transactions that enter and leave the pool since the last call.
+ */
 CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn);
 CBlockTemplate* CreateNewBlockWithKey(CReserveKey& reservekey);
 /** Modify the extranonce in a block */
@@ -2,13 +2,85 @@
 // Distributed under the MIT software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
+#if defined(HAVE_CONFIG_H)
+#include "config/bitcoin-config.h"
+#endif
+
 #include "pubkey.h"
 
 #include "eccryptoverify.h"
 
 #include "ecwrapper.h"
 
+#include <secp256k1.h>
+
+namespace {
+
+/** libsecp256k1 context for signature verification, which is built on first use */
+class CSecp256k1VerifyContext
+{
+public:
+    secp256k1_context_t* ctx;
+
+    CSecp256k1VerifyContext()
+    {
+        ctx = secp256k1_context_create(SECP256K1_CONTEXT_VERIFY);
+        assert(ctx != NULL);
+    }
+
+    ~CSecp256k1VerifyContext()
+    {
+        secp256k1_context_destroy(ctx);
+    }
+};
+
+const secp256k1_context_t* GetSecp256k1VerifyContext()
+{
+    static CSecp256k1VerifyContext context;
+    return context.ctx;
+}
+
+/**
+ * Whether a signature, without hash type, is strict DER as BIP66 requires.
+ * Format: 0x30 [total-length] 0x02 [R-length] [R] 0x02 [S-length] [S], where
+ * R and S are positive integers in their shortest encoding.
+ */
+bool IsStrictDERSignature(const std::vector<unsigned char>& sig)
+{
+    if (sig.size() < 8 || sig.size() > 72)
+        return false;
+    if (sig[0] != 0x30 || sig[1] != sig.size() - 2)
+        return false;
+    unsigned int lenR = sig[3];
+    if (5 + lenR >= sig.size())
+        return false;
+    unsigned int lenS = sig[5 + lenR];
+    if ((size_t)(lenR + lenS + 6) != sig.size())
+        return false;
+    if (sig[2] != 0x02 || lenR == 0 || (sig[4] & 0x80))
+        return false;
+    if (lenR > 1 && sig[4] == 0x00 && !(sig[5] & 0x80))
+        return false;
+    if (sig[lenR + 4] != 0x02 || lenS == 0 || (sig[lenR + 6] & 0x80))
+        return false;
+    if (lenS > 1 && sig[lenR + 6] == 0x00 && !(sig[lenR + 7] & 0x80))
+        return false;
+    return true;
+}
+
+}
+
 bool CPubKey::Verify(const uint256 &hash, const std::vector<unsigned char>& vchSig) const {
+#if defined(USE_SECP256K1_VERIFY)
+    // libsecp256k1 only parses strict DER. The other encodings OpenSSL accepts
+    // only occur before BIP66, and are left to OpenSSL.
+    if (IsStrictDERSignature(vchSig))
+        return VerifySecp256k1(hash, vchSig);
+#endif
+    return VerifyOpenSSL(hash, vchSig);
+}
+
+bool CPubKey::VerifyOpenSSL(const uint256 &hash, const std::vector<unsigned char>& vchSig) const {
     if (!IsValid())
         return false;
     CECKey key;
@@ -19,6 +91,12 @@ bool CPubKey::Verify(const uint256 &hash, const std::vector<unsigned char>& vchS
     return true;
 }
 
+bool CPubKey::VerifySecp256k1(const uint256 &hash, const std::vector<unsigned char>& vchSig) const {
+    if (!IsValid() || !IsStrictDERSignature(vchSig))
+        return false;
+    return secp256k1_ecdsa_verify(GetSecp256k1VerifyContext(), hash.begin(), &vchSig[0], vchSig.size(), begin(), size()) == 1;
+}
+
 bool CPubKey::RecoverCompact(const uint256 &hash, const std::vector<unsigned char>& vchSig) {
     if (vchSig.size() != 65)
         return false;
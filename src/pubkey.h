@@ -174,9 +174,16 @@ public:
     /**
      * Verify a DER signature (~72 bytes).
      * If this public key is not fully valid, the return value will be false.
+     * Uses OpenSSL, or libsecp256k1 for strict DER signatures if configured with --enable-secp256k1-verify.
      */
     bool Verify(const uint256& hash, const std::vector<unsigned char>& vchSig) const;
 
+    //! Verify a signature with OpenSSL, regardless of the configured implementation.
+    bool VerifyOpenSSL(const uint256& hash, const std::vector<unsigned char>& vchSig) const;
+
+    //! Verify a strict DER signature with libsecp256k1. Other encodings, which OpenSSL may accept, fail.
+    bool VerifySecp256k1(const uint256& hash, const std::vector<unsigned char>& vchSig) const;
+
     //! Recover a public key from a compact signature.
     bool RecoverCompact(const uint256& hash, const std::vector<unsigned char>& vchSig);
 
@@ -449,20 +449,14 @@ static bool rest_getutxos(AcceptedConnection* conn,
 
         for (size_t i = 0; i < vOutPoints.size(); i++) {
             CCoins coins;
-            uint256 hash = vOutPoints[i].hash;
-            if (view.GetCoins(hash, coins)) {
-                mempool.pruneSpent(hash, coins);
-                if (coins.IsAvailable(vOutPoints[i].n)) {
-                    hits[i] = true;
-                    // Safe to index into vout here because IsAvailable checked if it's off the end of the array, or if
-                    // n is valid but points to an already spent output (IsNull).
-                    CCoin coin;
-                    coin.nTxVer = coins.nVersion;
-                    coin.nHeight = coins.nHeight;
-                    coin.out = coins.vout.at(vOutPoints[i].n);
-                    assert(!coin.out.IsNull());
-                    outs.push_back(coin);
-                }
+            CCoin coin;
+            // Only the requested output is read, not the whole transaction
+            if (view.GetCoin(vOutPoints[i], coins, coin.out) && !mempool.isSpent(vOutPoints[i])) {
+                hits[i] = true;
+                coin.nTxVer = coins.nVersion;
+                coin.nHeight = coins.nHeight;
+                assert(!coin.out.IsNull());
+                outs.push_back(coin);
             }
 
             bitmapStringRepresentation.append(hits[i] ? "1" : "0"); // form a binary string representation (human-readable for json output)
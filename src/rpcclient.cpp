@@ -97,12 +97,15 @@ static const CRPCConvertParam vRPCConvertParams[] =
     { "searchrawtransactions", 2 },
     { "searchrawtransactions", 3 },
     { "searchrawtransactions", 4 },
+    { "searchrawtransactions", 6 },
     { "listallunspent", 1 },
     { "listallunspent", 2 },
     { "listallunspent", 3 },
     { "listallunspent", 4 },
+    { "listallunspent", 5 },
     { "getallbalance", 1 },
     { "getallbalance", 2 },
+    { "getallbalance", 3 },
 };
 
 class CRPCConvertTable
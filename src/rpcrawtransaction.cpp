@@ -22,6 +22,7 @@
 #include "wallet/wallet.h"
 #endif
 
+#include <limits>
 #include <stdint.h>
 
 #include <boost/assign/list_of.hpp>
@@ -812,123 +813,304 @@ Value sendrawtransaction(const Array& params, bool fHelp)
 // Address index extensions
 //
 
+/** Throw if the address index is not enabled, or still being built in the background */
+static void EnsureAddrIndexSynced()
+{
+    if (!fAddrIndex)
+        throw JSONRPCError(RPC_MISC_ERROR, "Address index not enabled");
+    int nHeight = GetAddrIndexHeight();
+    if (nHeight < chainActive.Height())
+        throw JSONRPCError(RPC_MISC_ERROR, strprintf("Address index syncing to height %d, currently at height %d", chainActive.Height(), nHeight));
+}
+
+/** The address argument of the address index calls is a string, or an array of strings */
+static Value_type AddrIndexDestinationsType(const Value& value)
+{
+    return value.type() == array_type ? array_type : str_type;
+}
+
+static std::set<CTxDestination> ParseAddrIndexDestinations(const Value& value)
+{
+    Array addresses;
+    if (value.type() == array_type)
+        addresses = value.get_array();
+    else
+        addresses.push_back(value);
+    if (addresses.empty())
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid parameter, no addresses");
+
+    std::set<CTxDestination> setDest;
+    BOOST_FOREACH(const Value& addr, addresses) {
+        CBitcoinAddress address(addr.get_str());
+        if (!address.IsValid())
+            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Invalid Bitcoin address: " + addr.get_str());
+        setDest.insert(address.Get());
+    }
+    return setDest;
+}
+
+/** Whether any of the destinations of an output is one of setDest */
+static bool HasAddrIndexDestination(const std::set<CTxDestination>& setDest, const std::vector<CTxDestination>& addresses)
+{
+    BOOST_FOREACH(const CTxDestination& dest, addresses)
+        if (setDest.count(dest))
+            return true;
+    return false;
+}
+
+//! Number of address index entries fetched from the database at once
+static const size_t nAddrIndexReadBatch = 1000;
+
+/** Position of the first possible address index entry at the given height */
+static CExtDiskTxPos AddrIndexStartOfHeight(int nHeight)
+{
+    return CExtDiskTxPos(CDiskTxPos(CDiskBlockPos(0, 0), 0), nHeight);
+}
+
+/** Position of the first possible address index entry following pos */
+static CExtDiskTxPos AddrIndexSuccessor(const CExtDiskTxPos& pos)
+{
+    CExtDiskTxPos posNext(pos);
+    posNext.nTxOffset++;
+    return posNext;
+}
+
+static std::string EncodeAddrIndexCursor(const CExtDiskTxPos& pos)
+{
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << pos;
+    return HexStr(ss.begin(), ss.end());
+}
+
+/** Parse the start argument of searchrawtransactions: a block height, or a cursor returned by a previous call */
+static CExtDiskTxPos DecodeAddrIndexStart(const std::string& strStart)
+{
+    if (strStart.empty())
+        return AddrIndexStartOfHeight(0);
+
+    int32_t nHeight;
+    if (ParseInt32(strStart, &nHeight) && nHeight >= 0)
+        return AddrIndexStartOfHeight(nHeight);
+
+    if (!IsHex(strStart))
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid start, expected block height or cursor");
+    std::vector<unsigned char> data(ParseHex(strStart));
+    CDataStream ss(data, SER_NETWORK, PROTOCOL_VERSION);
+    CExtDiskTxPos pos;
+    try {
+        ss >> pos;
+    } catch (const std::exception&) {
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid start, expected block height or cursor");
+    }
+    return pos;
+}
+
 Value searchrawtransactions(const Array &params, bool fHelp)
 {
-    if (fHelp || params.size() < 1 || params.size() > 5)
+    if (fHelp || params.size() < 1 || params.size() > 7)
         throw runtime_error(
-            "searchrawtransactions \"address\" ( verbose skip count includeorphans )\n"
+            "searchrawtransactions \"address\" ( verbose skip count includeorphans \"start\" includemempool )\n"
 
-            "\nReturns an array of all confirmed transactions associated with address.\n"
+            "\nReturns an array of all confirmed transactions associated with address,"
+            " ordered by block height. If an array of addresses is given, the transactions"
+            " of all of them are merged, and a transaction associated with several of them"
+            " is returned once.\n"
 
-            "\nNote: as per default, orphaned transactions, which are not part of the"
-            "active chain, are included in the results.\n"
+            "\nNote: the transactions of blocks which are disconnected from the active chain"
+            " are removed from the address index, so orphaned transactions are never included.\n"
 
             "\nArguments:\n"
-            "1. address          (string, required) The Bitcoin address\n"
+            "1. address          (string or array, required) The Bitcoin address, or an array of addresses\n"
             "2. verbose          (numeric, optional, default=1) If 0, return only transaction hex\n"
             "3. skip             (numeric, optional, default=0) The number of transactions to skip\n"
             "4. count            (numeric, optional, default=100) The number of transactions to return\n"
-            "5. includeorphans   (numeric, optional, default=1) If 0, exclude orphaned transactions\n"
+            "5. includeorphans   (numeric, optional, default=1) Ignored, only accepted for compatibility\n"
+            "6. \"start\"          (string, optional) If provided, start at this block height, or continue at the \"next\"\n"
+            "                    cursor of a previous call (\"\" to start at the beginning), and return an object\n"
+            "7. includemempool   (numeric, optional, default=0) If 1, append the unconfirmed transactions of the memory pool,\n"
+            "                    in the order they were received, to the last page of confirmed transactions\n"
+
+            "\nResult (if start is provided):\n"
+            "{\n"
+            "  \"transactions\" : [ ... ],   (array) The transactions, as without start\n"
+            "  \"next\" : \"cursor\"           (string) Cursor to continue with, or null if there are no further results\n"
+            "}\n"
 
             "\nExamples\n"
             + HelpExampleCli("searchrawtransactions", "1EXoDusjGwvnjZUyKkxZ4UHEf77z6A5S4P")
             + HelpExampleCli("searchrawtransactions", "1EXoDusjGwvnjZUyKkxZ4UHEf77z6A5S4P 1 500 5 0")
+            + HelpExampleCli("searchrawtransactions", "1EXoDusjGwvnjZUyKkxZ4UHEf77z6A5S4P 1 0 100 0 \"350000\"")
             + HelpExampleRpc("searchrawtransactions", "1EXoDusjGwvnjZUyKkxZ4UHEf77z6A5S4P, 1, 500, 5, 0")
+            + HelpExampleRpc("searchrawtransactions", "[\"1EXoDusjGwvnjZUyKkxZ4UHEf77z6A5S4P\", \"1BxtgEa8UcrMzVZaW32zVyJh4Sg4KGFzxA\"], 1, 0, 100")
         );
 
-    RPCTypeCheck(params, boost::assign::list_of(str_type)(int_type)(int_type)(int_type)(int_type));
+    RPCTypeCheck(params, boost::assign::list_of(AddrIndexDestinationsType(params[0]))(int_type)(int_type)(int_type)(int_type)(str_type)(int_type));
 
     LOCK(cs_main);
 
-    if (!fAddrIndex)
-        throw JSONRPCError(RPC_MISC_ERROR, "Address index not enabled");
+    EnsureAddrIndexSynced();
 
-    CBitcoinAddress address(params[0].get_str());
-    if (!address.IsValid())
-        throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Invalid Bitcoin address");
-    CTxDestination dest = address.Get();
-
-    std::set<CExtDiskTxPos> setpos;
-    if (!FindTransactionsByDestination(dest, setpos))
-        throw JSONRPCError(RPC_DATABASE_ERROR, "Cannot search for address");
+    std::set<CTxDestination> setDest = ParseAddrIndexDestinations(params[0]);
 
     bool fVerbose = true;
     if (params.size() > 1)
         fVerbose = (params[1].get_int() != 0);
 
+    bool fCursor = params.size() > 5;
+    CExtDiskTxPos posStart = AddrIndexStartOfHeight(0);
+    if (fCursor)
+        posStart = DecodeAddrIndexStart(params[5].get_str());
+
     int nSkip = 0;
     if (params.size() > 2)
         nSkip = params[2].get_int();
-    if (nSkip < 0)
-        nSkip += setpos.size();
+    if (nSkip < 0) {
+        // Skipping from the end requires the number of entries, but not the transactions
+        std::vector<CExtDiskTxPos> vpos;
+        if (!FindTransactionsByDestination(setDest, vpos, posStart, std::numeric_limits<size_t>::max()))
+            throw JSONRPCError(RPC_DATABASE_ERROR, "Cannot search for address");
+        nSkip = std::max(0, nSkip + (int)vpos.size());
+    }
 
     int nCount = 100;
     if (params.size() > 3)
         nCount = params[3].get_int();
 
-    bool fIncludeOrphans = true;
-    if (params.size() > 4)
-        fIncludeOrphans = (params[4].get_int() != 0);
-
-    std::set<CExtDiskTxPos>::const_iterator it = setpos.begin();
-    while (it != setpos.end() && nSkip--)
-        it++;
+    bool fIncludeMempool = false;
+    if (params.size() > 6)
+        fIncludeMempool = (params[6].get_int() != 0);
 
     Array result;
-    while (it != setpos.end() && nCount > 0) {
-        CTransaction tx;
-        uint256 hashBlock;
-        if (!ReadTransaction(tx, *it, hashBlock))
+    bool fExhausted = false;
+    while (nCount > 0 && !fExhausted) {
+        size_t nBatch = std::min(nAddrIndexReadBatch, (size_t)nSkip + nCount);
+        std::vector<CExtDiskTxPos> vpos;
+        if (!FindTransactionsByDestination(setDest, vpos, posStart, nBatch))
+            throw JSONRPCError(RPC_DATABASE_ERROR, "Cannot search for address");
+        fExhausted = vpos.size() < nBatch;
+
+        // Skip entries, then read the transactions of up to nCount entries at once
+        size_t nFirst = std::min((size_t)nSkip, vpos.size());
+        size_t nLast = std::min(vpos.size(), nFirst + nCount);
+        nSkip -= nFirst;
+        if (nLast < vpos.size())
+            fExhausted = false;
+        if (nLast > 0)
+            posStart = AddrIndexSuccessor(vpos[nLast - 1]);
+
+        std::vector<CDiskTxPos> vposRead(vpos.begin() + nFirst, vpos.begin() + nLast);
+        std::vector<CTransaction> vtx;
+        std::vector<uint256> vhashBlock;
+        if (!ReadTransactions(vposRead, vtx, vhashBlock))
             throw JSONRPCError(RPC_DESERIALIZATION_ERROR, "Cannot read transaction from disk");
 
-        bool fOrphaned = true;
-        if (!fIncludeOrphans && !hashBlock.IsNull()) {
-            BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
-            if (mi != mapBlockIndex.end() && (*mi).second) {
-                CBlockIndex* pindex = (*mi).second;
-                fOrphaned = !chainActive.Contains(pindex);
+        for (size_t i = 0; i < vtx.size(); i++) {
+            const CTransaction& tx = vtx[i];
+            const uint256& hashBlock = vhashBlock[i];
+
+            std::string strHex = EncodeHexTx(tx);
+
+            if (fVerbose) {
+                Object entry;
+                entry.push_back(Pair("hex", strHex));
+                TxToJSON(tx, hashBlock, entry);
+                result.push_back(entry);
+            } else {
+                result.push_back(strHex);
             }
+
+            nCount--;
         }
-        if (!fIncludeOrphans && fOrphaned) {
-            it++;
-            continue;
+    }
+
+    if (fIncludeMempool && fExhausted) {
+        std::vector<CTransaction> vtx;
+        if (!FindMempoolTransactionsByDestination(setDest, vtx))
+            throw JSONRPCError(RPC_DATABASE_ERROR, "Cannot search for address");
+        BOOST_FOREACH(const CTransaction& tx, vtx) {
+            std::string strHex = EncodeHexTx(tx);
+            if (fVerbose) {
+                Object entry;
+                entry.push_back(Pair("hex", strHex));
+                TxToJSON(tx, uint256(), entry);
+                result.push_back(entry);
+            } else {
+                result.push_back(strHex);
+            }
         }
+    }
 
-        std::string strHex = EncodeHexTx(tx);
+    if (!fCursor)
+        return result;
 
-        if (fVerbose) {
-            Object entry;
-            entry.push_back(Pair("hex", strHex));
-            TxToJSON(tx, hashBlock, entry);
-            result.push_back(entry);
-        } else {
-            result.push_back(strHex);
-        }
+    Object ret;
+    ret.push_back(Pair("transactions", result));
+    ret.push_back(Pair("next", fExhausted ? Value::null : Value(EncodeAddrIndexCursor(posStart))));
+    return ret;
+}
 
-        nCount--;
-        it++;
+/**
+ * Remove the outputs spent by transactions in the memory pool from vUnspent, and add the
+ * outputs of transactions in the memory pool, which are not spent yet, at the height of the next block.
+ */
+static void AddMempoolUnspent(const std::set<CTxDestination>& setDest, std::vector<std::pair<COutPoint, CAddrUnspentValue> >& vUnspent)
+{
+    std::vector<std::pair<COutPoint, CAddrUnspentValue> > vResult;
+    vResult.reserve(vUnspent.size());
+    std::vector<std::pair<COutPoint, CAddrUnspentValue> >::const_iterator it = vUnspent.begin();
+    for (; it != vUnspent.end(); it++)
+        if (!mempool.isSpent(it->first))
+            vResult.push_back(*it);
+
+    std::vector<CTransaction> vtx;
+    if (!FindMempoolTransactionsByDestination(setDest, vtx))
+        throw JSONRPCError(RPC_DATABASE_ERROR, "Cannot search for address");
+    BOOST_FOREACH(const CTransaction& tx, vtx) {
+        for (unsigned int i = 0; i < tx.vout.size(); i++) {
+            COutPoint outpoint(tx.GetHash(), i);
+            if (mempool.isSpent(outpoint))
+                continue;
+            CAddrUnspentValue value;
+            value.txout = tx.vout[i];
+            value.nHeight = chainActive.Height() + 1;
+            vResult.push_back(std::make_pair(outpoint, value));
+        }
     }
 
-    return result;
+    vUnspent.swap(vResult);
 }
 
+/** Orders unspent outputs by height, and then by outpoint */
+struct CompareAddrUnspentByHeight
+{
+    bool operator()(const std::pair<COutPoint, CAddrUnspentValue>& a, const std::pair<COutPoint, CAddrUnspentValue>& b) const
+    {
+        if (a.second.nHeight != b.second.nHeight)
+            return a.second.nHeight < b.second.nHeight;
+        return a.first < b.first;
+    }
+};
+
 Value listallunspent(const Array &params, bool fHelp)
 {
-    if (fHelp || params.size() < 1 || params.size() > 5)
+    if (fHelp || params.size() < 1 || params.size() > 6)
         throw runtime_error(
-            "listallunspent \"address\" ( verbose minconf maxconf maxreqsigs )\n"
+            "listallunspent \"address\" ( verbose minconf maxconf maxreqsigs includemempool )\n"
 
             "\nReturns an array of confirmed, unspent transaction outputs with between"
             " minconf and maxconf (inclusive) confirmations, spendable by the provided"
             " address, whereby maximal maxreqsigs signatures are required to redeem the"
-            " output.\n"
+            " output. If an array of addresses is given, an output spendable by several"
+            " of them is returned once.\n"
 
             "\nArguments:\n"
-            "1. address          (string, required) The Bitcoin address\n"
+            "1. address          (string or array, required) The Bitcoin address, or an array of addresses\n"
             "2. verbose          (numeric, optional, default=0) If 0, exclude reqSigs, addresses, scriptPubKey (asm, hex), blockhash, blocktime, blockheight\n"
             "3. minconf          (numeric, optional, default=1) The minimum confirmations to filter.\n"
             "4. maxconf          (numeric, optional, default=9999999) The maximum confirmations to filter\n"
             "5. maxreqsigs       (numeric, optional, default=1) The number of signatures required to spend the output\n"
+            "6. includemempool   (numeric, optional, default=0) If 1, include the outputs of unconfirmed transactions with\n"
+            "                    0 confirmations, and exclude outputs spent by unconfirmed transactions\n"
 
             "\nExamples\n"
             + HelpExampleCli("listallunspent", "1BxtgEa8UcrMzVZaW32zVyJh4Sg4KGFzxA")
@@ -936,21 +1118,20 @@ Value listallunspent(const Array &params, bool fHelp)
             + HelpExampleRpc("listallunspent", "1BxtgEa8UcrMzVZaW32zVyJh4Sg4KGFzxA, 1, 0, 100, 1")
         );
     
-    RPCTypeCheck(params, boost::assign::list_of(str_type)(int_type)(int_type)(int_type)(int_type));
+    RPCTypeCheck(params, boost::assign::list_of(AddrIndexDestinationsType(params[0]))(int_type)(int_type)(int_type)(int_type)(int_type));
 
     LOCK(cs_main);
 
-    if (!fAddrIndex)
-        throw JSONRPCError(RPC_MISC_ERROR, "Address index not enabled");
+    EnsureAddrIndexSynced();
 
-    CBitcoinAddress address(params[0].get_str());
-    if (!address.IsValid())
-        throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Invalid Bitcoin address");
-    CTxDestination dest = address.Get();
+    std::set<CTxDestination> setDest = ParseAddrIndexDestinations(params[0]);
 
-    std::set<CExtDiskTxPos> setpos;
-    if (!FindTransactionsByDestination(dest, setpos))
+    std::vector<std::pair<COutPoint, CAddrUnspentValue> > vUnspent;
+    if (!FindUnspentByDestination(setDest, vUnspent))
         throw JSONRPCError(RPC_DATABASE_ERROR, "Cannot search for address");
+    if (params.size() > 5 && params[5].get_int() != 0)
+        AddMempoolUnspent(setDest, vUnspent);
+    std::sort(vUnspent.begin(), vUnspent.end(), CompareAddrUnspentByHeight());
 
     bool fVerbose = false;
     if (params.size() > 1)
@@ -969,75 +1150,58 @@ Value listallunspent(const Array &params, bool fHelp)
         nMaxReqSigs = params[4].get_int();
 
     Array results;
-    std::set<CExtDiskTxPos>::const_iterator it = setpos.begin();
-    while (it != setpos.end()) {
-        CTransaction tx;
-        uint256 hashBlock;
-        if (!ReadTransaction(tx, *it, hashBlock))
-            throw JSONRPCError(RPC_DESERIALIZATION_ERROR, "Cannot read transaction from disk");
-
-        CCoins coins;
-        pcoinsTip->GetCoins(tx.GetHash(), coins);
-        for (unsigned int n = 0; n < tx.vout.size(); n++) {
-            const CTxOut& txout = tx.vout[n];
-            if (!(coins.IsAvailable(n) && txout.nValue > 0))
-                continue;
-
-            txnouttype type;
-            vector<CTxDestination> addresses;
-            int nRequired;
-            if (!ExtractDestinations(txout.scriptPubKey, type, addresses, nRequired))
-                continue;
-            if (nMaxReqSigs < nRequired)
-                continue;
-            if (std::find(addresses.begin(), addresses.end(), dest) == addresses.end())
-                continue;
+    std::vector<std::pair<COutPoint, CAddrUnspentValue> >::const_iterator it = vUnspent.begin();
+    for (; it != vUnspent.end(); it++) {
+        const COutPoint& outpoint = it->first;
+        const CTxOut& txout = it->second.txout;
+        if (!(txout.nValue > 0))
+            continue;
 
-            int nDepth = 0;
-            int nHeight = 0;
-            int64_t nTime = 0;
-            
-            BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
-            if (mi != mapBlockIndex.end() && (*mi).second) {
-                CBlockIndex* pindex = (*mi).second;
-                if (chainActive.Contains(pindex)) {
-                    nHeight = pindex->nHeight;
-                    nDepth = chainActive.Height() - nHeight + 1;
-                    nTime = pindex->GetBlockTime();
-                }
-            }
+        txnouttype type;
+        vector<CTxDestination> addresses;
+        int nRequired;
+        if (!ExtractDestinations(txout.scriptPubKey, type, addresses, nRequired))
+            continue;
+        if (nMaxReqSigs < nRequired)
+            continue;
+        if (!HasAddrIndexDestination(setDest, addresses))
+            continue;
 
-            if (nDepth < nMinDepth || nDepth > nMaxDepth)
-                continue;
+        // The unspent outputs of the index are always part of the active chain, or in the memory pool
+        int nHeight = it->second.nHeight;
+        int nDepth = chainActive.Height() - nHeight + 1;
+        if (nDepth < nMinDepth || nDepth > nMaxDepth)
+            continue;
 
-            Object entry;
-            entry.push_back(Pair("txid", tx.GetHash().GetHex()));
-            entry.push_back(Pair("vout", (int64_t)n));
-            entry.push_back(Pair("amount", ValueFromAmount(txout.nValue)));
-            entry.push_back(Pair("type", GetTxnOutputType(type)));
+        Object entry;
+        entry.push_back(Pair("txid", outpoint.hash.GetHex()));
+        entry.push_back(Pair("vout", (int64_t)outpoint.n));
+        entry.push_back(Pair("amount", ValueFromAmount(txout.nValue)));
+        entry.push_back(Pair("type", GetTxnOutputType(type)));
 
-            if (fVerbose) {
-                entry.push_back(Pair("reqSigs", nRequired));
-                Array a;
-                BOOST_FOREACH(const CTxDestination& addrinner, addresses)
-                    a.push_back(CBitcoinAddress(addrinner).ToString());
-                entry.push_back(Pair("addresses", a));
-
-                Object pkobj;
-                const CScript& pk = txout.scriptPubKey;
-                pkobj.push_back(Pair("asm", pk.ToString()));
-                pkobj.push_back(Pair("hex", HexStr(pk.begin(), pk.end())));
-                entry.push_back(Pair("scriptPubKey", pkobj));
-
-                entry.push_back(Pair("blockhash", hashBlock.GetHex()));
-                entry.push_back(Pair("blocktime", nTime));
+        if (fVerbose) {
+            entry.push_back(Pair("reqSigs", nRequired));
+            Array a;
+            BOOST_FOREACH(const CTxDestination& addrinner, addresses)
+                a.push_back(CBitcoinAddress(addrinner).ToString());
+            entry.push_back(Pair("addresses", a));
+
+            Object pkobj;
+            const CScript& pk = txout.scriptPubKey;
+            pkobj.push_back(Pair("asm", pk.ToString()));
+            pkobj.push_back(Pair("hex", HexStr(pk.begin(), pk.end())));
+            entry.push_back(Pair("scriptPubKey", pkobj));
+
+            CBlockIndex* pindex = chainActive[nHeight];
+            if (pindex) {
+                entry.push_back(Pair("blockhash", pindex->GetBlockHash().GetHex()));
+                entry.push_back(Pair("blocktime", pindex->GetBlockTime()));
                 entry.push_back(Pair("blockheight", nHeight));
             }
-
-            entry.push_back(Pair("confirmations", nDepth));
-            results.push_back(entry);
         }
-        it++;
+
+        entry.push_back(Pair("confirmations", nDepth));
+        results.push_back(entry);
     }
 
     return results;
@@ -1045,18 +1209,21 @@ Value listallunspent(const Array &params, bool fHelp)
 
 Value getallbalance(const Array &params, bool fHelp)
 {
-    if (fHelp || params.size() < 1 || params.size() > 3)
+    if (fHelp || params.size() < 1 || params.size() > 4)
         throw runtime_error(
-            "getallbalance \"address\" ( minconf maxreqsigs )\n"
+            "getallbalance \"address\" ( minconf maxreqsigs includemempool )\n"
 
             "\nReturns the sum of confirmed, spendable transaction outputs by address"
             " with at least minconf confirmations, whereby maximal maxreqsigs signatures"
-            " are allowed to be required to redeem an output.\n"
+            " are allowed to be required to redeem an output. If an array of addresses is"
+            " given, the outputs of all of them are summed up once each.\n"
 
             "\nArguments:\n"
-            "1. address          (string, required) The Bitcoin address\n"
+            "1. address          (string or array, required) The Bitcoin address, or an array of addresses\n"
             "2. minconf          (numeric, optional, default=1) The minimum confirmations to filter\n"
             "3. maxreqsigs       (numeric, optional, default=1) The number of signatures required to spend an output\n"
+            "4. includemempool   (numeric, optional, default=0) If 1, include the outputs of unconfirmed transactions with\n"
+            "                    0 confirmations, and exclude outputs spent by unconfirmed transactions\n"
 
             "\nExamples\n"
             + HelpExampleCli("getallbalance", "1BxtgEa8UcrMzVZaW32zVyJh4Sg4KGFzxA")
@@ -1064,21 +1231,19 @@ Value getallbalance(const Array &params, bool fHelp)
             + HelpExampleRpc("getallbalance", "1BxtgEa8UcrMzVZaW32zVyJh4Sg4KGFzxA, 0, 1")
         );
     
-    RPCTypeCheck(params, boost::assign::list_of(str_type)(int_type)(int_type));
+    RPCTypeCheck(params, boost::assign::list_of(AddrIndexDestinationsType(params[0]))(int_type)(int_type)(int_type));
 
     LOCK(cs_main);
 
-    if (!fAddrIndex)
-        throw JSONRPCError(RPC_MISC_ERROR, "Address index not enabled");
+    EnsureAddrIndexSynced();
 
-    CBitcoinAddress address(params[0].get_str());
-    if (!address.IsValid())
-        throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Invalid Bitcoin address");
-    CTxDestination dest = address.Get();
+    std::set<CTxDestination> setDest = ParseAddrIndexDestinations(params[0]);
 
-    std::set<CExtDiskTxPos> setpos;
-    if (!FindTransactionsByDestination(dest, setpos))
+    std::vector<std::pair<COutPoint, CAddrUnspentValue> > vUnspent;
+    if (!FindUnspentByDestination(setDest, vUnspent))
         throw JSONRPCError(RPC_DATABASE_ERROR, "Cannot search for address");
+    if (params.size() > 3 && params[3].get_int() != 0)
+        AddMempoolUnspent(setDest, vUnspent);
 
     int nMinDepth = 1;
     if (params.size() > 1)
@@ -1089,50 +1254,87 @@ Value getallbalance(const Array &params, bool fHelp)
         nMaxReqSigs = params[2].get_int();
 
     int64_t nBalance = 0;
-    std::set<CExtDiskTxPos>::const_iterator it = setpos.begin();
-    while (it != setpos.end()) {
-        CTransaction tx;
-        uint256 hashBlock;
-        if (!ReadTransaction(tx, *it, hashBlock))
-            throw JSONRPCError(RPC_DESERIALIZATION_ERROR, "Cannot read transaction from disk");
-
-        CCoins coins;
-        pcoinsTip->GetCoins(tx.GetHash(), coins);
-        for (unsigned int i = 0; i < tx.vout.size(); i++) {
-            const CTxOut& txout = tx.vout[i];
-            if (!(coins.IsAvailable(i) && txout.nValue > 0))
-                continue;
-
-            txnouttype type;
-            vector<CTxDestination> addresses;
-            int nRequired;
-            if (!ExtractDestinations(txout.scriptPubKey, type, addresses, nRequired))
-                continue;
-            if (nMaxReqSigs < nRequired)
-                continue;
-            if (std::find(addresses.begin(), addresses.end(), dest) == addresses.end())
-                continue;
+    std::vector<std::pair<COutPoint, CAddrUnspentValue> >::const_iterator it = vUnspent.begin();
+    for (; it != vUnspent.end(); it++) {
+        const CTxOut& txout = it->second.txout;
+        if (!(txout.nValue > 0))
+            continue;
 
-            int nDepth = 0;
-            BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
-            if (mi != mapBlockIndex.end() && (*mi).second) {
-                CBlockIndex* pindex = (*mi).second;
-                if (chainActive.Contains(pindex)) {
-                    nDepth = chainActive.Height() - pindex->nHeight + 1;
-                }
-            }
+        txnouttype type;
+        vector<CTxDestination> addresses;
+        int nRequired;
+        if (!ExtractDestinations(txout.scriptPubKey, type, addresses, nRequired))
+            continue;
+        if (nMaxReqSigs < nRequired)
+            continue;
+        if (!HasAddrIndexDestination(setDest, addresses))
+            continue;
 
-            if (nDepth < nMinDepth)
-                continue;
+        int nDepth = chainActive.Height() - (int)it->second.nHeight + 1;
+        if (nDepth < nMinDepth)
+            continue;
 
-            nBalance += txout.nValue;
-        }
-        it++;
+        nBalance += txout.nValue;
     }
 
     return ValueFromAmount(nBalance);
 }
 
+Value getaddresssummary(const Array &params, bool fHelp)
+{
+    if (fHelp || params.size() != 1)
+        throw runtime_error(
+            "getaddresssummary \"address\"\n"
+
+            "\nReturns a summary of the confirmed history of address, as maintained by the"
+            " address index with -addrsummary. Amounts only include outputs that pay address"
+            " alone: outputs of multisig scripts count as transactions of each of their keys,"
+            " but their amounts count for none of them, and unspendable outputs are not received.\n"
+
+            "\nArguments:\n"
+            "1. address          (string, required) The Bitcoin address\n"
+
+            "\nResult:\n"
+            "{\n"
+            "  \"address\" : \"address\",  (string) The Bitcoin address\n"
+            "  \"txcount\" : n,          (numeric) The number of transactions spending from or paying to address\n"
+            "  \"received\" : x.xxx,     (numeric) The total amount received in btc\n"
+            "  \"sent\" : x.xxx,         (numeric) The total amount spent in btc\n"
+            "  \"balance\" : x.xxx,      (numeric) The amount received, but not spent yet in btc\n"
+            "  \"firstheight\" : n,      (numeric) The height of the first block with a transaction, or null\n"
+            "  \"lastheight\" : n        (numeric) The height of the last block with a transaction, or null\n"
+            "}\n"
+
+            "\nExamples\n"
+            + HelpExampleCli("getaddresssummary", "1BxtgEa8UcrMzVZaW32zVyJh4Sg4KGFzxA")
+            + HelpExampleRpc("getaddresssummary", "1BxtgEa8UcrMzVZaW32zVyJh4Sg4KGFzxA")
+        );
+
+    LOCK(cs_main);
+
+    EnsureAddrIndexSynced();
+    if (!fAddrSummary)
+        throw JSONRPCError(RPC_MISC_ERROR, "Address summaries not enabled");
+
+    CBitcoinAddress address(params[0].get_str());
+    if (!address.IsValid())
+        throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Invalid Bitcoin address");
+
+    CAddrSummary summary;
+    if (!GetAddrSummaryByDestination(address.Get(), summary))
+        throw JSONRPCError(RPC_DATABASE_ERROR, "Cannot search for address");
+
+    Object result;
+    result.push_back(Pair("address", address.ToString()));
+    result.push_back(Pair("txcount", (int64_t)summary.nTxCount));
+    result.push_back(Pair("received", ValueFromAmount(summary.nReceived)));
+    result.push_back(Pair("sent", ValueFromAmount(summary.nSent)));
+    result.push_back(Pair("balance", ValueFromAmount(summary.nReceived - summary.nSent)));
+    result.push_back(Pair("firstheight", summary.IsNull() ? Value::null : Value(summary.nFirstHeight)));
+    result.push_back(Pair("lastheight", summary.IsNull() ? Value::null : Value(summary.nLastHeight)));
+    return result;
+}
+
 Value gettxposition(const Array& params, bool fHelp)
 {
     if (fHelp || params.size() != 1)
@@ -290,6 +290,7 @@ static const CRPCCommand vRPCCommands[] =
     { "blockchain",         "getblockhash",           &getblockhash,           true  },
     { "blockchain",         "getchaintips",           &getchaintips,           true  },
     { "blockchain",         "getdifficulty",          &getdifficulty,          true  },
+    { "blockchain",         "getmempoolentry",        &getmempoolentry,        true  },
     { "blockchain",         "getmempoolinfo",         &getmempoolinfo,         true  },
     { "blockchain",         "getrawmempool",          &getrawmempool,          true  },
     { "blockchain",         "gettxout",               &gettxout,               true  },
@@ -339,6 +340,7 @@ static const CRPCCommand vRPCCommands[] =
     { "address index",      "searchrawtransactions",  &searchrawtransactions,  false },
     { "address index",      "listallunspent",         &listallunspent,         false },
     { "address index",      "getallbalance",          &getallbalance,          false },
+    { "address index",      "getaddresssummary",      &getaddresssummary,      false },
     { "address index",      "gettxposition",          &gettxposition,          false },
 
 #ifdef ENABLE_WALLET
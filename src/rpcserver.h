@@ -227,6 +227,7 @@ extern json_spirit::Value getdifficulty(const json_spirit::Array& params, bool f
 extern json_spirit::Value settxfee(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value getmempoolinfo(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value getrawmempool(const json_spirit::Array& params, bool fHelp);
+extern json_spirit::Value getmempoolentry(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value getblockhash(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value getblock(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value gettxoutsetinfo(const json_spirit::Array& params, bool fHelp);
@@ -240,6 +241,7 @@ extern json_spirit::Value reconsiderblock(const json_spirit::Array& params, bool
 extern json_spirit::Value searchrawtransactions(const json_spirit::Array& params, bool fHelp); // in rcprawtransaction.cpp
 extern json_spirit::Value listallunspent(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value getallbalance(const json_spirit::Array& params, bool fHelp);
+extern json_spirit::Value getaddresssummary(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value gettxposition(const json_spirit::Array& params, bool fHelp);
 
 // in rest.cpp
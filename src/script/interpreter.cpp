@@ -12,6 +12,7 @@
 #include "eccryptoverify.h"
 #include "pubkey.h"
 #include "script/script.h"
+#include "streams.h"
 #include "uint256.h"
 
 using namespace std;
@@ -1033,7 +1034,36 @@ public:
 
 } // anon namespace
 
-uint256 SignatureHash(const CScript& scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType)
+void PrecomputedTransactionData::Init(const CTransaction& txTo)
+{
+    vMidstates.clear();
+    vchInputs.clear();
+    vInputEnd.clear();
+    vchOutputs.clear();
+    if (txTo.vin.size() < 2)
+        return;
+
+    CHashWriter ss(SER_GETHASH, 0);
+    ss << txTo.nVersion;
+    ::WriteCompactSize(ss, txTo.vin.size());
+    CDataStream ssInputs(SER_GETHASH, 0);
+    vMidstates.reserve(txTo.vin.size());
+    vInputEnd.reserve(txTo.vin.size());
+    for (unsigned int i = 0; i < txTo.vin.size(); i++) {
+        vMidstates.push_back(ss);
+        size_t nStart = ssInputs.size();
+        ssInputs << txTo.vin[i].prevout << CScript() << txTo.vin[i].nSequence;
+        ss.write(&ssInputs[nStart], ssInputs.size() - nStart);
+        vInputEnd.push_back(ssInputs.size());
+    }
+    vchInputs.assign(ssInputs.begin(), ssInputs.end());
+
+    CDataStream ssOutputs(SER_GETHASH, 0);
+    ssOutputs << txTo.vout << txTo.nLockTime;
+    vchOutputs.assign(ssOutputs.begin(), ssOutputs.end());
+}
+
+uint256 SignatureHash(const CScript& scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType, const PrecomputedTransactionData* txdata)
 {
     static const uint256 one(uint256S("0000000000000000000000000000000000000000000000000000000000000001"));
     if (nIn >= txTo.vin.size()) {
@@ -1052,6 +1082,26 @@ uint256 SignatureHash(const CScript& scriptCode, const CTransaction& txTo, unsig
     // Wrapper to serialize only the necessary parts of the transaction being signed
     CTransactionSignatureSerializer txTmp(txTo, scriptCode, nIn, nHashType);
 
+    if (txdata && txdata->IsInitialized(txTo) && (nHashType & 0x1f) != SIGHASH_SINGLE && (nHashType & 0x1f) != SIGHASH_NONE) {
+        // Continue from the state before this input, then append the remaining
+        // blanked inputs and the outputs as they were serialized before
+        CHashWriter ss(SER_GETHASH, 0);
+        if (nHashType & SIGHASH_ANYONECANPAY) {
+            ss << txTo.nVersion;
+            ::WriteCompactSize(ss, 1);
+            txTmp.SerializeInput(ss, nIn, SER_GETHASH, 0);
+        } else {
+            ss = txdata->vMidstates[nIn];
+            txTmp.SerializeInput(ss, nIn, SER_GETHASH, 0);
+            unsigned int nEnd = txdata->vInputEnd[nIn];
+            if (nEnd < txdata->vchInputs.size())
+                ss.write((const char*)&txdata->vchInputs[nEnd], txdata->vchInputs.size() - nEnd);
+        }
+        ss.write((const char*)&txdata->vchOutputs[0], txdata->vchOutputs.size());
+        ss << nHashType;
+        return ss.GetHash();
+    }
+
     // Serialize and hash
     CHashWriter ss(SER_GETHASH, 0);
     ss << txTmp << nHashType;
@@ -1076,7 +1126,7 @@ bool TransactionSignatureChecker::CheckSig(const vector<unsigned char>& vchSigIn
     int nHashType = vchSig.back();
     vchSig.pop_back();
 
-    uint256 sighash = SignatureHash(scriptCode, *txTo, nIn, nHashType);
+    uint256 sighash = SignatureHash(scriptCode, *txTo, nIn, nHashType, txdata);
 
     if (!VerifySignature(vchSig, pubkey, sighash))
         return false;
@@ -6,6 +6,7 @@
 #ifndef BITCOIN_SCRIPT_INTERPRETER_H
 #define BITCOIN_SCRIPT_INTERPRETER_H
 
+#include "hash.h"
 #include "script_error.h"
 #include "primitives/transaction.h"
 
@@ -78,7 +79,38 @@ enum
     SCRIPT_VERIFY_CLEANSTACK = (1U << 8),
 };
 
-uint256 SignatureHash(const CScript &scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType);
+/**
+ * Data about a transaction that is shared by the signature hashes of all its inputs.
+ * Only SIGHASH_ALL hashes use it: the inputs with their scripts blanked out and the
+ * outputs are serialized once, and the hash state before each input is kept, so
+ * hashing an input no longer reserializes the transaction or rehashes the inputs
+ * in front of it.
+ */
+class PrecomputedTransactionData
+{
+private:
+    //! Hash state after nVersion, the input count and the blanked inputs before each input
+    std::vector<CHashWriter> vMidstates;
+    //! Serialized inputs with their scripts blanked out
+    std::vector<unsigned char> vchInputs;
+    //! Offset in vchInputs of the end of each input
+    std::vector<unsigned int> vInputEnd;
+    //! Serialized outputs, including their count, followed by nLockTime
+    std::vector<unsigned char> vchOutputs;
+
+    friend uint256 SignatureHash(const CScript &scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType, const PrecomputedTransactionData* txdata);
+
+public:
+    PrecomputedTransactionData() {}
+    explicit PrecomputedTransactionData(const CTransaction& txTo) { Init(txTo); }
+
+    /** Precompute the data of txTo. Does nothing for transactions with a single input, which gain nothing. */
+    void Init(const CTransaction& txTo);
+    bool IsInitialized(const CTransaction& txTo) const { return !vMidstates.empty() && vMidstates.size() == txTo.vin.size(); }
+};
+
+/** Compute the signature hash of input nIn of txTo, using txdata if given, which must have been computed from txTo */
+uint256 SignatureHash(const CScript &scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType, const PrecomputedTransactionData* txdata = NULL);
 
 class BaseSignatureChecker
 {
@@ -96,12 +128,13 @@ class TransactionSignatureChecker : public BaseSignatureChecker
 private:
     const CTransaction* txTo;
     unsigned int nIn;
+    const PrecomputedTransactionData* txdata;
 
 protected:
     virtual bool VerifySignature(const std::vector<unsigned char>& vchSig, const CPubKey& vchPubKey, const uint256& sighash) const;
 
 public:
-    TransactionSignatureChecker(const CTransaction* txToIn, unsigned int nInIn) : txTo(txToIn), nIn(nInIn) {}
+    TransactionSignatureChecker(const CTransaction* txToIn, unsigned int nInIn, const PrecomputedTransactionData* txdataIn = NULL) : txTo(txToIn), nIn(nInIn), txdata(txdataIn) {}
     bool CheckSig(const std::vector<unsigned char>& scriptSig, const std::vector<unsigned char>& vchPubKey, const CScript& scriptCode) const;
 };
 
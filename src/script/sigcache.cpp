@@ -5,13 +5,15 @@
 
 #include "sigcache.h"
 
+#include "crypto/common.h"
+#include "crypto/sha256.h"
 #include "pubkey.h"
 #include "random.h"
+#include "serialize.h"
 #include "uint256.h"
 #include "util.h"
 
 #include <boost/thread.hpp>
-#include <boost/tuple/tuple_comparison.hpp>
 
 namespace {
 
@@ -19,64 +21,133 @@ namespace {
  * Valid signature cache, to avoid doing expensive ECDSA signature checking
  * twice for every transaction (once when accepted into memory pool, and
  * again when accepted into the block chain)
+ *
+ * Entries are salted SHA256 digests of (signature hash, signature, public key),
+ * stored in fixed-size, open-addressed tables. The tables are split into shards
+ * with a lock each, so that script verification threads rarely wait for each other.
  */
 class CSignatureCache
 {
 private:
-     //! sigdata_type is (signature hash, signature, public key):
-    typedef boost::tuple<uint256, std::vector<unsigned char>, CPubKey> sigdata_type;
-    std::set< sigdata_type> setValid;
-    boost::shared_mutex cs_sigcache;
+    //! Number of shards; the first byte of an entry selects its shard, the next eight its slot
+    static const unsigned int nShards = 64;
+    //! Number of consecutive slots an entry may be stored in
+    static const unsigned int nProbe = 8;
+
+    struct CShard
+    {
+        boost::mutex cs;
+        //! Slots of the table, a null entry marks an empty slot
+        std::vector<uint256> vEntries;
+        uint64_t nHits;
+        uint64_t nMisses;
+
+        CShard() : nHits(0), nMisses(0) {}
+    };
+
+    //! Random salt, so that the slot of an entry cannot be predicted by an attacker
+    uint256 salt;
+    CShard shards[nShards];
+
+    uint256 ComputeEntry(const uint256 &hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey) const
+    {
+        uint256 entry;
+        CSHA256().Write(salt.begin(), salt.size()).Write(hash.begin(), hash.size()).Write(begin_ptr(vchSig), vchSig.size()).Write(pubKey.begin(), pubKey.size()).Finalize(entry.begin());
+        return entry;
+    }
+
+    CShard& GetShard(const uint256 &entry)
+    {
+        return shards[*entry.begin() % nShards];
+    }
+
+    static size_t GetSlot(const CShard& shard, const uint256 &entry)
+    {
+        return ReadLE64(entry.begin() + 1) % shard.vEntries.size();
+    }
 
 public:
+    CSignatureCache()
+    {
+        salt = GetRandHash();
+        int64_t nMaxCacheSize = std::max((int64_t)0, GetArg("-maxsigcachemb", DEFAULT_MAX_SIG_CACHE_SIZE)) * ((size_t) 1 << 20);
+        // -maxsigcachesize is a number of entries, as it was before the cache was sized in MiB
+        if (mapArgs.count("-maxsigcachesize"))
+            nMaxCacheSize = std::max((int64_t)0, GetArg("-maxsigcachesize", 0)) * sizeof(uint256);
+        size_t nSlots = nMaxCacheSize / sizeof(uint256) / nShards;
+        if (nSlots < nProbe)
+            nSlots = 0;
+        for (unsigned int i = 0; i < nShards; i++)
+            shards[i].vEntries.resize(nSlots);
+    }
+
     bool
     Get(const uint256 &hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey)
     {
-        boost::shared_lock<boost::shared_mutex> lock(cs_sigcache);
-
-        sigdata_type k(hash, vchSig, pubKey);
-        std::set<sigdata_type>::iterator mi = setValid.find(k);
-        if (mi != setValid.end())
-            return true;
+        uint256 entry = ComputeEntry(hash, vchSig, pubKey);
+        CShard& shard = GetShard(entry);
+        boost::unique_lock<boost::mutex> lock(shard.cs);
+        if (!shard.vEntries.empty()) {
+            size_t nPos = GetSlot(shard, entry);
+            for (unsigned int i = 0; i < nProbe; i++) {
+                if (shard.vEntries[(nPos + i) % shard.vEntries.size()] == entry) {
+                    shard.nHits++;
+                    return true;
+                }
+            }
+        }
+        shard.nMisses++;
         return false;
     }
 
     void Set(const uint256 &hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey)
     {
-        // DoS prevention: limit cache size to less than 10MB
-        // (~200 bytes per cache entry times 50,000 entries)
-        // Since there are a maximum of 20,000 signature operations per block
-        // 50,000 is a reasonable default.
-        int64_t nMaxCacheSize = GetArg("-maxsigcachesize", 50000);
-        if (nMaxCacheSize <= 0) return;
-
-        boost::unique_lock<boost::shared_mutex> lock(cs_sigcache);
-
-        while (static_cast<int64_t>(setValid.size()) > nMaxCacheSize)
-        {
-            // Evict a random entry. Random because that helps
-            // foil would-be DoS attackers who might try to pre-generate
-            // and re-use a set of valid signatures just-slightly-greater
-            // than our cache size.
-            uint256 randomHash = GetRandHash();
-            std::vector<unsigned char> unused;
-            std::set<sigdata_type>::iterator it =
-                setValid.lower_bound(sigdata_type(randomHash, unused, unused));
-            if (it == setValid.end())
-                it = setValid.begin();
-            setValid.erase(*it);
+        uint256 entry = ComputeEntry(hash, vchSig, pubKey);
+        CShard& shard = GetShard(entry);
+        boost::unique_lock<boost::mutex> lock(shard.cs);
+        if (shard.vEntries.empty())
+            return;
+        size_t nPos = GetSlot(shard, entry);
+        for (unsigned int i = 0; i < nProbe; i++) {
+            uint256& slot = shard.vEntries[(nPos + i) % shard.vEntries.size()];
+            if (slot.IsNull() || slot == entry) {
+                slot = entry;
+                return;
+            }
         }
+        // All slots are taken: evict one chosen by the salted entry. Random because
+        // that helps foil would-be DoS attackers who might try to pre-generate and
+        // re-use a set of valid signatures just-slightly-greater than our cache size.
+        shard.vEntries[(nPos + entry.GetHash(salt) % nProbe) % shard.vEntries.size()] = entry;
+    }
 
-        sigdata_type k(hash, vchSig, pubKey);
-        setValid.insert(k);
+    void GetStats(uint64_t& nHits, uint64_t& nMisses)
+    {
+        nHits = nMisses = 0;
+        for (unsigned int i = 0; i < nShards; i++) {
+            boost::unique_lock<boost::mutex> lock(shards[i].cs);
+            nHits += shards[i].nHits;
+            nMisses += shards[i].nMisses;
+        }
     }
 };
 
+CSignatureCache& GetSignatureCache()
+{
+    static CSignatureCache signatureCache;
+    return signatureCache;
+}
+
+}
+
+void GetSignatureCacheStats(uint64_t& nHits, uint64_t& nMisses)
+{
+    GetSignatureCache().GetStats(nHits, nMisses);
 }
 
 bool CachingTransactionSignatureChecker::VerifySignature(const std::vector<unsigned char>& vchSig, const CPubKey& pubkey, const uint256& sighash) const
 {
-    static CSignatureCache signatureCache;
+    CSignatureCache& signatureCache = GetSignatureCache();
 
     if (signatureCache.Get(sighash, vchSig, pubkey))
         return true;
@@ -8,8 +8,12 @@
 
 #include "script/interpreter.h"
 
+#include <stdint.h>
 #include <vector>
 
+//! -maxsigcachemb default (MiB)
+static const int64_t DEFAULT_MAX_SIG_CACHE_SIZE = 32;
+
 class CPubKey;
 
 class CachingTransactionSignatureChecker : public TransactionSignatureChecker
@@ -18,9 +22,12 @@ private:
     bool store;
 
 public:
-    CachingTransactionSignatureChecker(const CTransaction* txToIn, unsigned int nInIn, bool storeIn=true) : TransactionSignatureChecker(txToIn, nInIn), store(storeIn) {}
+    CachingTransactionSignatureChecker(const CTransaction* txToIn, unsigned int nInIn, bool storeIn=true, const PrecomputedTransactionData* txdataIn=NULL) : TransactionSignatureChecker(txToIn, nInIn, txdataIn), store(storeIn) {}
 
     bool VerifySignature(const std::vector<unsigned char>& vchSig, const CPubKey& vchPubKey, const uint256& sighash) const;
 };
 
+/** Get the number of signature cache lookups that found, and did not find, the signature */
+void GetSignatureCacheStats(uint64_t& nHits, uint64_t& nMisses);
+
 #endif // BITCOIN_SCRIPT_SIGCACHE_H
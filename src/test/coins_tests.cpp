@@ -102,6 +102,8 @@ BOOST_AUTO_TEST_CASE(coins_cache_simulation_test)
     bool updated_an_entry = false;
     bool found_an_entry = false;
     bool missed_an_entry = false;
+    bool prefetched_entries = false;
+    bool evicted_entries = false;
 
     // A simple map to track what we expect the cache stack to represent.
     std::map<uint256, CCoins> result;
@@ -142,6 +144,25 @@ BOOST_AUTO_TEST_CASE(coins_cache_simulation_test)
             }
         }
 
+        // Occasionally load a batch of entries into the tip, which must not change what it represents.
+        if (insecure_rand() % 50 == 0) {
+            std::vector<uint256> vTxid;
+            for (unsigned int j = 0; j < 10; j++) {
+                vTxid.push_back(txids[insecure_rand() % txids.size()]);
+            }
+            stack.back()->PrefetchCoins(vTxid);
+            prefetched_entries = true;
+        }
+
+        // Occasionally write the tip to its base while keeping it cached, and shrink it.
+        if (insecure_rand() % 200 == 0) {
+            size_t nUsage = stack.back()->DynamicMemoryUsage();
+            BOOST_CHECK(stack.back()->Sync());
+            stack.back()->Evict(nUsage / 2);
+            BOOST_CHECK(stack.back()->DynamicMemoryUsage() <= nUsage);
+            evicted_entries = true;
+        }
+
         // Once every 1000 iterations and at the end, verify the full cache.
         if (insecure_rand() % 1000 == 1 || i == NUM_SIMULATION_ITERATIONS - 1) {
             for (std::map<uint256, CCoins>::iterator it = result.begin(); it != result.end(); it++) {
@@ -195,6 +216,8 @@ BOOST_AUTO_TEST_CASE(coins_cache_simulation_test)
     BOOST_CHECK(updated_an_entry);
     BOOST_CHECK(found_an_entry);
     BOOST_CHECK(missed_an_entry);
+    BOOST_CHECK(prefetched_entries);
+    BOOST_CHECK(evicted_entries);
 }
 
 BOOST_AUTO_TEST_SUITE_END()
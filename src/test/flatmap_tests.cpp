@@ -0,0 +1,129 @@
+// Copyright (c) 2015 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "flatmap.h"
+
+#include "random.h"
+#include "test/test_bitcoin.h"
+
+#include <map>
+
+#include <boost/test/unit_test.hpp>
+
+namespace
+{
+//! Hasher with many collisions, to exercise probing and deletion
+struct CCollidingHasher
+{
+    size_t operator()(int key) const { return key % 97; }
+};
+
+struct CPlainHasher
+{
+    size_t operator()(int key) const { return key * 2654435761U; }
+};
+
+template <typename Hash>
+void CheckEqual(const flatmap<int, int, Hash>& map, const std::map<int, int>& ref)
+{
+    BOOST_CHECK_EQUAL(map.size(), ref.size());
+    size_t nSeen = 0;
+    for (typename flatmap<int, int, Hash>::const_iterator it = map.begin(); it != map.end(); ++it) {
+        std::map<int, int>::const_iterator itRef = ref.find(it->first);
+        BOOST_CHECK(itRef != ref.end() && itRef->second == it->second);
+        nSeen++;
+    }
+    BOOST_CHECK_EQUAL(nSeen, ref.size());
+}
+
+template <typename Hash>
+void SimulateMap()
+{
+    flatmap<int, int, Hash> map;
+    std::map<int, int> ref;
+    for (int i = 0; i < 20000; i++) {
+        int key = insecure_rand() % 2000;
+        unsigned int op = insecure_rand() % 8;
+        if (op < 3) {
+            std::pair<typename flatmap<int, int, Hash>::iterator, bool> ret = map.insert(std::make_pair(key, i));
+            BOOST_CHECK_EQUAL(ret.second, ref.insert(std::make_pair(key, i)).second);
+            BOOST_CHECK_EQUAL(ret.first->second, ref[key]);
+        } else if (op < 5) {
+            BOOST_CHECK_EQUAL(map.erase(key), ref.erase(key));
+        } else if (op < 7) {
+            typename flatmap<int, int, Hash>::iterator it = map.find(key);
+            BOOST_CHECK_EQUAL(it != map.end(), ref.count(key) != 0);
+            if (it != map.end())
+                BOOST_CHECK_EQUAL(it->second, ref[key]);
+        } else {
+            map[key] = i;
+            ref[key] = i;
+        }
+        if (i % 1000 == 0)
+            CheckEqual(map, ref);
+    }
+    CheckEqual(map, ref);
+
+    // Erase every other entry while iterating, like BatchWrite implementations do.
+    bool fErase = false;
+    for (typename flatmap<int, int, Hash>::iterator it = map.begin(); it != map.end();) {
+        fErase = !fErase;
+        if (fErase) {
+            ref.erase(it->first);
+            map.erase(it++);
+        } else {
+            it++;
+        }
+    }
+    CheckEqual(map, ref);
+
+    // Clearing releases all memory
+    flatmap<int, int, Hash> mapEmpty;
+    map.clear();
+    BOOST_CHECK(map.empty());
+    BOOST_CHECK(map.begin() == map.end());
+    BOOST_CHECK_EQUAL(map.DynamicMemoryUsage(), mapEmpty.DynamicMemoryUsage());
+}
+}
+
+BOOST_FIXTURE_TEST_SUITE(flatmap_tests, BasicTestingSetup)
+
+BOOST_AUTO_TEST_CASE(flatmap_simulation)
+{
+    SimulateMap<CPlainHasher>();
+    SimulateMap<CCollidingHasher>();
+}
+
+BOOST_AUTO_TEST_CASE(flatmap_stable_entries)
+{
+    flatmap<int, int, CPlainHasher> map;
+    int* pFirst = &map[0];
+    flatmap<int, int, CPlainHasher>::iterator itFirst = map.find(0);
+    size_t nUsage = map.DynamicMemoryUsage();
+    // Growing the table moves no entries
+    for (int i = 1; i < 10000; i++)
+        map[i] = i;
+    BOOST_CHECK(map.DynamicMemoryUsage() > nUsage);
+    *pFirst = 42;
+    BOOST_CHECK_EQUAL(map.find(0)->second, 42);
+    // An iterator obtained before the table grew can still be used to erase
+    map.erase(itFirst);
+    BOOST_CHECK(map.find(0) == map.end());
+    BOOST_CHECK_EQUAL(map.size(), 9999U);
+    // Freed slots are reused
+    nUsage = map.DynamicMemoryUsage();
+    map[-1] = -1;
+    BOOST_CHECK_EQUAL(map.DynamicMemoryUsage(), nUsage);
+    // Compacting releases the slots of erased entries, and keeps the rest
+    for (int i = 1; i < 10000; i += 2)
+        map.erase(i);
+    map.shrink_to_fit();
+    BOOST_CHECK(map.DynamicMemoryUsage() < nUsage);
+    BOOST_CHECK_EQUAL(map.size(), 5000U);
+    for (int i = 1; i < 10000; i++)
+        BOOST_CHECK_EQUAL(map.count(i), (i % 2) ? 0U : 1U);
+    BOOST_CHECK_EQUAL(map.find(-1)->second, -1);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -5,6 +5,7 @@
 #include "key.h"
 
 #include "base58.h"
+#include "random.h"
 #include "script/script.h"
 #include "uint256.h"
 #include "util.h"
@@ -14,6 +15,7 @@
 #include <string>
 #include <vector>
 
+#include <boost/foreach.hpp>
 #include <boost/test/unit_test.hpp>
 
 using namespace std;
@@ -188,4 +190,130 @@ BOOST_AUTO_TEST_CASE(key_test1)
     BOOST_CHECK(detsigc == ParseHex("2052d8a32079c11e79db95af63bb9600c5b04f21a9ca33dc129c2bfa8ac9dc1cd561d8ae5e0f6c1a16bde3719c64c2fd70e404b6428ab9a69566962e8771b5944d"));
 }
 
+/** Encode a signature from its integers, which are given as their DER contents */
+static vector<unsigned char> EncodeSignature(const vector<unsigned char>& r, const vector<unsigned char>& s, bool fLongLengths = false)
+{
+    vector<unsigned char> sig;
+    sig.push_back(0x30);
+    if (fLongLengths) {
+        sig.push_back(0x82);
+        sig.push_back(0x00);
+    }
+    sig.push_back(r.size() + s.size() + (fLongLengths ? 6 : 4));
+    for (int i = 0; i < 2; i++) {
+        const vector<unsigned char>& n = i ? s : r;
+        sig.push_back(0x02);
+        if (fLongLengths)
+            sig.push_back(0x81);
+        sig.push_back(n.size());
+        sig.insert(sig.end(), n.begin(), n.end());
+    }
+    return sig;
+}
+
+/** Replace the value of a DER integer by the group order minus the value */
+static vector<unsigned char> NegateModOrder(const vector<unsigned char>& v)
+{
+    static const unsigned char order[32] = {
+        0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFE,
+        0xBA,0xAE,0xDC,0xE6,0xAF,0x48,0xA0,0x3B,0xBF,0xD2,0x5E,0x8C,0xD0,0x36,0x41,0x41
+    };
+    unsigned char value[32] = {0};
+    vector<unsigned char> stripped(v);
+    while (!stripped.empty() && stripped[0] == 0)
+        stripped.erase(stripped.begin());
+    memcpy(value + 32 - stripped.size(), &stripped[0], stripped.size());
+    vector<unsigned char> result(33, 0);
+    int borrow = 0;
+    for (int i = 31; i >= 0; i--) {
+        int diff = order[i] - value[i] - borrow;
+        borrow = diff < 0;
+        result[i + 1] = diff & 0xFF;
+    }
+    while (result.size() > 1 && result[0] == 0 && result[1] < 0x80)
+        result.erase(result.begin());
+    return result;
+}
+
+BOOST_AUTO_TEST_CASE(key_verify_implementations)
+{
+    // libsecp256k1 must agree with OpenSSL on strict DER signatures, and Verify
+    // must agree with OpenSSL on the pre-BIP66 encodings it leaves to OpenSSL
+    for (int i = 0; i < 32; i++) {
+        CKey key;
+        key.MakeNewKey(i % 2 == 0);
+        CPubKey pubkey = key.GetPubKey();
+        uint256 hash = GetRandHash();
+        vector<unsigned char> sig;
+        BOOST_REQUIRE(key.Sign(hash, sig));
+
+        // Split the canonical signature into its integers
+        vector<unsigned char> r(sig.begin() + 4, sig.begin() + 4 + sig[3]);
+        vector<unsigned char> s(sig.begin() + 6 + sig[3], sig.end());
+        BOOST_REQUIRE(EncodeSignature(r, s) == sig);
+
+        vector<vector<unsigned char> > vStrict;
+        vStrict.push_back(sig);
+        // High S
+        vStrict.push_back(EncodeSignature(r, NegateModOrder(s)));
+        // Corrupted values
+        vector<unsigned char> sigCorrupted(sig);
+        sigCorrupted[sigCorrupted.size() - 1 - GetRand(s.size() - 1)] ^= 1 << GetRand(8);
+        vStrict.push_back(sigCorrupted);
+
+        BOOST_FOREACH(const vector<unsigned char>& vchSig, vStrict) {
+            bool fValid = pubkey.VerifyOpenSSL(hash, vchSig);
+            BOOST_CHECK_MESSAGE(pubkey.VerifySecp256k1(hash, vchSig) == fValid, HexStr(vchSig));
+            BOOST_CHECK(pubkey.Verify(hash, vchSig) == fValid);
+            BOOST_CHECK(!pubkey.VerifySecp256k1(GetRandHash(), vchSig));
+        }
+        BOOST_CHECK(pubkey.VerifySecp256k1(hash, vStrict[0]));
+        BOOST_CHECK(pubkey.VerifySecp256k1(hash, vStrict[1]));
+        BOOST_CHECK(!pubkey.VerifySecp256k1(hash, vStrict[2]));
+
+        vector<vector<unsigned char> > vLax;
+        // Padded integers
+        vector<unsigned char> rPadded(r);
+        rPadded.insert(rPadded.begin(), 2, 0x00);
+        vLax.push_back(EncodeSignature(rPadded, s));
+        // Long-form lengths
+        vLax.push_back(EncodeSignature(r, s, true));
+        // Trailing data
+        vector<unsigned char> sigTrailing(sig);
+        sigTrailing.push_back(0x01);
+        vLax.push_back(sigTrailing);
+        // Indefinite-length sequence
+        vector<unsigned char> sigIndefinite(sig);
+        sigIndefinite[1] = 0x80;
+        sigIndefinite.push_back(0x00);
+        sigIndefinite.push_back(0x00);
+        vLax.push_back(sigIndefinite);
+        // Wrong sequence lengths, with and without a byte to cover them
+        vector<unsigned char> sigBadLength(sig);
+        sigBadLength[1]++;
+        vLax.push_back(sigBadLength);
+        sigBadLength.push_back(0x00);
+        vLax.push_back(sigBadLength);
+        sigBadLength = sig;
+        sigBadLength[1]--;
+        vLax.push_back(sigBadLength);
+        // Negative R
+        if (r[0] == 0x00 && r.size() > 1)
+            vLax.push_back(EncodeSignature(vector<unsigned char>(r.begin() + 1, r.end()), s));
+        // Truncated signatures
+        vLax.push_back(vector<unsigned char>(sig.begin(), sig.end() - 1));
+        vLax.push_back(vector<unsigned char>());
+
+        BOOST_FOREACH(const vector<unsigned char>& vchSig, vLax) {
+            BOOST_CHECK_MESSAGE(!pubkey.VerifySecp256k1(hash, vchSig), HexStr(vchSig));
+            BOOST_CHECK(pubkey.Verify(hash, vchSig) == pubkey.VerifyOpenSSL(hash, vchSig));
+        }
+        // Before BIP66, OpenSSL accepts the BER forms of a valid signature
+        for (int j = 0; j < 4; j++)
+            BOOST_CHECK_MESSAGE(pubkey.Verify(hash, vLax[j]), HexStr(vLax[j]));
+        for (int j = 4; j < 7; j++)
+            BOOST_CHECK(!pubkey.Verify(hash, vLax[j]));
+    }
+}
+
 BOOST_AUTO_TEST_SUITE_END()
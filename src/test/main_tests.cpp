@@ -4,6 +4,9 @@
 
 #include "chainparams.h"
 #include "main.h"
+#include "pubkey.h"
+#include "random.h"
+#include "script/standard.h"
 
 #include "test/test_bitcoin.h"
 
@@ -73,4 +76,47 @@ BOOST_AUTO_TEST_CASE(test_combiner_all)
     BOOST_CHECK(Test());
 }
 
+BOOST_AUTO_TEST_CASE(addr_summary_credit)
+{
+    uint160 hash;
+    GetRandBytes(hash.begin(), hash.size());
+    std::vector<unsigned char> vchKey1(33, 0x02), vchKey2(33, 0x03);
+    GetRandBytes(&vchKey1[1], 32);
+    GetRandBytes(&vchKey2[1], 32);
+    std::vector<uint160> vAddrIds;
+    uint160 addrid;
+
+    // Single-key scripts are credited to their identifier
+    CScript scriptKeyHash = GetScriptForDestination(CKeyID(hash));
+    ExtractAddrIds(scriptKeyHash, vAddrIds);
+    BOOST_CHECK(GetAddrSummaryCredit(scriptKeyHash, vAddrIds, addrid));
+    BOOST_CHECK(addrid == hash);
+    vAddrIds.clear();
+    CScript scriptHash = GetScriptForDestination(CScriptID(hash));
+    ExtractAddrIds(scriptHash, vAddrIds);
+    BOOST_CHECK(GetAddrSummaryCredit(scriptHash, vAddrIds, addrid));
+    BOOST_CHECK(addrid == hash);
+
+    // Unspendable outputs are indexed, but never credited
+    vAddrIds.clear();
+    CScript scriptReturn = CScript() << OP_RETURN << std::vector<unsigned char>(hash.begin(), hash.end());
+    ExtractAddrIds(scriptReturn, vAddrIds);
+    BOOST_CHECK_EQUAL(vAddrIds.size(), 1U);
+    BOOST_CHECK(!GetAddrSummaryCredit(scriptReturn, vAddrIds, addrid));
+
+    // Multisig outputs are indexed under every key, but credited to none of them
+    vAddrIds.clear();
+    CScript scriptMultisig = CScript() << OP_1 << vchKey1 << vchKey2 << OP_2 << OP_CHECKMULTISIG;
+    ExtractAddrIds(scriptMultisig, vAddrIds);
+    BOOST_CHECK_EQUAL(vAddrIds.size(), 2U);
+    BOOST_CHECK(!GetAddrSummaryCredit(scriptMultisig, vAddrIds, addrid));
+
+    // Unless all of them are the same key
+    vAddrIds.clear();
+    scriptMultisig = CScript() << OP_1 << vchKey1 << vchKey1 << OP_2 << OP_CHECKMULTISIG;
+    ExtractAddrIds(scriptMultisig, vAddrIds);
+    BOOST_CHECK(GetAddrSummaryCredit(scriptMultisig, vAddrIds, addrid));
+    BOOST_CHECK(addrid == vAddrIds[0]);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -2,15 +2,41 @@
 // Distributed under the MIT software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
+#include "consensus/validation.h"
 #include "main.h"
+#include "pubkey.h"
+#include "random.h"
+#include "script/standard.h"
 #include "txmempool.h"
 #include "util.h"
 
 #include "test/test_bitcoin.h"
 
+#include <boost/filesystem/fstream.hpp>
 #include <boost/test/unit_test.hpp>
 #include <list>
 
+extern volatile bool fRequestShutdown;
+
+//! A transaction spending output n of prevout with the P2SH script of redeemScript, sending the value less a fee to the same script
+static CTransaction SpendP2SH(const uint256& hashPrev, uint32_t n, const CScript& redeemScript, CAmount nValue)
+{
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout = COutPoint(hashPrev, n);
+    tx.vin[0].scriptSig = CScript() << std::vector<unsigned char>(redeemScript.begin(), redeemScript.end());
+    tx.vout.resize(1);
+    tx.vout[0].nValue = nValue - 10000;
+    tx.vout[0].scriptPubKey = GetScriptForDestination(CScriptID(redeemScript));
+    return tx;
+}
+
+static std::string ReadFile(const boost::filesystem::path& path)
+{
+    boost::filesystem::ifstream file(path, std::ios::binary);
+    return std::string(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+}
+
 BOOST_FIXTURE_TEST_SUITE(mempool_tests, TestingSetup)
 
 BOOST_AUTO_TEST_CASE(MempoolRemoveTest)
@@ -101,4 +127,321 @@ BOOST_AUTO_TEST_CASE(MempoolRemoveTest)
     removed.clear();
 }
 
+static void CheckPackageTotals(CTxMemPool& pool, const CTransaction& tx, uint64_t nAncestors, CAmount nAncestorFees,
+                               uint64_t nDescendants, CAmount nDescendantFees)
+{
+    CTxMemPool::txiter it = pool.mapTx.find(tx.GetHash());
+    BOOST_REQUIRE(it != pool.mapTx.end());
+    BOOST_CHECK_EQUAL(it->GetCountWithAncestors(), nAncestors);
+    BOOST_CHECK_EQUAL(it->GetSizeWithAncestors(), nAncestors * it->GetTxSize());
+    BOOST_CHECK_EQUAL(it->GetModFeesWithAncestors(), nAncestorFees);
+    BOOST_CHECK_EQUAL(it->GetCountWithDescendants(), nDescendants);
+    BOOST_CHECK_EQUAL(it->GetSizeWithDescendants(), nDescendants * it->GetTxSize());
+    BOOST_CHECK_EQUAL(it->GetModFeesWithDescendants(), nDescendantFees);
+}
+
+BOOST_AUTO_TEST_CASE(MempoolPackageTotalsTest)
+{
+    // A parent with two children, one of which has a child of its own. All
+    // transactions have the same size, so the sizes follow from the counts.
+    CMutableTransaction txParent;
+    txParent.vin.resize(1);
+    txParent.vin[0].scriptSig = CScript() << OP_11;
+    txParent.vout.resize(2);
+    for (int i = 0; i < 2; i++)
+    {
+        txParent.vout[i].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+        txParent.vout[i].nValue = 33000LL;
+    }
+    CMutableTransaction txChild[2];
+    for (int i = 0; i < 2; i++)
+    {
+        txChild[i].vin.resize(1);
+        txChild[i].vin[0].scriptSig = CScript() << OP_11;
+        txChild[i].vin[0].prevout.hash = txParent.GetHash();
+        txChild[i].vin[0].prevout.n = i;
+        txChild[i].vout.resize(2);
+        txChild[i].vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+        txChild[i].vout[0].nValue = 11000LL;
+        txChild[i].vout[1] = txChild[i].vout[0];
+    }
+    CMutableTransaction txGrandChild;
+    txGrandChild.vin.resize(1);
+    txGrandChild.vin[0].scriptSig = CScript() << OP_11;
+    txGrandChild.vin[0].prevout.hash = txChild[0].GetHash();
+    txGrandChild.vin[0].prevout.n = 0;
+    txGrandChild.vout.resize(2);
+    txGrandChild.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    txGrandChild.vout[0].nValue = 11000LL;
+    txGrandChild.vout[1] = txGrandChild.vout[0];
+
+    CTxMemPool testPool(CFeeRate(0));
+    testPool.addUnchecked(txParent.GetHash(), CTxMemPoolEntry(txParent, 1000, 0, 0.0, 1));
+    testPool.addUnchecked(txChild[0].GetHash(), CTxMemPoolEntry(txChild[0], 100, 0, 0.0, 1));
+    testPool.addUnchecked(txChild[1].GetHash(), CTxMemPoolEntry(txChild[1], 200, 0, 0.0, 1));
+    testPool.addUnchecked(txGrandChild.GetHash(), CTxMemPoolEntry(txGrandChild, 10, 0, 0.0, 1));
+    CheckPackageTotals(testPool, txParent, 1, 1000, 4, 1310);
+    CheckPackageTotals(testPool, txChild[0], 2, 1100, 2, 110);
+    CheckPackageTotals(testPool, txChild[1], 2, 1200, 1, 200);
+    CheckPackageTotals(testPool, txGrandChild, 3, 1110, 1, 10);
+
+    // Prioritisation counts towards the totals of the packages
+    testPool.PrioritiseTransaction(txChild[0].GetHash(), txChild[0].GetHash().ToString(), 0.0, 5000);
+    CheckPackageTotals(testPool, txParent, 1, 1000, 4, 6310);
+    CheckPackageTotals(testPool, txChild[0], 2, 6100, 2, 5110);
+    CheckPackageTotals(testPool, txGrandChild, 3, 6110, 1, 10);
+
+    // Removing a transaction, as when it is included in a block, leaves its descendants
+    std::list<CTransaction> removed;
+    testPool.remove(txParent, removed, false);
+    BOOST_CHECK_EQUAL(removed.size(), 1);
+    CheckPackageTotals(testPool, txChild[0], 1, 5100, 2, 5110);
+    CheckPackageTotals(testPool, txChild[1], 1, 200, 1, 200);
+    CheckPackageTotals(testPool, txGrandChild, 2, 5110, 1, 10);
+
+    // A transaction can return to the pool after its descendants, as when its block is disconnected
+    testPool.addUnchecked(txParent.GetHash(), CTxMemPoolEntry(txParent, 1000, 0, 0.0, 1));
+    CheckPackageTotals(testPool, txParent, 1, 1000, 4, 6310);
+    CheckPackageTotals(testPool, txChild[0], 2, 6100, 2, 5110);
+    CheckPackageTotals(testPool, txChild[1], 2, 1200, 1, 200);
+    CheckPackageTotals(testPool, txGrandChild, 3, 6110, 1, 10);
+
+    // The package limits are checked against the totals
+    CTxMemPool::setEntries setAncestors;
+    std::string errString;
+    CTxMemPoolEntry entry(txGrandChild, 0, 0, 0.0, 1);
+    BOOST_CHECK(testPool.CalculateMemPoolAncestors(entry, setAncestors, 3, 1000000, 5, 1000000, errString, false));
+    BOOST_CHECK_EQUAL(setAncestors.size(), 2);
+    setAncestors.clear();
+    BOOST_CHECK(!testPool.CalculateMemPoolAncestors(entry, setAncestors, 2, 1000000, 5, 1000000, errString, false));
+    setAncestors.clear();
+    CMutableTransaction txNew = txGrandChild;
+    txNew.vin[0].prevout.n = 1;
+    CTxMemPoolEntry entryNew(txNew, 0, 0, 0.0, 1);
+    BOOST_CHECK(!testPool.CalculateMemPoolAncestors(entryNew, setAncestors, 3, 1000000, 4, 1000000, errString));
+    setAncestors.clear();
+    BOOST_CHECK(testPool.CalculateMemPoolAncestors(entryNew, setAncestors, 3, 1000000, 5, 1000000, errString));
+
+    // Removing a package removes its descendants as well
+    testPool.remove(txChild[0], removed, true);
+    BOOST_CHECK_EQUAL(removed.size(), 3);
+    CheckPackageTotals(testPool, txParent, 1, 1000, 2, 1200);
+}
+
+template<typename name>
+static void CheckSort(CTxMemPool& pool, const std::vector<uint256>& sortedOrder)
+{
+    BOOST_CHECK_EQUAL(pool.size(), sortedOrder.size());
+    typename CTxMemPool::indexed_transaction_set::index<name>::type::iterator it = pool.mapTx.get<name>().begin();
+    for (size_t i = 0; it != pool.mapTx.get<name>().end() && i < sortedOrder.size(); ++it, ++i)
+        BOOST_CHECK_EQUAL(it->GetTx().GetHash().ToString(), sortedOrder[i].ToString());
+}
+
+BOOST_AUTO_TEST_CASE(MempoolIndexingTest)
+{
+    // Three unrelated transactions, and a child of the one paying the least.
+    // All have the same size.
+    CMutableTransaction tx[4];
+    for (int i = 0; i < 4; i++)
+    {
+        tx[i].vin.resize(1);
+        tx[i].vin[0].scriptSig = CScript() << OP_11;
+        tx[i].vin[0].prevout.hash = GetRandHash();
+        tx[i].vout.resize(1);
+        tx[i].vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+        tx[i].vout[0].nValue = 10 * COIN;
+    }
+    tx[3].vin[0].prevout.hash = tx[1].GetHash();
+    tx[3].vin[0].prevout.n = 0;
+
+    CTxMemPool pool(CFeeRate(0));
+    pool.addUnchecked(tx[0].GetHash(), CTxMemPoolEntry(tx[0], 10000, 3, 0.0, 1));
+    pool.addUnchecked(tx[1].GetHash(), CTxMemPoolEntry(tx[1], 1000, 1, 0.0, 1));
+    pool.addUnchecked(tx[2].GetHash(), CTxMemPoolEntry(tx[2], 5000, 2, 0.0, 1));
+    pool.addUnchecked(tx[3].GetHash(), CTxMemPoolEntry(tx[3], 50000, 4, 0.0, 1));
+
+    // The child makes its parent the last to be evicted but one, and is mined first
+    std::vector<uint256> sortedOrder(4);
+    sortedOrder[0] = tx[2].GetHash();
+    sortedOrder[1] = tx[0].GetHash();
+    sortedOrder[2] = tx[1].GetHash();
+    sortedOrder[3] = tx[3].GetHash();
+    CheckSort<descendant_score>(pool, sortedOrder);
+    sortedOrder[0] = tx[3].GetHash();
+    sortedOrder[1] = tx[0].GetHash();
+    sortedOrder[2] = tx[2].GetHash();
+    sortedOrder[3] = tx[1].GetHash();
+    CheckSort<ancestor_score>(pool, sortedOrder);
+    sortedOrder[0] = tx[1].GetHash();
+    sortedOrder[1] = tx[2].GetHash();
+    sortedOrder[2] = tx[0].GetHash();
+    sortedOrder[3] = tx[3].GetHash();
+    CheckSort<entry_time>(pool, sortedOrder);
+
+    // The orderings follow prioritisation
+    pool.PrioritiseTransaction(tx[2].GetHash(), tx[2].GetHash().ToString(), 0.0, 20000);
+    sortedOrder[0] = tx[0].GetHash();
+    sortedOrder[1] = tx[2].GetHash();
+    sortedOrder[2] = tx[1].GetHash();
+    sortedOrder[3] = tx[3].GetHash();
+    CheckSort<descendant_score>(pool, sortedOrder);
+    sortedOrder[0] = tx[3].GetHash();
+    sortedOrder[1] = tx[2].GetHash();
+    sortedOrder[2] = tx[0].GetHash();
+    sortedOrder[3] = tx[1].GetHash();
+    CheckSort<ancestor_score>(pool, sortedOrder);
+
+    // Expiry takes the descendants of expired transactions along
+    BOOST_CHECK_EQUAL(pool.Expire(3), 3);
+    sortedOrder.resize(1);
+    sortedOrder[0] = tx[0].GetHash();
+    CheckSort<entry_time>(pool, sortedOrder);
+}
+
+BOOST_AUTO_TEST_CASE(MempoolSizeLimitTest)
+{
+    // Two unrelated transactions, and a free parent whose child pays for both
+    CMutableTransaction tx[4];
+    for (int i = 0; i < 4; i++)
+    {
+        tx[i].vin.resize(1);
+        tx[i].vin[0].scriptSig = CScript() << OP_11;
+        tx[i].vin[0].prevout.hash = GetRandHash();
+        tx[i].vout.resize(1);
+        tx[i].vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+        tx[i].vout[0].nValue = 10 * COIN;
+    }
+    tx[3].vin[0].prevout.hash = tx[2].GetHash();
+    tx[3].vin[0].prevout.n = 0;
+
+    CTxMemPool pool(CFeeRate(0));
+    pool.addUnchecked(tx[0].GetHash(), CTxMemPoolEntry(tx[0], 5000, 0, 0.0, 1));
+    pool.addUnchecked(tx[1].GetHash(), CTxMemPoolEntry(tx[1], 1000, 0, 0.0, 1));
+    pool.addUnchecked(tx[2].GetHash(), CTxMemPoolEntry(tx[2], 0, 0, 0.0, 1));
+    pool.addUnchecked(tx[3].GetHash(), CTxMemPoolEntry(tx[3], 20000, 0, 0.0, 1));
+    unsigned int nTxSize = ::GetSerializeSize(tx[0], SER_NETWORK, PROTOCOL_VERSION);
+
+    // Nothing is evicted while the pool fits
+    pool.TrimToSize(pool.DynamicMemoryUsage());
+    BOOST_CHECK_EQUAL(pool.size(), 4);
+    BOOST_CHECK(pool.GetMinFee(1) == CFeeRate(0));
+
+    // The lowest fee rate goes first, and raises the minimum fee to above its own
+    pool.TrimToSize(pool.DynamicMemoryUsage() - 1);
+    BOOST_CHECK(!pool.exists(tx[1].GetHash()));
+    BOOST_CHECK_EQUAL(pool.size(), 3);
+    BOOST_CHECK_EQUAL(pool.GetMinFee(1).GetFeePerK(), CFeeRate(1000, nTxSize).GetFeePerK() + ::minRelayTxFee.GetFeePerK());
+
+    // The free parent stays, because its child pays for it
+    pool.TrimToSize(pool.DynamicMemoryUsage() - 1);
+    BOOST_CHECK(!pool.exists(tx[0].GetHash()));
+    BOOST_CHECK(pool.exists(tx[2].GetHash()));
+    BOOST_CHECK(pool.exists(tx[3].GetHash()));
+
+    // Packages are evicted along with their descendants
+    pool.TrimToSize(0);
+    BOOST_CHECK_EQUAL(pool.size(), 0);
+    CAmount nMinFee = CFeeRate(20000, 2 * nTxSize).GetFeePerK() + ::minRelayTxFee.GetFeePerK();
+    BOOST_CHECK_EQUAL(pool.GetMinFee(1).GetFeePerK(), nMinFee);
+
+    // The minimum fee only decays after a block. With the pool nearly empty,
+    // it halves every quarter of ROLLING_FEE_HALFLIFE.
+    SetMockTime(42 + CTxMemPool::ROLLING_FEE_HALFLIFE);
+    BOOST_CHECK_EQUAL(pool.GetMinFee(1000000).GetFeePerK(), nMinFee);
+    std::vector<CTransaction> vtxBlock;
+    std::list<CTransaction> conflicts;
+    SetMockTime(42);
+    pool.removeForBlock(vtxBlock, 1, conflicts);
+    SetMockTime(42 + CTxMemPool::ROLLING_FEE_HALFLIFE);
+    BOOST_CHECK_EQUAL(pool.GetMinFee(1000000).GetFeePerK(), (CAmount)(nMinFee / 16.0));
+
+    // ... until it is no longer above the relay fee
+    SetMockTime(42 + 10 * CTxMemPool::ROLLING_FEE_HALFLIFE);
+    BOOST_CHECK(pool.GetMinFee(1000000) == CFeeRate(0));
+    SetMockTime(0);
+}
+
+BOOST_AUTO_TEST_CASE(MempoolPersistTest)
+{
+    // Outputs anyone can spend with a standard transaction, without signatures
+    CScript redeemScript = CScript() << OP_TRUE;
+    CScript scriptPubKey = GetScriptForDestination(CScriptID(redeemScript));
+    int64_t nNow = GetTime();
+    boost::filesystem::path path = GetDataDir() / "mempool.dat";
+
+    // A parent with a child, a prioritised transaction, and one that is three hours old
+    std::vector<CTransaction> vtx;
+    std::vector<int64_t> vTime;
+    {
+        LOCK(cs_main);
+        for (int i = 0; i < 3; i++) {
+            uint256 hash = GetRandHash();
+            CCoinsModifier coins = pcoinsTip->ModifyCoins(hash);
+            coins->nVersion = 1;
+            coins->vout.push_back(CTxOut(COIN, scriptPubKey));
+            vtx.push_back(SpendP2SH(hash, 0, redeemScript, COIN));
+            if (i == 0)
+                vtx.push_back(SpendP2SH(vtx[0].GetHash(), 0, redeemScript, vtx[0].vout[0].nValue));
+        }
+        vTime.push_back(nNow - 100);
+        vTime.push_back(nNow - 50);
+        vTime.push_back(nNow - 10);
+        vTime.push_back(nNow - 3 * 60 * 60);
+        for (unsigned int i = 0; i < vtx.size(); i++) {
+            CValidationState state;
+            BOOST_CHECK(AcceptToMemoryPoolWithTime(mempool, state, vtx[i], true, NULL, vTime[i]));
+        }
+    }
+    BOOST_CHECK_EQUAL(mempool.size(), 4U);
+    uint256 hashUnknown = GetRandHash();
+    mempool.PrioritiseTransaction(vtx[2].GetHash(), vtx[2].GetHash().ToString(), 1e6, 5000);
+    mempool.PrioritiseTransaction(hashUnknown, hashUnknown.ToString(), 0, -1000);
+    std::map<uint256, std::pair<double, CAmount> > mapDeltas;
+    {
+        LOCK(mempool.cs);
+        mapDeltas = mempool.mapDeltas;
+    }
+
+    // Nothing is dumped before the load, which finds no file here
+    DumpMempool();
+    BOOST_CHECK(!boost::filesystem::exists(path));
+    BOOST_CHECK(!LoadMempool());
+    DumpMempool();
+    BOOST_CHECK(boost::filesystem::exists(path));
+
+    // Times and prioritisations come back, entries older than -mempoolexpiry don't
+    mempool.clear();
+    mempool.ClearPrioritisation(vtx[2].GetHash());
+    mempool.ClearPrioritisation(hashUnknown);
+    mapArgs["-mempoolexpiry"] = "1";
+    BOOST_CHECK(LoadMempool());
+    BOOST_CHECK_EQUAL(mempool.size(), 3U);
+    BOOST_CHECK(!mempool.exists(vtx[3].GetHash()));
+    {
+        LOCK(mempool.cs);
+        for (unsigned int i = 0; i < 3; i++) {
+            CTxMemPool::txiter it = mempool.mapTx.find(vtx[i].GetHash());
+            BOOST_REQUIRE(it != mempool.mapTx.end());
+            BOOST_CHECK_EQUAL(it->GetTime(), vTime[i]);
+            BOOST_CHECK_EQUAL(it->GetModifiedFee(), i == 2 ? 15000 : 10000);
+        }
+        BOOST_CHECK(mempool.mapDeltas == mapDeltas);
+    }
+
+    // A shutdown during the load leaves the file as it was, rather than
+    // replacing it with the part that was loaded
+    std::string strSaved = ReadFile(path);
+    mempool.clear();
+    fRequestShutdown = true;
+    BOOST_CHECK(!LoadMempool());
+    DumpMempool();
+    fRequestShutdown = false;
+    BOOST_CHECK(ReadFile(path) == strSaved);
+
+    mapArgs.erase("-mempoolexpiry");
+    mempool.clear();
+    mempool.ClearPrioritisation(vtx[2].GetHash());
+    mempool.ClearPrioritisation(hashUnknown);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
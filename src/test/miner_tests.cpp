@@ -94,6 +94,38 @@ BOOST_AUTO_TEST_CASE(CreateNewBlock_validity)
     BOOST_CHECK(pblocktemplate = CreateNewBlock(scriptPubKey));
     delete pblocktemplate;
 
+    // the template follows the transactions entering and leaving the pool
+    tx.vin.resize(1);
+    tx.vin[0].scriptSig = CScript() << OP_1;
+    tx.vin[0].prevout.hash = txFirst[0]->GetHash();
+    tx.vin[0].prevout.n = 0;
+    tx.vout.resize(1);
+    tx.vout[0].nValue = 4900000000LL;
+    CTransaction txParent(tx);
+    mempool.addUnchecked(txParent.GetHash(), CTxMemPoolEntry(txParent, 100000000LL, GetTime(), 111.0, 11));
+    BOOST_CHECK(pblocktemplate = CreateNewBlock(scriptPubKey));
+    BOOST_CHECK_EQUAL(pblocktemplate->block.vtx.size(), 2);
+    delete pblocktemplate;
+    tx.vin[0].prevout.hash = txParent.GetHash();
+    tx.vout[0].nValue = 4800000000LL;
+    hash = tx.GetHash();
+    mempool.addUnchecked(hash, CTxMemPoolEntry(tx, 100000000LL, GetTime(), 111.0, 11));
+    BOOST_CHECK(pblocktemplate = CreateNewBlock(scriptPubKey));
+    BOOST_CHECK_EQUAL(pblocktemplate->block.vtx.size(), 3);
+    BOOST_CHECK(pblocktemplate->block.vtx[2].GetHash() == hash);
+    BOOST_CHECK_EQUAL(pblocktemplate->vTxFees[0], -200000000LL);
+    delete pblocktemplate;
+    {
+        // removing the parent takes the child with it
+        std::list<CTransaction> removed;
+        mempool.remove(txParent, removed, true);
+    }
+    BOOST_CHECK(pblocktemplate = CreateNewBlock(scriptPubKey));
+    BOOST_CHECK_EQUAL(pblocktemplate->block.vtx.size(), 1);
+    BOOST_CHECK_EQUAL(pblocktemplate->vTxFees[0], 0);
+    delete pblocktemplate;
+    mempool.clear();
+
     // block sigops > limit: 1000 CHECKMULTISIG + 1
     tx.vin.resize(1);
     // NOTE: OP_NOP is used to force 20 SigOps for the CHECKMULTISIG
@@ -159,6 +159,11 @@ BOOST_AUTO_TEST_CASE(sighash_test)
         std::cout << "\n";
         #endif
         BOOST_CHECK(sh == sho);
+
+        PrecomputedTransactionData txdata(txTo);
+        BOOST_CHECK(SignatureHash(scriptCode, txTo, nIn, nHashType, &txdata) == sho);
+        BOOST_CHECK(SignatureHash(scriptCode, txTo, nIn, (nHashType & SIGHASH_ANYONECANPAY) | SIGHASH_ALL, &txdata) ==
+                    SignatureHashOld(scriptCode, txTo, nIn, (nHashType & SIGHASH_ANYONECANPAY) | SIGHASH_ALL));
     }
     #if defined(PRINT_SIGHASH_JSON)
     std::cout << "]\n";
@@ -212,6 +217,10 @@ BOOST_AUTO_TEST_CASE(sighash_from_data)
 
         sh = SignatureHash(scriptCode, tx, nIn, nHashType);
         BOOST_CHECK_MESSAGE(sh.GetHex() == sigHashHex, strTest);
+
+        PrecomputedTransactionData txdata(tx);
+        sh = SignatureHash(scriptCode, tx, nIn, nHashType, &txdata);
+        BOOST_CHECK_MESSAGE(sh.GetHex() == sigHashHex, strTest);
     }
 }
 BOOST_AUTO_TEST_SUITE_END()
@@ -23,6 +23,7 @@
 
 CClientUIInterface uiInterface; // Declared but not defined in ui_interface.h
 CWallet* pwalletMain;
+volatile bool fRequestShutdown = false; // Stands in for the one in init.cpp, so tests can request a shutdown
 
 extern bool fPrintToConsole;
 extern void noui_connect();
@@ -98,5 +99,5 @@ void StartShutdown()
 
 bool ShutdownRequested()
 {
-  return false;
+  return fRequestShutdown;
 }
@@ -0,0 +1,285 @@
+// Copyright (c) 2015 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "txdb.h"
+
+#include "chainparams.h"
+#include "coins.h"
+#include "hash.h"
+#include "main.h"
+#include "random.h"
+#include "script/script.h"
+#include "uint256.h"
+#include "test/test_bitcoin.h"
+
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+#include <boost/scoped_ptr.hpp>
+#include <boost/test/unit_test.hpp>
+
+namespace
+{
+/** CCoinsViewDB in memory, with access to its raw entries */
+class CCoinsViewDBTest : public CCoinsViewDB
+{
+public:
+    CCoinsViewDBTest() : CCoinsViewDB(1 << 20, true) {}
+
+    //! Write the coins of txid as one entry, as they were stored before every output had its own
+    void WriteLegacyCoins(const uint256 &txid, const CCoins &coins)
+    {
+        BOOST_CHECK(db.Write(std::make_pair('c', txid), coins));
+    }
+
+    //! Count the entries whose key starts with chType, followed by txid unless it is null
+    unsigned int CountEntries(char chType, const uint256 &txid = uint256())
+    {
+        std::string strPrefix(1, chType);
+        if (!txid.IsNull())
+            strPrefix.append((const char*)txid.begin(), 32);
+        boost::scoped_ptr<leveldb::Iterator> pcursor(db.NewIterator());
+        unsigned int nCount = 0;
+        for (pcursor->Seek(strPrefix); pcursor->Valid() && pcursor->key().starts_with(strPrefix); pcursor->Next())
+            nCount++;
+        return nCount;
+    }
+};
+
+CCoins RandomCoins()
+{
+    CCoins coins;
+    coins.fCoinBase = insecure_rand() % 2;
+    coins.nHeight = insecure_rand() % 500000;
+    coins.nVersion = 1 + insecure_rand() % 2;
+    coins.vout.resize(1 + insecure_rand() % 20);
+    for (unsigned int i = 0; i < coins.vout.size(); i++) {
+        if (i + 1 < coins.vout.size() && insecure_rand() % 4 == 0)
+            continue;
+        std::vector<unsigned char> script(insecure_rand() % 40);
+        for (unsigned int j = 0; j < script.size(); j++)
+            script[j] = insecure_rand();
+        coins.vout[i].nValue = insecure_rand();
+        coins.vout[i].scriptPubKey = CScript(script.begin(), script.end());
+    }
+    return coins;
+}
+
+unsigned int CountUnspent(const CCoins &coins)
+{
+    unsigned int nCount = 0;
+    for (unsigned int i = 0; i < coins.vout.size(); i++)
+        nCount += !coins.vout[i].IsNull();
+    return nCount;
+}
+
+//! The hash of GetStats, computed the way it was when every transaction had one entry
+uint256 LegacyStatsHash(const uint256 &hashBlock, const std::map<uint256, CCoins> &mapCoins)
+{
+    CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
+    ss << hashBlock;
+    for (std::map<uint256, CCoins>::const_iterator it = mapCoins.begin(); it != mapCoins.end(); it++) {
+        const CCoins &coins = it->second;
+        if (coins.IsPruned())
+            continue;
+        ss << it->first;
+        ss << VARINT(coins.nVersion);
+        ss << (coins.fCoinBase ? 'c' : 'n');
+        ss << VARINT(coins.nHeight);
+        for (unsigned int i = 0; i < coins.vout.size(); i++) {
+            if (!coins.vout[i].IsNull()) {
+                ss << VARINT(i+1);
+                ss << coins.vout[i];
+            }
+        }
+        ss << VARINT(0);
+    }
+    return ss.GetHash();
+}
+
+//! Check that the database holds exactly the unspent outputs of mapCoins, as whole transactions and one by one
+void CheckCoins(CCoinsViewDBTest &db, const std::map<uint256, CCoins> &mapCoins)
+{
+    for (std::map<uint256, CCoins>::const_iterator it = mapCoins.begin(); it != mapCoins.end(); it++) {
+        const CCoins &expected = it->second;
+        CCoins coins;
+        BOOST_CHECK_EQUAL(db.GetCoins(it->first, coins), !expected.IsPruned());
+        BOOST_CHECK(coins == expected);
+        BOOST_CHECK_EQUAL(db.HaveCoins(it->first), !expected.IsPruned());
+        BOOST_CHECK_EQUAL(db.CountEntries('C', it->first), CountUnspent(expected));
+        for (unsigned int i = 0; i < expected.vout.size() + 1; i++) {
+            CTxOut txout;
+            BOOST_CHECK_EQUAL(db.GetCoin(COutPoint(it->first, i), coins, txout), expected.IsAvailable(i));
+            if (expected.IsAvailable(i)) {
+                BOOST_CHECK(txout == expected.vout[i]);
+                BOOST_CHECK(coins.vout.empty());
+                BOOST_CHECK_EQUAL(coins.fCoinBase, expected.fCoinBase);
+                BOOST_CHECK_EQUAL(coins.nHeight, expected.nHeight);
+                BOOST_CHECK_EQUAL(coins.nVersion, expected.nVersion);
+            }
+        }
+    }
+}
+
+void CheckStats(CCoinsViewDBTest &db, const std::map<uint256, CCoins> &mapCoins)
+{
+    CCoinsStats stats;
+    BOOST_CHECK(db.GetStats(stats));
+    BOOST_CHECK(stats.hashSerialized == LegacyStatsHash(db.GetBestBlock(), mapCoins));
+    uint64_t nTransactions = 0;
+    uint64_t nTransactionOutputs = 0;
+    for (std::map<uint256, CCoins>::const_iterator it = mapCoins.begin(); it != mapCoins.end(); it++) {
+        nTransactions += !it->second.IsPruned();
+        nTransactionOutputs += CountUnspent(it->second);
+    }
+    BOOST_CHECK_EQUAL(stats.nTransactions, nTransactions);
+    BOOST_CHECK_EQUAL(stats.nTransactionOutputs, nTransactionOutputs);
+}
+}
+
+BOOST_FIXTURE_TEST_SUITE(txdb_tests, TestingSetup)
+
+BOOST_AUTO_TEST_CASE(coins_db_write)
+{
+    CCoinsViewDBTest db;
+    const uint256 hashGenesis = Params().GenesisBlock().GetHash();
+    std::map<uint256, CCoins> mapOriginal;
+    std::map<uint256, CCoins> mapCoins;
+    {
+        CCoinsViewCache cache(&db);
+        for (int i = 0; i < 100; i++) {
+            uint256 txid = GetRandHash();
+            mapOriginal[txid] = RandomCoins();
+            mapCoins[txid] = mapOriginal[txid];
+            *cache.ModifyCoins(txid) = mapOriginal[txid];
+        }
+        cache.SetBestBlock(hashGenesis);
+        BOOST_CHECK(cache.Flush());
+    }
+    BOOST_CHECK(db.GetBestBlock() == hashGenesis);
+    CheckCoins(db, mapCoins);
+    CheckStats(db, mapCoins);
+
+    // Spend outputs, and now and then restore one as undoing a block does, writing
+    // with both Sync and Flush. The database is never read for writing, so its
+    // entries must follow from the flags of the cache entries alone.
+    bool fRestored = false;
+    bool fPruned = false;
+    CCoinsViewCache cache(&db);
+    for (int nRound = 0; nRound < 20; nRound++) {
+        for (std::map<uint256, CCoins>::iterator it = mapCoins.begin(); it != mapCoins.end(); it++) {
+            if (insecure_rand() % 3)
+                continue;
+            const CCoins &original = mapOriginal[it->first];
+            CCoins &expected = it->second;
+            unsigned int n = insecure_rand() % original.vout.size();
+            CCoinsModifier coins = cache.ModifyCoins(it->first);
+            if (!expected.IsAvailable(n) && !original.vout[n].IsNull()) {
+                if (coins->IsPruned()) {
+                    coins->fCoinBase = original.fCoinBase;
+                    coins->nHeight = original.nHeight;
+                    coins->nVersion = original.nVersion;
+                }
+                if (coins->vout.size() <= n)
+                    coins->vout.resize(n + 1);
+                coins->vout[n] = original.vout[n];
+                fRestored = true;
+            } else {
+                coins->Spend(n);
+                fPruned |= coins->IsPruned();
+            }
+            expected = *coins;
+            expected.Cleanup();
+        }
+        if (nRound % 2) {
+            BOOST_CHECK(cache.Sync());
+        } else {
+            BOOST_CHECK(cache.Flush());
+        }
+        CheckCoins(db, mapCoins);
+    }
+    BOOST_CHECK(fRestored);
+    BOOST_CHECK(fPruned);
+    CheckStats(db, mapCoins);
+}
+
+BOOST_AUTO_TEST_CASE(coins_db_upgrade)
+{
+    CCoinsViewDBTest db;
+    std::map<uint256, CCoins> mapCoins;
+    for (int i = 0; i < 100; i++) {
+        uint256 txid = GetRandHash();
+        CCoins &coins = mapCoins[txid];
+        coins = RandomCoins();
+        db.WriteLegacyCoins(txid, coins);
+    }
+    {
+        CCoinsViewCache cache(&db);
+        cache.SetBestBlock(Params().GenesisBlock().GetHash());
+        BOOST_CHECK(cache.Flush());
+    }
+    BOOST_CHECK_EQUAL(db.CountEntries('c'), mapCoins.size());
+    BOOST_CHECK(db.Upgrade());
+    BOOST_CHECK_EQUAL(db.CountEntries('c'), 0U);
+    CheckCoins(db, mapCoins);
+    CheckStats(db, mapCoins);
+    // Nothing is left to upgrade
+    BOOST_CHECK(db.Upgrade());
+    CheckCoins(db, mapCoins);
+}
+
+BOOST_AUTO_TEST_CASE(addr_index_read)
+{
+    CBlockTreeDB db(1 << 20, true);
+    std::vector<uint160> vAddrIds;
+    std::vector<std::pair<uint160, CExtDiskTxPos> > vEntries;
+    std::set<CExtDiskTxPos> setAll;
+    for (int i = 0; i < 20; i++) {
+        uint160 addrid;
+        GetRandBytes(addrid.begin(), addrid.size());
+        vAddrIds.push_back(addrid);
+        for (int j = 0; j < 10; j++) {
+            int nHeight = insecure_rand() % 100;
+            CExtDiskTxPos pos(CDiskTxPos(CDiskBlockPos(0, nHeight * 1000), insecure_rand() % 1000), nHeight);
+            vEntries.push_back(std::make_pair(addrid, pos));
+            setAll.insert(pos);
+            // Transactions shared with the previous identifier
+            if (i > 0 && j % 3 == 0)
+                vEntries.push_back(std::make_pair(vAddrIds[i - 1], pos));
+        }
+    }
+    BOOST_CHECK(db.WriteAddrIndex(vEntries, std::vector<std::pair<uint160, CExtDiskTxPos> >(), CAddrUnspentMap(), CAddrSummaryMap(), uint256()));
+    std::vector<CExtDiskTxPos> vAll(setAll.begin(), setAll.end());
+
+    // Everything, in height order and once per transaction
+    std::vector<CExtDiskTxPos> list;
+    BOOST_CHECK(db.ReadAddrIndex(vAddrIds, list, vAll[0], vAll.size() + 1));
+    BOOST_CHECK(list == vAll);
+
+    // Pages of any size, starting at any entry
+    for (int i = 0; i < 50; i++) {
+        size_t nStart = insecure_rand() % vAll.size();
+        size_t nMaxResults = 1 + insecure_rand() % 20;
+        list.clear();
+        BOOST_CHECK(db.ReadAddrIndex(vAddrIds, list, vAll[nStart], nMaxResults));
+        std::vector<CExtDiskTxPos> vExpected(vAll.begin() + nStart, vAll.begin() + std::min(vAll.size(), nStart + nMaxResults));
+        BOOST_CHECK(list == vExpected);
+    }
+
+    // A single identifier, and identifiers without entries
+    list.clear();
+    BOOST_CHECK(db.ReadAddrIndex(vAddrIds[0], list));
+    std::set<CExtDiskTxPos> setFirst;
+    for (unsigned int i = 0; i < vEntries.size(); i++)
+        if (vEntries[i].first == vAddrIds[0])
+            setFirst.insert(vEntries[i].second);
+    BOOST_CHECK(list == std::vector<CExtDiskTxPos>(setFirst.begin(), setFirst.end()));
+    list.clear();
+    BOOST_CHECK(db.ReadAddrIndex(std::vector<uint160>(1, uint160()), list, vAll[0], 10));
+    BOOST_CHECK(list.empty());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -6,33 +6,213 @@
 #include "txdb.h"
 
 #include "chainparams.h"
+#include "checkqueue.h"
+#include "crypto/common.h"
 #include "hash.h"
+#include "init.h"
 #include "main.h"
 #include "pow.h"
+#include "ui_interface.h"
 #include "uint256.h"
+#include "util.h"
+#include "utiltime.h"
 
+#include <algorithm>
+#include <limits>
+#include <set>
 #include <stdint.h>
 
+#include <boost/foreach.hpp>
 #include <boost/thread.hpp>
 
 using namespace std;
 
 static const char DB_COINS = 'c';
+static const char DB_COIN = 'C';
 static const char DB_BLOCK_FILES = 'f';
 static const char DB_TXINDEX = 't';
 static const char DB_BLOCK_INDEX = 'b';
+static const char DB_ADDRINDEX = 'a';
+static const char DB_ADDRUNSPENT = 'u';
+static const char DB_ADDRSUMMARY = 's';
 
 static const char DB_BEST_BLOCK = 'B';
 static const char DB_FLAG = 'F';
 static const char DB_REINDEX_FLAG = 'R';
 static const char DB_LAST_BLOCK = 'l';
+static const char DB_ADDRINDEX_VERSION = 'V';
+static const char DB_ADDRINDEX_BEST = 'A';
 
+static const char DB_SALT = 'S';
 
-void static BatchWriteCoins(CLevelDBBatch &batch, const uint256 &hash, const CCoins &coins) {
-    if (coins.IsPruned())
-        batch.Erase(make_pair(DB_COINS, hash));
-    else
-        batch.Write(make_pair(DB_COINS, hash), coins);
+/**
+ * Key of an address index entry.
+ *
+ * Entries are keyed by the full address identifier, followed by the
+ * position stored big-endian with the height first, so that the entries
+ * of one address are contiguous and sorted by height (and then by
+ * position on disk) within LevelDB, and can be iterated in that order
+ * starting at an arbitrary position.
+ */
+struct CAddrIndexKey
+{
+    uint160 addrid;
+    CExtDiskTxPos pos;
+
+    CAddrIndexKey(const uint160 &addridIn, const CExtDiskTxPos &posIn) : addrid(addridIn), pos(posIn) {}
+    CAddrIndexKey() {}
+
+    unsigned int GetSerializeSize(int nType, int nVersion) const {
+        return 1 + 20 + 16;
+    }
+
+    template<typename Stream>
+    void Serialize(Stream &s, int nType, int nVersion) const {
+        unsigned char buf[16];
+        WriteBE32(&buf[0], pos.nHeight);
+        WriteBE32(&buf[4], pos.nFile);
+        WriteBE32(&buf[8], pos.nPos);
+        WriteBE32(&buf[12], pos.nTxOffset);
+        ser_writedata8(s, DB_ADDRINDEX);
+        s.write((const char*)addrid.begin(), 20);
+        s.write((const char*)buf, sizeof(buf));
+    }
+
+    template<typename Stream>
+    void Unserialize(Stream &s, int nType, int nVersion) {
+        unsigned char buf[16];
+        if (ser_readdata8(s) != DB_ADDRINDEX)
+            throw std::ios_base::failure("CAddrIndexKey::Unserialize(): not an address index key");
+        s.read((char*)addrid.begin(), 20);
+        s.read((char*)buf, sizeof(buf));
+        pos.nHeight = ReadBE32(&buf[0]);
+        pos.nFile = ReadBE32(&buf[4]);
+        pos.nPos = ReadBE32(&buf[8]);
+        pos.nTxOffset = ReadBE32(&buf[12]);
+    }
+};
+
+/**
+ * Key of a chainstate entry, which holds a single unspent output.
+ *
+ * Entries are keyed by txid followed by the output index, so the unspent
+ * outputs of one transaction are contiguous and can be read with one seek.
+ * Before, each transaction had one entry keyed by (DB_COINS, txid), which
+ * had to be rewritten entirely whenever one of its outputs was spent.
+ */
+struct CCoinKey
+{
+    uint256 txid;
+    uint32_t n;
+
+    CCoinKey(const uint256 &txidIn, uint32_t nIn) : txid(txidIn), n(nIn) {}
+    CCoinKey() : n(0) {}
+
+    unsigned int GetSerializeSize(int nType, int nVersion) const {
+        return 1 + 32 + GetSizeOfVarInt(n);
+    }
+
+    template<typename Stream>
+    void Serialize(Stream &s, int nType, int nVersion) const {
+        ser_writedata8(s, DB_COIN);
+        s.write((const char*)txid.begin(), 32);
+        WriteVarInt(s, n);
+    }
+
+    template<typename Stream>
+    void Unserialize(Stream &s, int nType, int nVersion) {
+        if (ser_readdata8(s) != DB_COIN)
+            throw std::ios_base::failure("CCoinKey::Unserialize(): not a coin key");
+        s.read((char*)txid.begin(), 32);
+        n = ReadVarInt<Stream, uint32_t>(s);
+    }
+
+    //! Whether slKey is the key of an output of txid
+    static bool IsOf(const leveldb::Slice &slKey, const uint256 &txid) {
+        return slKey.size() > 33 && slKey[0] == DB_COIN && memcmp(slKey.data() + 1, txid.begin(), 32) == 0;
+    }
+};
+
+/**
+ * Value of a chainstate entry: one output along with the metadata of its
+ * transaction, which is repeated for every unspent output.
+ */
+class CCoinValue
+{
+private:
+    CCoins &coins;
+    CTxOut &txout;
+
+public:
+    CCoinValue(CCoins &coinsIn, CTxOut &txoutIn) : coins(coinsIn), txout(txoutIn) {}
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion) {
+        unsigned int nCode = coins.nHeight * 2 + (coins.fCoinBase ? 1 : 0);
+        READWRITE(VARINT(nCode));
+        READWRITE(VARINT(coins.nVersion));
+        READWRITE(REF(CTxOutCompressor(txout)));
+        if (ser_action.ForRead()) {
+            coins.nHeight = nCode / 2;
+            coins.fCoinBase = nCode & 1;
+        }
+    }
+};
+
+/** Read the unspent outputs of txid, which are all entries starting with its key prefix */
+bool static ReadCoins(const CLevelDBWrapper &db, const uint256 &txid, CCoins &coins) {
+    boost::scoped_ptr<leveldb::Iterator> pcursor(db.NewReadIterator());
+    CDataStream ssKeySet(SER_DISK, CLIENT_VERSION);
+    ssKeySet << CCoinKey(txid, 0);
+    coins.Clear();
+    bool fFound = false;
+    for (pcursor->Seek(ssKeySet.str()); pcursor->Valid() && CCoinKey::IsOf(pcursor->key(), txid); pcursor->Next()) {
+        leveldb::Slice slKey = pcursor->key();
+        CDataStream ssKey(slKey.data(), slKey.data()+slKey.size(), SER_DISK, CLIENT_VERSION);
+        CCoinKey key;
+        ssKey >> key;
+        if (key.n >= coins.vout.size())
+            coins.vout.resize(key.n + 1);
+        leveldb::Slice slValue = pcursor->value();
+        CDataStream ssValue(slValue.data(), slValue.data()+slValue.size(), SER_DISK, CLIENT_VERSION);
+        CCoinValue value(coins, coins.vout[key.n]);
+        ssValue >> value;
+        fFound = true;
+    }
+    HandleError(pcursor->status());
+    return fFound;
+}
+
+/** Queue entries for all unspent outputs of txid */
+void static BatchWriteOutputs(CLevelDBBatch &batch, const uint256 &txid, const CCoins &coins) {
+    for (unsigned int i = 0; i < coins.vout.size(); i++) {
+        if (!coins.vout[i].IsNull())
+            batch.Write(CCoinKey(txid, i), CCoinValue(REF(coins), REF(coins.vout[i])));
+    }
+}
+
+/**
+ * Queue the changes to the entries of txid, as told by the flags of its cache
+ * entry, without reading what the database has. Fresh transactions have no
+ * entries yet. For others, the entries of spent outputs within the size the
+ * cache entry had when it last matched the database are erased, and the unspent
+ * outputs are only written again if they may not all be there.
+ */
+void static BatchWriteCoins(CLevelDBBatch &batch, const uint256 &txid, const CCoinsCacheEntry &entry) {
+    const CCoins &coins = entry.coins;
+    if (entry.flags & CCoinsCacheEntry::FRESH) {
+        BatchWriteOutputs(batch, txid, coins);
+        return;
+    }
+    unsigned int nOutputs = std::max((unsigned int)coins.vout.size(), (unsigned int)entry.nBaseOutputs);
+    for (unsigned int i = 0; i < nOutputs; i++) {
+        if (i >= coins.vout.size() || coins.vout[i].IsNull())
+            batch.Erase(CCoinKey(txid, i));
+    }
+    if (entry.flags & CCoinsCacheEntry::REWRITE)
+        BatchWriteOutputs(batch, txid, coins);
 }
 
 void static BatchWriteHashBestChain(CLevelDBBatch &batch, const uint256 &hash) {
@@ -43,11 +223,104 @@ CCoinsViewDB::CCoinsViewDB(size_t nCacheSize, bool fMemory, bool fWipe) : db(Get
 }
 
 bool CCoinsViewDB::GetCoins(const uint256 &txid, CCoins &coins) const {
-    return db.Read(make_pair(DB_COINS, txid), coins);
+    return ReadCoins(db, txid, coins);
+}
+
+bool CCoinsViewDB::GetCoin(const COutPoint &outpoint, CCoins &coins, CTxOut &txout) const {
+    coins.Clear();
+    CCoinValue value(coins, txout);
+    return db.Read(CCoinKey(outpoint.hash, outpoint.n), value);
+}
+
+namespace {
+
+/** Closure reading a run of entries from the coin database */
+class CCoinsReadCheck
+{
+private:
+    const CLevelDBWrapper *pdb;
+    const uint256 *ptxid;
+    CCoins *pcoins;
+    char *pfFound;
+    unsigned int nCount;
+
+public:
+    CCoinsReadCheck() : pdb(NULL), ptxid(NULL), pcoins(NULL), pfFound(NULL), nCount(0) {}
+    CCoinsReadCheck(const CLevelDBWrapper &db, const uint256 *ptxidIn, CCoins *pcoinsIn, char *pfFoundIn, unsigned int nCountIn) :
+        pdb(&db), ptxid(ptxidIn), pcoins(pcoinsIn), pfFound(pfFoundIn), nCount(nCountIn) {}
+
+    bool operator()() {
+        try {
+            for (unsigned int i = 0; i < nCount; i++)
+                pfFound[i] = ReadCoins(*pdb, ptxid[i], pcoins[i]);
+        } catch (const std::runtime_error& e) {
+            LogPrintf("%s: %s\n", __func__, e.what());
+            return false;
+        }
+        return true;
+    }
+
+    void swap(CCoinsReadCheck &check) {
+        std::swap(pdb, check.pdb);
+        std::swap(ptxid, check.ptxid);
+        std::swap(pcoins, check.pcoins);
+        std::swap(pfFound, check.pfFound);
+        std::swap(nCount, check.nCount);
+    }
+};
+
+/** Number of entries read by one CCoinsReadCheck */
+static const unsigned int COINS_READ_CHUNK_SIZE = 8;
+
+CCheckQueue<CCoinsReadCheck> coinsreadqueue(8, MAX_SCRIPTCHECK_THREADS);
+//! Only one thread at a time can wait for coinsreadqueue
+boost::mutex csCoinsRead;
+
+}
+
+void ThreadCoinsRead() {
+    RenameThread("bitcoin-coinsread");
+    coinsreadqueue.Thread();
+}
+
+void CCoinsViewDB::GetCoinsBatch(const std::vector<uint256> &vTxid, std::vector<std::pair<uint256, CCoins> > &vCoinsOut) const {
+    if (vTxid.size() <= COINS_READ_CHUNK_SIZE) {
+        CCoinsView::GetCoinsBatch(vTxid, vCoinsOut);
+        return;
+    }
+    // Reading in key order keeps neighbouring reads within the same tables
+    std::vector<uint256> vTxidSorted(vTxid);
+    std::sort(vTxidSorted.begin(), vTxidSorted.end());
+    std::vector<CCoins> vCoins(vTxidSorted.size());
+    std::vector<char> vfFound(vTxidSorted.size(), 0);
+    {
+        boost::unique_lock<boost::mutex> lock(csCoinsRead);
+        CCheckQueueControl<CCoinsReadCheck> control(&coinsreadqueue);
+        std::vector<CCoinsReadCheck> vChecks;
+        for (unsigned int i = 0; i < vTxidSorted.size(); i += COINS_READ_CHUNK_SIZE) {
+            unsigned int nCount = std::min(COINS_READ_CHUNK_SIZE, (unsigned int)vTxidSorted.size() - i);
+            vChecks.push_back(CCoinsReadCheck(db, &vTxidSorted[i], &vCoins[i], &vfFound[i], nCount));
+        }
+        control.Add(vChecks);
+        if (!control.Wait())
+            throw std::runtime_error("CCoinsViewDB::GetCoinsBatch(): database read failed");
+    }
+    for (unsigned int i = 0; i < vTxidSorted.size(); i++) {
+        if (vfFound[i]) {
+            vCoinsOut.push_back(std::make_pair(vTxidSorted[i], CCoins()));
+            vCoinsOut.back().second.swap(vCoins[i]);
+        }
+    }
 }
 
 bool CCoinsViewDB::HaveCoins(const uint256 &txid) const {
-    return db.Exists(make_pair(DB_COINS, txid));
+    boost::scoped_ptr<leveldb::Iterator> pcursor(db.NewReadIterator());
+    CDataStream ssKeySet(SER_DISK, CLIENT_VERSION);
+    ssKeySet << CCoinKey(txid, 0);
+    pcursor->Seek(ssKeySet.str());
+    bool fFound = pcursor->Valid() && CCoinKey::IsOf(pcursor->key(), txid);
+    HandleError(pcursor->status());
+    return fFound;
 }
 
 uint256 CCoinsViewDB::GetBestBlock() const {
@@ -57,31 +330,377 @@ uint256 CCoinsViewDB::GetBestBlock() const {
     return hashBestChain;
 }
 
+bool CCoinsViewDB::Upgrade() {
+    boost::scoped_ptr<leveldb::Iterator> pcursor(db.NewIterator());
+    pcursor->Seek(std::string(1, DB_COINS));
+    if (!pcursor->Valid() || pcursor->key()[0] != DB_COINS)
+        return true;
+
+    LogPrintf("Upgrading the chainstate database to one entry per unspent output...\n");
+    uiInterface.InitMessage(_("Upgrading chainstate database..."));
+    // Every batch converts whole transactions, so the database stays consistent
+    // if this is interrupted, and the upgrade simply continues on the next start.
+    CLevelDBBatch batch;
+    size_t nBatchSize = 0;
+    size_t nConverted = 0;
+    try {
+        for (; pcursor->Valid(); pcursor->Next()) {
+            boost::this_thread::interruption_point();
+            leveldb::Slice slKey = pcursor->key();
+            if (slKey.size() == 0 || slKey[0] != DB_COINS)
+                break;
+            CDataStream ssKey(slKey.data(), slKey.data()+slKey.size(), SER_DISK, CLIENT_VERSION);
+            char chType;
+            uint256 txid;
+            ssKey >> chType >> txid;
+            leveldb::Slice slValue = pcursor->value();
+            CDataStream ssValue(slValue.data(), slValue.data()+slValue.size(), SER_DISK, CLIENT_VERSION);
+            CCoins coins;
+            ssValue >> coins;
+            BatchWriteOutputs(batch, txid, coins);
+            batch.EraseRaw(slKey);
+            nConverted++;
+            nBatchSize += slValue.size();
+            if (nBatchSize > (1 << 24)) {
+                if (!db.WriteBatch(batch))
+                    return false;
+                batch.Clear();
+                nBatchSize = 0;
+                LogPrintf("Upgraded %u transactions\n", (unsigned int)nConverted);
+            }
+        }
+        HandleError(pcursor->status());
+        if (!db.WriteBatch(batch))
+            return false;
+    } catch (const std::exception& e) {
+        return error("%s: Deserialize or I/O error - %s", __func__, e.what());
+    }
+    LogPrintf("Upgraded the chainstate database (%u transactions)\n", (unsigned int)nConverted);
+    return true;
+}
+
 bool CCoinsViewDB::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock) {
+    bool ret = WriteCoins(mapCoins, hashBlock);
+    mapCoins.clear();
+    return ret;
+}
+
+bool CCoinsViewDB::WriteCoins(const CCoinsMap &mapCoins, const uint256 &hashBlock) {
     CLevelDBBatch batch;
+    PrepareWrite(mapCoins, hashBlock, batch);
+    return WriteBatch(batch);
+}
+
+void CCoinsViewDB::PrepareWrite(const CCoinsMap &mapCoins, const uint256 &hashBlock, CLevelDBBatch &batch) const {
     size_t count = 0;
     size_t changed = 0;
-    for (CCoinsMap::iterator it = mapCoins.begin(); it != mapCoins.end();) {
+    for (CCoinsMap::const_iterator it = mapCoins.begin(); it != mapCoins.end(); it++) {
         if (it->second.flags & CCoinsCacheEntry::DIRTY) {
-            BatchWriteCoins(batch, it->first, it->second.coins);
+            BatchWriteCoins(batch, it->first, it->second);
             changed++;
         }
         count++;
-        CCoinsMap::iterator itOld = it++;
-        mapCoins.erase(itOld);
     }
+    // The best block marker goes last; the batch is applied atomically as a whole.
     if (!hashBlock.IsNull())
         BatchWriteHashBestChain(batch, hashBlock);
 
     LogPrint("coindb", "Committing %u changed transactions (out of %u) to coin database...\n", (unsigned int)changed, (unsigned int)count);
+}
+
+bool CCoinsViewDB::WriteBatch(CLevelDBBatch &batch) {
     return db.WriteBatch(batch);
 }
 
-CBlockTreeDB::CBlockTreeDB(size_t nCacheSize, bool fMemory, bool fWipe) : CLevelDBWrapper(GetDataDir() / "blocks" / "index", nCacheSize, fMemory, fWipe) {
-    if (!Read('S', salt)) {
-        salt = GetRandHash();
-        Write('S', salt);
+CCoinsViewBackgroundFlush::CCoinsViewBackgroundFlush(CCoinsViewDB *dbIn) : CCoinsViewBacked(dbIn), db(dbIn), fPending(false), fRunning(false), fFailed(false) {
+}
+
+void CCoinsViewBackgroundFlush::WaitForBatch(boost::unique_lock<boost::mutex> &lock, const uint256 &txid) const {
+    while (fPending && pbatchSnapshot && std::binary_search(vBatchTxid.begin(), vBatchTxid.end(), txid)) {
+        // The caller already considers the changes written, so there is no older version to fall back on.
+        if (fFailed)
+            throw std::runtime_error("CCoinsViewBackgroundFlush: writing to the coin database failed");
+        condDone.wait(lock);
+    }
+}
+
+bool CCoinsViewBackgroundFlush::GetCoins(const uint256 &txid, CCoins &coins) const {
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        WaitForBatch(lock, txid);
+        if (fPending) {
+            CCoinsMap::const_iterator it = mapSnapshot.find(txid);
+            if (it != mapSnapshot.end()) {
+                coins = it->second.coins;
+                return true;
+            }
+        }
+    }
+    // Entries not in the snapshot are not changed by writing it, so the database
+    // has the right version whether or not the write completes meanwhile.
+    return db->GetCoins(txid, coins);
+}
+
+bool CCoinsViewBackgroundFlush::GetCoin(const COutPoint &outpoint, CCoins &coins, CTxOut &txout) const {
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        WaitForBatch(lock, outpoint.hash);
+        if (fPending) {
+            CCoinsMap::const_iterator it = mapSnapshot.find(outpoint.hash);
+            if (it != mapSnapshot.end())
+                return it->second.coins.GetOutput(outpoint.n, coins, txout);
+        }
+    }
+    return db->GetCoin(outpoint, coins, txout);
+}
+
+void CCoinsViewBackgroundFlush::GetCoinsBatch(const std::vector<uint256> &vTxid, std::vector<std::pair<uint256, CCoins> > &vCoins) const {
+    std::vector<uint256> vTxidRest;
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        BOOST_FOREACH(const uint256 &txid, vTxid)
+            WaitForBatch(lock, txid);
+        if (!fPending) {
+            vTxidRest = vTxid;
+        } else {
+            BOOST_FOREACH(const uint256 &txid, vTxid) {
+                CCoinsMap::const_iterator it = mapSnapshot.find(txid);
+                if (it != mapSnapshot.end())
+                    vCoins.push_back(std::make_pair(txid, it->second.coins));
+                else
+                    vTxidRest.push_back(txid);
+            }
+        }
+    }
+    db->GetCoinsBatch(vTxidRest, vCoins);
+}
+
+bool CCoinsViewBackgroundFlush::HaveCoins(const uint256 &txid) const {
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        WaitForBatch(lock, txid);
+        if (fPending && mapSnapshot.count(txid))
+            return true;
+    }
+    return db->HaveCoins(txid);
+}
+
+uint256 CCoinsViewBackgroundFlush::GetBestBlock() const {
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        if (fPending && !hashSnapshotBlock.IsNull())
+            return hashSnapshotBlock;
+    }
+    return db->GetBestBlock();
+}
+
+bool CCoinsViewBackgroundFlush::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock) {
+    boost::unique_lock<boost::mutex> lock(cs);
+    while (fPending && !fFailed)
+        condDone.wait(lock);
+    if (fFailed)
+        return false;
+    if (!fRunning) {
+        lock.unlock();
+        return db->BatchWrite(mapCoins, hashBlock);
+    }
+    // Take over the entries; the caller continues with the empty map of the previous snapshot.
+    mapSnapshot.swap(mapCoins);
+    mapCoins.clear();
+    hashSnapshotBlock = hashBlock;
+    fPending = true;
+    condWriter.notify_one();
+    return true;
+}
+
+bool CCoinsViewBackgroundFlush::WriteCoins(const CCoinsMap &mapCoins, const uint256 &hashBlock) {
+    boost::unique_lock<boost::mutex> lock(cs);
+    while (fPending && !fFailed)
+        condDone.wait(lock);
+    if (fFailed)
+        return false;
+    if (!fRunning) {
+        lock.unlock();
+        return db->WriteCoins(mapCoins, hashBlock);
     }
+    lock.unlock();
+    // The entries cannot be taken over, so serialize them into the batch the write
+    // needs anyway. Only their txids are kept aside, to know which reads must wait.
+    boost::scoped_ptr<CLevelDBBatch> pbatch(new CLevelDBBatch());
+    db->PrepareWrite(mapCoins, hashBlock, *pbatch);
+    std::vector<uint256> vTxid;
+    for (CCoinsMap::const_iterator it = mapCoins.begin(); it != mapCoins.end(); it++) {
+        if (it->second.flags & CCoinsCacheEntry::DIRTY)
+            vTxid.push_back(it->first);
+    }
+    std::sort(vTxid.begin(), vTxid.end());
+    lock.lock();
+    pbatchSnapshot.swap(pbatch);
+    vBatchTxid.swap(vTxid);
+    hashSnapshotBlock = hashBlock;
+    fPending = true;
+    condWriter.notify_one();
+    return true;
+}
+
+bool CCoinsViewBackgroundFlush::GetStats(CCoinsStats &stats) const {
+    if (!Wait())
+        return false;
+    return db->GetStats(stats);
+}
+
+bool CCoinsViewBackgroundFlush::Wait() const {
+    boost::unique_lock<boost::mutex> lock(cs);
+    while (fPending && !fFailed)
+        condDone.wait(lock);
+    return !fFailed;
+}
+
+void CCoinsViewBackgroundFlush::WriteSnapshot(boost::unique_lock<boost::mutex> &lock) {
+    lock.unlock();
+    int64_t nStart = GetTimeMicros();
+    bool fOk;
+    try {
+        if (pbatchSnapshot)
+            fOk = db->WriteBatch(*pbatchSnapshot);
+        else
+            fOk = db->WriteCoins(mapSnapshot, hashSnapshotBlock);
+    } catch (const std::runtime_error& e) {
+        LogPrintf("%s: %s\n", __func__, e.what());
+        fOk = false;
+    }
+    LogPrint("coindb", "Wrote coins snapshot of %u transactions in the background: %.2fms\n", (unsigned int)(pbatchSnapshot ? vBatchTxid.size() : mapSnapshot.size()), 0.001 * (GetTimeMicros() - nStart));
+    lock.lock();
+    if (fOk) {
+        mapSnapshot.clear();
+        pbatchSnapshot.reset();
+        vBatchTxid.clear();
+        fPending = false;
+    } else {
+        // The cache above already considers these entries written. Keep serving
+        // them, so nothing stale is read while shutting down.
+        fFailed = true;
+        strMiscWarning = "Failed to write to coin database";
+        LogPrintf("*** %s\n", strMiscWarning);
+        uiInterface.ThreadSafeMessageBox(_("Error: A fatal internal error occurred, see debug.log for details"), "", CClientUIInterface::MSG_ERROR);
+        StartShutdown();
+    }
+    condDone.notify_all();
+}
+
+void CCoinsViewBackgroundFlush::Thread() {
+    boost::unique_lock<boost::mutex> lock(cs);
+    fRunning = true;
+    try {
+        while (true) {
+            while (!fPending || fFailed)
+                condWriter.wait(lock);
+            WriteSnapshot(lock);
+        }
+    } catch (const boost::thread_interrupted&) {
+        // Do not leave a handed off snapshot behind; later writes are synchronous.
+        if (fPending && !fFailed)
+            WriteSnapshot(lock);
+        fRunning = false;
+        throw;
+    }
+}
+
+void ThreadCoinsWrite(CCoinsViewBackgroundFlush *view) {
+    RenameThread("bitcoin-coinswrite");
+    view->Thread();
+}
+
+CCoinsViewPrefetch::CCoinsViewPrefetch(CCoinsView *viewIn, size_t nMaxCoinsIn) : CCoinsViewBacked(viewIn), nGeneration(0), nMaxCoins(nMaxCoinsIn) {
+}
+
+bool CCoinsViewPrefetch::GetCoins(const uint256 &txid, CCoins &coins) const {
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        boost::unordered_map<uint256, CCoins, CCoinsKeyHasher>::iterator it = mapCoins.find(txid);
+        if (it != mapCoins.end()) {
+            coins.swap(it->second);
+            mapCoins.erase(it);
+            return true;
+        }
+    }
+    return base->GetCoins(txid, coins);
+}
+
+void CCoinsViewPrefetch::GetCoinsBatch(const std::vector<uint256> &vTxid, std::vector<std::pair<uint256, CCoins> > &vCoins) const {
+    std::vector<uint256> vTxidRest;
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        BOOST_FOREACH(const uint256 &txid, vTxid) {
+            boost::unordered_map<uint256, CCoins, CCoinsKeyHasher>::iterator it = mapCoins.find(txid);
+            if (it != mapCoins.end()) {
+                vCoins.push_back(std::make_pair(txid, CCoins()));
+                vCoins.back().second.swap(it->second);
+                mapCoins.erase(it);
+            } else {
+                vTxidRest.push_back(txid);
+            }
+        }
+    }
+    base->GetCoinsBatch(vTxidRest, vCoins);
+}
+
+bool CCoinsViewPrefetch::HaveCoins(const uint256 &txid) const {
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        if (mapCoins.count(txid))
+            return true;
+    }
+    return base->HaveCoins(txid);
+}
+
+bool CCoinsViewPrefetch::BatchWrite(CCoinsMap &mapCoinsIn, const uint256 &hashBlock) {
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        nGeneration++;
+        mapCoins.clear();
+    }
+    bool ret = base->BatchWrite(mapCoinsIn, hashBlock);
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        nGeneration++;
+        mapCoins.clear();
+    }
+    return ret;
+}
+
+bool CCoinsViewPrefetch::WriteCoins(const CCoinsMap &mapCoinsIn, const uint256 &hashBlock) {
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        nGeneration++;
+        mapCoins.clear();
+    }
+    bool ret = base->WriteCoins(mapCoinsIn, hashBlock);
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        nGeneration++;
+        mapCoins.clear();
+    }
+    return ret;
+}
+
+void CCoinsViewPrefetch::Prefetch(const uint256 &txid) {
+    unsigned int nGenerationRead;
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        if (mapCoins.size() >= nMaxCoins || mapCoins.count(txid))
+            return;
+        nGenerationRead = nGeneration;
+    }
+    CCoins coins;
+    if (!base->GetCoins(txid, coins))
+        return;
+    boost::unique_lock<boost::mutex> lock(cs);
+    if (nGeneration == nGenerationRead)
+        mapCoins[txid].swap(coins);
+}
+
+CBlockTreeDB::CBlockTreeDB(size_t nCacheSize, bool fMemory, bool fWipe) : CLevelDBWrapper(GetDataDir() / "blocks" / "index", nCacheSize, fMemory, fWipe) {
 }
 
 bool CBlockTreeDB::ReadBlockFileInfo(int nFile, CBlockFileInfo &info) {
@@ -104,56 +723,67 @@ bool CBlockTreeDB::ReadLastBlockFile(int &nFile) {
     return Read(DB_LAST_BLOCK, nFile);
 }
 
+/** Add the unspent outputs of one transaction to the statistics, hashing them as they used to be stored */
+void static ApplyStats(CCoinsStats &stats, CHashWriter &ss, const uint256 &txhash, const CCoins &coins) {
+    ss << txhash;
+    ss << VARINT(coins.nVersion);
+    ss << (coins.fCoinBase ? 'c' : 'n');
+    ss << VARINT(coins.nHeight);
+    stats.nTransactions++;
+    for (unsigned int i=0; i<coins.vout.size(); i++) {
+        const CTxOut &out = coins.vout[i];
+        if (!out.IsNull()) {
+            stats.nTransactionOutputs++;
+            ss << VARINT(i+1);
+            ss << out;
+            stats.nTotalAmount += out.nValue;
+        }
+    }
+    ss << VARINT(0);
+}
+
 bool CCoinsViewDB::GetStats(CCoinsStats &stats) const {
     /* It seems that there are no "const iterators" for LevelDB.  Since we
        only need read operations on it, use a const-cast to get around
        that restriction.  */
     boost::scoped_ptr<leveldb::Iterator> pcursor(const_cast<CLevelDBWrapper*>(&db)->NewIterator());
-    pcursor->SeekToFirst();
+    pcursor->Seek(std::string(1, DB_COIN));
 
     CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
     stats.hashBlock = GetBestBlock();
     ss << stats.hashBlock;
-    CAmount nTotalAmount = 0;
+    stats.nTotalAmount = 0;
+    // The outputs of a transaction are contiguous; collect them before adding them up.
+    CCoinKey key;
+    CCoins coins;
     while (pcursor->Valid()) {
         boost::this_thread::interruption_point();
         try {
             leveldb::Slice slKey = pcursor->key();
-            CDataStream ssKey(slKey.data(), slKey.data()+slKey.size(), SER_DISK, CLIENT_VERSION);
-            char chType;
-            ssKey >> chType;
-            if (chType == DB_COINS) {
-                leveldb::Slice slValue = pcursor->value();
-                CDataStream ssValue(slValue.data(), slValue.data()+slValue.size(), SER_DISK, CLIENT_VERSION);
-                CCoins coins;
-                ssValue >> coins;
-                uint256 txhash;
-                ssKey >> txhash;
-                ss << txhash;
-                ss << VARINT(coins.nVersion);
-                ss << (coins.fCoinBase ? 'c' : 'n');
-                ss << VARINT(coins.nHeight);
-                stats.nTransactions++;
-                for (unsigned int i=0; i<coins.vout.size(); i++) {
-                    const CTxOut &out = coins.vout[i];
-                    if (!out.IsNull()) {
-                        stats.nTransactionOutputs++;
-                        ss << VARINT(i+1);
-                        ss << out;
-                        nTotalAmount += out.nValue;
-                    }
-                }
-                stats.nSerializedSize += 32 + slValue.size();
-                ss << VARINT(0);
+            if (slKey.size() == 0 || slKey[0] != DB_COIN)
+                break;
+            if (!coins.vout.empty() && !CCoinKey::IsOf(slKey, key.txid)) {
+                ApplyStats(stats, ss, key.txid, coins);
+                coins.Clear();
             }
+            CDataStream ssKey(slKey.data(), slKey.data()+slKey.size(), SER_DISK, CLIENT_VERSION);
+            ssKey >> key;
+            if (key.n >= coins.vout.size())
+                coins.vout.resize(key.n + 1);
+            leveldb::Slice slValue = pcursor->value();
+            CDataStream ssValue(slValue.data(), slValue.data()+slValue.size(), SER_DISK, CLIENT_VERSION);
+            CCoinValue value(coins, coins.vout[key.n]);
+            ssValue >> value;
+            stats.nSerializedSize += slKey.size() + slValue.size();
             pcursor->Next();
         } catch (const std::exception& e) {
             return error("%s: Deserialize or I/O error - %s", __func__, e.what());
         }
     }
+    if (!coins.vout.empty())
+        ApplyStats(stats, ss, key.txid, coins);
     stats.nHeight = mapBlockIndex.find(GetBestBlock())->second->nHeight;
     stats.hashSerialized = ss.GetHash();
-    stats.nTotalAmount = nTotalAmount;
     return true;
 }
 
@@ -181,51 +811,193 @@ bool CBlockTreeDB::WriteTxIndex(const std::vector<std::pair<uint256, CDiskTxPos>
 }
 
 bool CBlockTreeDB::ReadAddrIndex(const uint160 &addrid, std::vector<CExtDiskTxPos> &list) {
+    return ReadAddrIndex(std::vector<uint160>(1, addrid), list, CExtDiskTxPos(CDiskTxPos(CDiskBlockPos(0, 0), 0), 0), std::numeric_limits<size_t>::max());
+}
+
+/** Read the address index key at the position of pcursor; returns false once the entries of addrid are exhausted */
+static bool ReadAddrIndexKey(leveldb::Iterator *pcursor, const uint160 &addrid, CAddrIndexKey &key) {
+    if (!pcursor->Valid())
+        return false;
+    leveldb::Slice slKey = pcursor->key();
+    if (slKey.size() != key.GetSerializeSize(SER_DISK, CLIENT_VERSION) || slKey[0] != DB_ADDRINDEX)
+        return false;
+    CDataStream ssKey(slKey.data(), slKey.data() + slKey.size(), SER_DISK, CLIENT_VERSION);
+    ssKey >> key;
+    return key.addrid == addrid;
+}
+
+bool CBlockTreeDB::ReadAddrIndex(const std::vector<uint160> &vAddrIds, std::vector<CExtDiskTxPos> &list, const CExtDiskTxPos &posStart, size_t nMaxResults) {
+    if (nMaxResults == 0)
+        return true;
+    std::set<uint160> setAddrIds(vAddrIds.begin(), vAddrIds.end());
+    // One iterator walks the identifiers in key order, with a seek per identifier. The
+    // first nMaxResults positions are kept; the entries of an identifier are sorted, so
+    // its walk ends at the first one beyond them.
+    std::set<CExtDiskTxPos> setResults;
     boost::scoped_ptr<leveldb::Iterator> pcursor(NewIterator());
-    uint64_t lookupid;
-    {
-        CHashWriter ss(SER_GETHASH, 0);
-        ss << salt;
-        ss << addrid;
-        lookupid = ss.GetHash().GetCheapHash();
+    try {
+        BOOST_FOREACH(const uint160 &addrid, setAddrIds) {
+            CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+            ssKey << CAddrIndexKey(addrid, posStart);
+            pcursor->Seek(leveldb::Slice(&ssKey[0], ssKey.size()));
+            CAddrIndexKey key;
+            for (; ReadAddrIndexKey(pcursor.get(), addrid, key); pcursor->Next()) {
+                if (setResults.size() == nMaxResults) {
+                    if (!(key.pos < *setResults.rbegin()))
+                        break;
+                    // A transaction of several identifiers is only returned once
+                    if (setResults.insert(key.pos).second)
+                        setResults.erase(--setResults.end());
+                } else {
+                    setResults.insert(key.pos);
+                }
+            }
+        }
+    } catch (const std::exception &e) {
+        return error("%s: Deserialize or I/O error - %s", __func__, e.what());
     }
+    list.insert(list.end(), setResults.begin(), setResults.end());
+    return true;
+}
+
+bool CBlockTreeDB::ReadAddrUnspentIndex(const std::vector<uint160> &vAddrIds, std::vector<std::pair<COutPoint, CAddrUnspentValue> > &vUnspent) {
+    std::set<uint160> setAddrIds(vAddrIds.begin(), vAddrIds.end());
+    std::set<COutPoint> setOutPoints;
+    boost::scoped_ptr<leveldb::Iterator> pcursor(NewIterator());
+    BOOST_FOREACH(const uint160 &addrid, setAddrIds) {
+        {
+            CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+            ssKey << std::make_pair(DB_ADDRUNSPENT, addrid);
+            pcursor->Seek(ssKey.str());
+        }
+        while (pcursor->Valid()) {
+            std::pair<char, CAddrUnspentKey> key;
+            CAddrUnspentValue value;
+            try {
+                leveldb::Slice slKey = pcursor->key();
+                CDataStream ssKey(slKey.data(), slKey.data() + slKey.size(), SER_DISK, CLIENT_VERSION);
+                ssKey >> key;
+                if (key.first != DB_ADDRUNSPENT || key.second.addrid != addrid)
+                    break;
+                leveldb::Slice slValue = pcursor->value();
+                CDataStream ssValue(slValue.data(), slValue.data() + slValue.size(), SER_DISK, CLIENT_VERSION);
+                ssValue >> value;
+            } catch (const std::exception &e) {
+                return error("%s: Deserialize or I/O error - %s", __func__, e.what());
+            }
+            // An output with several of the identifiers is only returned once
+            if (setOutPoints.insert(key.second.outpoint).second)
+                vUnspent.push_back(std::make_pair(key.second.outpoint, value));
+            pcursor->Next();
+        }
+    }
+    return true;
+}
+
+bool CBlockTreeDB::ReadAddrSummary(const uint160 &addrid, CAddrSummary &summary) {
+    return Read(std::make_pair(DB_ADDRSUMMARY, addrid), summary);
+}
+
+bool CBlockTreeDB::ReadAddrIndexLastHeight(const uint160 &addrid, int nBeforeHeight, int &nHeight) {
+    boost::scoped_ptr<leveldb::Iterator> pcursor(NewIterator());
     {
         CDataStream ssKey(SER_DISK, CLIENT_VERSION);
-        ssKey << std::make_pair('a', lookupid);
+        ssKey << CAddrIndexKey(addrid, CExtDiskTxPos(CDiskTxPos(CDiskBlockPos(0, 0), 0), nBeforeHeight));
         leveldb::Slice slKey(&ssKey[0], ssKey.size());
         pcursor->Seek(slKey);
     }
-    while (pcursor->Valid()) {
-        std::pair<std::pair<char, uint64_t>, CExtDiskTxPos> key;
-        leveldb::Slice slKey = pcursor->key();
-        try {
-            CDataStream ssKey(slKey.data(), slKey.data() + slKey.size(), SER_DISK, CLIENT_VERSION);
-            ssKey >> key;
-        } catch(std::exception &e) {
-            return error("%s: Deserialize or I/O error - %s", __func__, e.what());
-        }
-        if (key.first.first == 'a' && key.first.second == lookupid) {
-            list.push_back(key.second);
-        } else {
-            break;
-        }
-        pcursor->Next();
+    // The entry preceding the first one at nBeforeHeight
+    if (pcursor->Valid())
+        pcursor->Prev();
+    else
+        pcursor->SeekToLast();
+    if (!pcursor->Valid())
+        return false;
+    CAddrIndexKey key;
+    leveldb::Slice slKey = pcursor->key();
+    if (slKey.size() != key.GetSerializeSize(SER_DISK, CLIENT_VERSION) || slKey[0] != DB_ADDRINDEX)
+        return false;
+    try {
+        CDataStream ssKey(slKey.data(), slKey.data() + slKey.size(), SER_DISK, CLIENT_VERSION);
+        ssKey >> key;
+    } catch (const std::exception &e) {
+        return error("%s: Deserialize or I/O error - %s", __func__, e.what());
     }
+    if (key.addrid != addrid)
+        return false;
+    nHeight = key.pos.nHeight;
     return true;
 }
 
-bool CBlockTreeDB::AddAddrIndex(const std::vector<std::pair<uint160, CExtDiskTxPos> > &list) {
+bool CBlockTreeDB::WriteAddrIndex(const std::vector<std::pair<uint160, CExtDiskTxPos> > &list, const std::vector<std::pair<uint160, CExtDiskTxPos> > &listErase, const CAddrUnspentMap &mapUnspent, const CAddrSummaryMap &mapSummary, const uint256 &hashBlock) {
     unsigned char foo[0];
     CLevelDBBatch batch;
-    for (std::vector<std::pair<uint160, CExtDiskTxPos> >::const_iterator it = list.begin(); it != list.end(); ++it) {
-        CHashWriter ss(SER_GETHASH, 0);
-        ss << salt;
-        ss << it->first;
-        batch.Write(std::make_pair(std::make_pair('a', ss.GetHash().GetCheapHash()), it->second), FLATDATA(foo));
+    for (std::vector<std::pair<uint160, CExtDiskTxPos> >::const_iterator it = list.begin(); it != list.end(); ++it)
+        batch.Write(CAddrIndexKey(it->first, it->second), FLATDATA(foo));
+    for (std::vector<std::pair<uint160, CExtDiskTxPos> >::const_iterator it = listErase.begin(); it != listErase.end(); ++it)
+        batch.Erase(CAddrIndexKey(it->first, it->second));
+    for (CAddrUnspentMap::const_iterator it = mapUnspent.begin(); it != mapUnspent.end(); ++it) {
+        if (it->second.IsNull())
+            batch.Erase(std::make_pair(DB_ADDRUNSPENT, it->first));
+        else
+            batch.Write(std::make_pair(DB_ADDRUNSPENT, it->first), it->second);
+    }
+    for (CAddrSummaryMap::const_iterator it = mapSummary.begin(); it != mapSummary.end(); ++it) {
+        if (it->second.IsNull())
+            batch.Erase(std::make_pair(DB_ADDRSUMMARY, it->first));
+        else
+            batch.Write(std::make_pair(DB_ADDRSUMMARY, it->first), it->second);
+    }
+    batch.Write(DB_ADDRINDEX_BEST, hashBlock);
+    return WriteBatch(batch);
+}
+
+bool CBlockTreeDB::ReadAddrIndexBestBlock(uint256 &hashBlock) {
+    return Read(DB_ADDRINDEX_BEST, hashBlock);
+}
+
+bool CBlockTreeDB::EraseAddrIndex() {
+    static const char prefixes[] = { DB_ADDRINDEX, DB_ADDRUNSPENT, DB_ADDRSUMMARY };
+    boost::scoped_ptr<leveldb::Iterator> pcursor(NewIterator());
+
+    CLevelDBBatch batch;
+    size_t nBatchSize = 0;
+    for (unsigned int i = 0; i < sizeof(prefixes); i++) {
+        pcursor->Seek(std::string(1, prefixes[i]));
+        while (pcursor->Valid()) {
+            boost::this_thread::interruption_point();
+            leveldb::Slice slKey = pcursor->key();
+            if (slKey.size() == 0 || slKey[0] != prefixes[i])
+                break;
+            // Entries of all formats share the prefix, so erase them by their raw key
+            batch.EraseRaw(slKey);
+            if (++nBatchSize >= 100000) {
+                if (!WriteBatch(batch))
+                    return false;
+                batch.Clear();
+                nBatchSize = 0;
+            }
+            pcursor->Next();
+        }
     }
+    // The salt was only used by the legacy, hash-based format
+    batch.Erase(DB_SALT);
+    batch.Erase(DB_ADDRINDEX_VERSION);
+    batch.Erase(DB_ADDRINDEX_BEST);
     return WriteBatch(batch);
 }
 
+bool CBlockTreeDB::WriteAddrIndexVersion(int nVersion) {
+    return Write(DB_ADDRINDEX_VERSION, nVersion);
+}
+
+bool CBlockTreeDB::ReadAddrIndexVersion(int &nVersion) {
+    nVersion = 0;
+    if (!Exists(DB_ADDRINDEX_VERSION))
+        return true;
+    return Read(DB_ADDRINDEX_VERSION, nVersion);
+}
+
 bool CBlockTreeDB::WriteFlag(const std::string &name, bool fValue) {
     return Write(std::make_pair(DB_FLAG, name), fValue ? '1' : '0');
 }
@@ -14,10 +14,17 @@
 #include <utility>
 #include <vector>
 
+#include <boost/scoped_ptr.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+
 class CBlockFileInfo;
 class CBlockIndex;
 struct CDiskTxPos;
 struct CExtDiskTxPos;
+struct CAddrUnspentKey;
+struct CAddrUnspentValue;
+struct CAddrSummary;
 class uint160;
 class uint256;
 
@@ -27,8 +34,13 @@ static const int64_t nDefaultDbCache = 100;
 static const int64_t nMaxDbCache = sizeof(void*) > 4 ? 16384 : 1024;
 //! min. -dbcache in (MiB)
 static const int64_t nMinDbCache = 4;
+//! current on-disk format of the address index
+static const int nAddrIndexVersion = 6;
 
-/** CCoinsView backed by the LevelDB coin database (chainstate/) */
+/**
+ * CCoinsView backed by the LevelDB coin database (chainstate/). Every unspent output
+ * has its own entry, so spending an output only deletes that entry.
+ */
 class CCoinsViewDB : public CCoinsView
 {
 protected:
@@ -37,19 +49,127 @@ public:
     CCoinsViewDB(size_t nCacheSize, bool fMemory = false, bool fWipe = false);
 
     bool GetCoins(const uint256 &txid, CCoins &coins) const;
+    //! Reads just the entry of the output
+    bool GetCoin(const COutPoint &outpoint, CCoins &coins, CTxOut &txout) const;
+    //! Reads the txids in key order, spread over the ThreadCoinsRead threads
+    void GetCoinsBatch(const std::vector<uint256> &vTxid, std::vector<std::pair<uint256, CCoins> > &vCoins) const;
+    bool HaveCoins(const uint256 &txid) const;
+    uint256 GetBestBlock() const;
+    bool BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock);
+    bool GetStats(CCoinsStats &stats) const;
+
+    //! Write the modified entries of mapCoins and the best block in one atomic batch, leaving mapCoins intact
+    bool WriteCoins(const CCoinsMap &mapCoins, const uint256 &hashBlock);
+
+    //! Queue the changes WriteCoins makes into batch, without applying them
+    void PrepareWrite(const CCoinsMap &mapCoins, const uint256 &hashBlock, CLevelDBBatch &batch) const;
+
+    //! Apply a batch queued by PrepareWrite
+    bool WriteBatch(CLevelDBBatch &batch);
+
+    //! Convert entries of the old format, with one entry per transaction, to one entry per unspent output
+    bool Upgrade();
+};
+
+/**
+ * CCoinsView layer that writes to the coin database in the background. A batch
+ * written through it becomes an immutable snapshot, which ThreadCoinsWrite
+ * persists while the layer keeps serving reads from it, so the caller can go on
+ * with a fresh cache right away. Entries written with WriteCoins stay with the
+ * caller instead; they are serialized into a database batch up front, and reads
+ * of them wait for that batch to be on disk. Only one snapshot is pending at a
+ * time; writing the next one waits for the previous one to be on disk. The
+ * snapshot reaches the database as a single atomic batch with the best block
+ * marker last, so after a crash the database is at either the previous or the
+ * new best block. Without a running writer thread, writes happen synchronously.
+ */
+class CCoinsViewBackgroundFlush : public CCoinsViewBacked
+{
+private:
+    CCoinsViewDB *db;
+    mutable boost::mutex cs;
+    //! Signalled when a snapshot is handed off to the writer thread
+    boost::condition_variable condWriter;
+    //! Signalled when a snapshot was written (or failed to be)
+    mutable boost::condition_variable condDone;
+    //! The snapshot being written. Not modified while fPending is set.
+    CCoinsMap mapSnapshot;
+    //! The serialized snapshot being written, when it was handed over by WriteCoins
+    boost::scoped_ptr<CLevelDBBatch> pbatchSnapshot;
+    //! The sorted txids whose changes are in pbatchSnapshot
+    std::vector<uint256> vBatchTxid;
+    uint256 hashSnapshotBlock;
+    bool fPending;
+    bool fRunning;
+    bool fFailed;
+
+    //! Wait until a pending batch does not have changes to txid
+    void WaitForBatch(boost::unique_lock<boost::mutex> &lock, const uint256 &txid) const;
+
+    //! Write the pending snapshot to the database, temporarily releasing the lock
+    void WriteSnapshot(boost::unique_lock<boost::mutex> &lock);
+
+public:
+    CCoinsViewBackgroundFlush(CCoinsViewDB *dbIn);
+
+    bool GetCoins(const uint256 &txid, CCoins &coins) const;
+    bool GetCoin(const COutPoint &outpoint, CCoins &coins, CTxOut &txout) const;
+    void GetCoinsBatch(const std::vector<uint256> &vTxid, std::vector<std::pair<uint256, CCoins> > &vCoins) const;
     bool HaveCoins(const uint256 &txid) const;
     uint256 GetBestBlock() const;
     bool BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock);
+    bool WriteCoins(const CCoinsMap &mapCoins, const uint256 &hashBlock);
     bool GetStats(CCoinsStats &stats) const;
+
+    //! Wait until no snapshot is pending anymore, and return whether all were written successfully
+    bool Wait() const;
+
+    //! Writer thread, which runs until interrupted
+    void Thread();
 };
 
+/**
+ * CCoinsView layer that serves coins read from its backend ahead of time, so the
+ * database reads for blocks that are about to be connected can happen in the
+ * background. Prefetch() may be called from any thread, concurrently with the
+ * other methods. Prefetched coins are handed out once, as the cache above keeps
+ * them from then on, and all of them are dropped when writing through the layer,
+ * including those whose read is still in progress.
+ */
+class CCoinsViewPrefetch : public CCoinsViewBacked
+{
+private:
+    mutable boost::mutex cs;
+    mutable boost::unordered_map<uint256, CCoins, CCoinsKeyHasher> mapCoins;
+    //! Incremented before and after every write, to recognize reads that overlap one
+    unsigned int nGeneration;
+    size_t nMaxCoins;
+
+public:
+    CCoinsViewPrefetch(CCoinsView *viewIn, size_t nMaxCoinsIn);
+
+    bool GetCoins(const uint256 &txid, CCoins &coins) const;
+    void GetCoinsBatch(const std::vector<uint256> &vTxid, std::vector<std::pair<uint256, CCoins> > &vCoins) const;
+    bool HaveCoins(const uint256 &txid) const;
+    bool BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock);
+    bool WriteCoins(const CCoinsMap &mapCoins, const uint256 &hashBlock);
+
+    //! Read the coins of txid from the backend, unless they are prefetched already or the layer is full
+    void Prefetch(const uint256 &txid);
+};
+
+/** Run an instance of the thread reading coins for CCoinsViewDB::GetCoinsBatch */
+void ThreadCoinsRead();
+
+/** Run the thread writing the snapshots of a CCoinsViewBackgroundFlush */
+void ThreadCoinsWrite(CCoinsViewBackgroundFlush *view);
+
 /** Access to the block database (blocks/index/) */
 class CBlockTreeDB : public CLevelDBWrapper
 {
 public:
     CBlockTreeDB(size_t nCacheSize, bool fMemory = false, bool fWipe = false);
 private:
-    uint256 salt;
     CBlockTreeDB(const CBlockTreeDB&);
     void operator=(const CBlockTreeDB&);
 public:
@@ -61,7 +181,29 @@ public:
     bool ReadTxIndex(const uint256 &txid, CDiskTxPos &pos);
     bool WriteTxIndex(const std::vector<std::pair<uint256, CDiskTxPos> > &list);
     bool ReadAddrIndex(const uint160 &addrid, std::vector<CExtDiskTxPos> &list);
-    bool AddAddrIndex(const std::vector<std::pair<uint160, CExtDiskTxPos> > &list);
+    /**
+     * Read at most nMaxResults entries of any of vAddrIds, in height order without duplicates,
+     * starting at posStart (inclusive). One iterator visits the identifiers in key order, and
+     * stops reading an identifier at its first entry beyond the nMaxResults kept so far.
+     */
+    bool ReadAddrIndex(const std::vector<uint160> &vAddrIds, std::vector<CExtDiskTxPos> &list, const CExtDiskTxPos &posStart, size_t nMaxResults);
+    /** Read the unspent outputs of any of vAddrIds, without duplicates */
+    bool ReadAddrUnspentIndex(const std::vector<uint160> &vAddrIds, std::vector<std::pair<COutPoint, CAddrUnspentValue> > &vUnspent);
+    /** Read the summary of addrid; returns false if it has none */
+    bool ReadAddrSummary(const uint160 &addrid, CAddrSummary &summary);
+    /** Find the height of the last entry of addrid below nBeforeHeight; returns false if there is none */
+    bool ReadAddrIndexLastHeight(const uint160 &addrid, int nBeforeHeight, int &nHeight);
+    /**
+     * Add and remove address index entries, apply changes to the unspent outputs and summaries
+     * of addresses (null values are erased) and record the last block included, atomically
+     */
+    bool WriteAddrIndex(const std::vector<std::pair<uint160, CExtDiskTxPos> > &list, const std::vector<std::pair<uint160, CExtDiskTxPos> > &listErase, const std::map<CAddrUnspentKey, CAddrUnspentValue> &mapUnspent, const std::map<uint160, CAddrSummary> &mapSummary, const uint256 &hashBlock);
+    /** Read the last block included in the address index */
+    bool ReadAddrIndexBestBlock(uint256 &hashBlock);
+    /** Remove all address index entries, in the current or any previous format */
+    bool EraseAddrIndex();
+    bool WriteAddrIndexVersion(int nVersion);
+    bool ReadAddrIndexVersion(int &nVersion);
     bool WriteFlag(const std::string &name, bool fValue);
     bool ReadFlag(const std::string &name, bool &fValue);
     bool LoadBlockIndexGuts();
@@ -8,6 +8,7 @@
 #include "clientversion.h"
 #include "consensus/consensus.h"
 #include "consensus/validation.h"
+#include "core_memusage.h"
 #include "main.h"
 #include "policy/fees.h"
 #include "streams.h"
@@ -15,10 +16,18 @@
 #include "utilmoneystr.h"
 #include "version.h"
 
+#include <cmath>
+#include <limits>
+
+#include <boost/foreach.hpp>
+
 using namespace std;
 
 CTxMemPoolEntry::CTxMemPoolEntry():
-    nFee(0), nTxSize(0), nModSize(0), nTime(0), dPriority(0.0), hadNoDependencies(false)
+    nFee(0), nTxSize(0), nModSize(0), nUsageSize(0), nTime(0), dPriority(0.0), hadNoDependencies(false),
+    fInputsVerified(false), nSigOps(0), nFeeDelta(0),
+    nCountWithAncestors(1), nSizeWithAncestors(0), nModFeesWithAncestors(0),
+    nCountWithDescendants(1), nSizeWithDescendants(0), nModFeesWithDescendants(0)
 {
     nHeight = MEMPOOL_HEIGHT;
 }
@@ -27,10 +36,18 @@ CTxMemPoolEntry::CTxMemPoolEntry(const CTransaction& _tx, const CAmount& _nFee,
                                  int64_t _nTime, double _dPriority,
                                  unsigned int _nHeight, bool poolHasNoInputsOf):
     tx(_tx), nFee(_nFee), nTime(_nTime), dPriority(_dPriority), nHeight(_nHeight),
-    hadNoDependencies(poolHasNoInputsOf)
+    hadNoDependencies(poolHasNoInputsOf), fInputsVerified(false), nSigOps(0), nFeeDelta(0)
 {
     nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
     nModSize = tx.CalculateModifiedSize(nTxSize);
+    nUsageSize = RecursiveDynamicUsage(tx);
+
+    nCountWithAncestors = 1;
+    nSizeWithAncestors = nTxSize;
+    nModFeesWithAncestors = nFee;
+    nCountWithDescendants = 1;
+    nSizeWithDescendants = nTxSize;
+    nModFeesWithDescendants = nFee;
 }
 
 CTxMemPoolEntry::CTxMemPoolEntry(const CTxMemPoolEntry& other)
@@ -47,13 +64,38 @@ CTxMemPoolEntry::GetPriority(unsigned int currentHeight) const
     return dResult;
 }
 
+void CTxMemPoolEntry::UpdateFeeDelta(CAmount nNewFeeDelta)
+{
+    nModFeesWithAncestors += nNewFeeDelta - nFeeDelta;
+    nModFeesWithDescendants += nNewFeeDelta - nFeeDelta;
+    nFeeDelta = nNewFeeDelta;
+}
+
+void CTxMemPoolEntry::UpdateAncestorState(int64_t nModifySize, CAmount nModifyFee, int64_t nModifyCount)
+{
+    nSizeWithAncestors += nModifySize;
+    nModFeesWithAncestors += nModifyFee;
+    nCountWithAncestors += nModifyCount;
+    assert(int64_t(nCountWithAncestors) > 0);
+}
+
+void CTxMemPoolEntry::UpdateDescendantState(int64_t nModifySize, CAmount nModifyFee, int64_t nModifyCount)
+{
+    nSizeWithDescendants += nModifySize;
+    nModFeesWithDescendants += nModifyFee;
+    nCountWithDescendants += nModifyCount;
+    assert(int64_t(nCountWithDescendants) > 0);
+}
+
 CTxMemPool::CTxMemPool(const CFeeRate& _minRelayFee) :
-    nTransactionsUpdated(0)
+    nTransactionsUpdated(0), totalTxSize(0), cachedInnerUsage(0),
+    lastRollingFeeUpdate(0), blockSinceLastRollingFeeBump(false), rollingMinimumFeeRate(0)
 {
     // Sanity checks off by default for performance, because otherwise
     // accepting transactions becomes O(N^2) where N is the number
     // of transactions in the pool
     fSanityCheck = false;
+    fAddrIndex = false;
 
     minerPolicyEstimator = new CBlockPolicyEstimator(_minRelayFee);
 }
@@ -89,68 +131,373 @@ void CTxMemPool::AddTransactionsUpdated(unsigned int n)
 }
 
 
-bool CTxMemPool::addUnchecked(const uint256& hash, const CTxMemPoolEntry &entry, bool fCurrentEstimate)
+void CTxMemPool::setAddrIndex(bool _fAddrIndex)
+{
+    LOCK(cs);
+    fAddrIndex = _fAddrIndex;
+    if (!fAddrIndex) {
+        setAddrTx.clear();
+        mapTxAddrIds.clear();
+    }
+}
+
+bool CTxMemPool::CalculateMemPoolAncestors(const CTxMemPoolEntry& entry, setEntries& setAncestors,
+                                           uint64_t limitAncestorCount, uint64_t limitAncestorSize,
+                                           uint64_t limitDescendantCount, uint64_t limitDescendantSize,
+                                           std::string& errString, bool fSearchForParents)
+{
+    LOCK(cs);
+    setEntries parents;
+    const CTransaction& tx = entry.GetTx();
+
+    if (fSearchForParents) {
+        // The entry need not be in the pool, so its parents are found through its inputs.
+        BOOST_FOREACH(const CTxIn& txin, tx.vin) {
+            txiter piter = mapTx.find(txin.prevout.hash);
+            if (piter != mapTx.end()) {
+                parents.insert(piter);
+                if (parents.size() + 1 > limitAncestorCount) {
+                    errString = strprintf("too many unconfirmed parents [limit: %u]", limitAncestorCount);
+                    return false;
+                }
+            }
+        }
+    } else {
+        txiter it = mapTx.find(tx.GetHash());
+        assert(it != mapTx.end());
+        parents = GetMemPoolParents(it);
+    }
+
+    uint64_t nSizeWithAncestors = entry.GetTxSize();
+    while (!parents.empty()) {
+        txiter stageit = *parents.begin();
+        setAncestors.insert(stageit);
+        parents.erase(stageit);
+        nSizeWithAncestors += stageit->GetTxSize();
+
+        if (stageit->GetSizeWithDescendants() + entry.GetTxSize() > limitDescendantSize) {
+            errString = strprintf("exceeds descendant size limit for tx %s [limit: %u]", stageit->GetTx().GetHash().ToString(), limitDescendantSize);
+            return false;
+        } else if (stageit->GetCountWithDescendants() + 1 > limitDescendantCount) {
+            errString = strprintf("too many descendants for tx %s [limit: %u]", stageit->GetTx().GetHash().ToString(), limitDescendantCount);
+            return false;
+        } else if (nSizeWithAncestors > limitAncestorSize) {
+            errString = strprintf("exceeds ancestor size limit [limit: %u]", limitAncestorSize);
+            return false;
+        }
+
+        BOOST_FOREACH(const txiter& piter, GetMemPoolParents(stageit)) {
+            if (!setAncestors.count(piter))
+                parents.insert(piter);
+            if (parents.size() + setAncestors.size() + 1 > limitAncestorCount) {
+                errString = strprintf("too many unconfirmed ancestors [limit: %u]", limitAncestorCount);
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+void CTxMemPool::CalculateDescendants(txiter entryit, setEntries& setDescendants)
+{
+    setEntries stage;
+    if (!setDescendants.count(entryit))
+        stage.insert(entryit);
+    while (!stage.empty()) {
+        txiter it = *stage.begin();
+        setDescendants.insert(it);
+        stage.erase(it);
+        BOOST_FOREACH(const txiter& childit, GetMemPoolChildren(it)) {
+            if (!setDescendants.count(childit))
+                stage.insert(childit);
+        }
+    }
+}
+
+const CTxMemPool::setEntries& CTxMemPool::GetMemPoolParents(txiter it) const
+{
+    std::map<txiter, TxLinks, CompareIteratorByHash>::const_iterator itLinks = mapLinks.find(it);
+    assert(itLinks != mapLinks.end());
+    return itLinks->second.parents;
+}
+
+const CTxMemPool::setEntries& CTxMemPool::GetMemPoolChildren(txiter it) const
+{
+    std::map<txiter, TxLinks, CompareIteratorByHash>::const_iterator itLinks = mapLinks.find(it);
+    assert(itLinks != mapLinks.end());
+    return itLinks->second.children;
+}
+
+void CTxMemPool::UpdateParent(txiter entry, txiter parent, bool add)
+{
+    setEntries& parents = mapLinks[entry].parents;
+    if (add && parents.insert(parent).second)
+        cachedInnerUsage += memusage::IncrementalDynamicUsage(parents);
+    else if (!add && parents.erase(parent))
+        cachedInnerUsage -= memusage::IncrementalDynamicUsage(parents);
+}
+
+void CTxMemPool::UpdateChild(txiter entry, txiter child, bool add)
+{
+    setEntries& children = mapLinks[entry].children;
+    if (add && children.insert(child).second)
+        cachedInnerUsage += memusage::IncrementalDynamicUsage(children);
+    else if (!add && children.erase(child))
+        cachedInnerUsage -= memusage::IncrementalDynamicUsage(children);
+}
+
+bool CompareTxMemPoolEntryByDescendantScore::operator()(const CTxMemPoolEntry& entryA, const CTxMemPoolEntry& entryB) const
+{
+    // Compare the fee rates as fractions, in doubles to avoid overflows
+    double fA = entryA.GetModifiedFee(), sA = entryA.GetTxSize();
+    if ((double)entryA.GetModFeesWithDescendants() * sA > fA * entryA.GetSizeWithDescendants()) {
+        fA = entryA.GetModFeesWithDescendants();
+        sA = entryA.GetSizeWithDescendants();
+    }
+    double fB = entryB.GetModifiedFee(), sB = entryB.GetTxSize();
+    if ((double)entryB.GetModFeesWithDescendants() * sB > fB * entryB.GetSizeWithDescendants()) {
+        fB = entryB.GetModFeesWithDescendants();
+        sB = entryB.GetSizeWithDescendants();
+    }
+    if (fA * sB != fB * sA)
+        return fA * sB < fB * sA;
+    if (entryA.GetTime() != entryB.GetTime())
+        return entryA.GetTime() > entryB.GetTime();
+    return entryA.GetTx().GetHash() < entryB.GetTx().GetHash();
+}
+
+bool CompareTxMemPoolEntryByAncestorFee::operator()(const CTxMemPoolEntry& a, const CTxMemPoolEntry& b) const
+{
+    double f1 = (double)a.GetModFeesWithAncestors() * b.GetSizeWithAncestors();
+    double f2 = (double)b.GetModFeesWithAncestors() * a.GetSizeWithAncestors();
+    if (f1 == f2)
+        return a.GetTx().GetHash() < b.GetTx().GetHash();
+    return f1 > f2;
+}
+
+void CTxMemPool::UpdateAncestorsOf(bool add, txiter it, const setEntries& setAncestors)
+{
+    BOOST_FOREACH(const txiter& piter, GetMemPoolParents(it))
+        UpdateChild(piter, it, add);
+    const int64_t nUpdateCount = add ? 1 : -1;
+    const int64_t nUpdateSize = nUpdateCount * (int64_t)it->GetTxSize();
+    const CAmount nUpdateFee = nUpdateCount * it->GetModifiedFee();
+    BOOST_FOREACH(const txiter& ancestorit, setAncestors)
+        mapTx.modify(ancestorit, update_descendant_state(nUpdateSize, nUpdateFee, nUpdateCount));
+}
+
+void CTxMemPool::RecalculateAncestorState(txiter it)
+{
+    setEntries setAncestors;
+    uint64_t nNoLimit = std::numeric_limits<uint64_t>::max();
+    std::string dummy;
+    CalculateMemPoolAncestors(*it, setAncestors, nNoLimit, nNoLimit, nNoLimit, nNoLimit, dummy, false);
+    int64_t nSize = it->GetTxSize();
+    CAmount nFees = it->GetModifiedFee();
+    BOOST_FOREACH(const txiter& ancestorit, setAncestors) {
+        nSize += ancestorit->GetTxSize();
+        nFees += ancestorit->GetModifiedFee();
+    }
+    mapTx.modify(it, update_ancestor_state(nSize - it->GetSizeWithAncestors(), nFees - it->GetModFeesWithAncestors(),
+                                           (int64_t)setAncestors.size() + 1 - (int64_t)it->GetCountWithAncestors()));
+}
+
+void CTxMemPool::RecalculateDescendantState(txiter it)
+{
+    setEntries setDescendants;
+    CalculateDescendants(it, setDescendants);
+    int64_t nSize = 0;
+    CAmount nFees = 0;
+    BOOST_FOREACH(const txiter& descendantit, setDescendants) {
+        nSize += descendantit->GetTxSize();
+        nFees += descendantit->GetModifiedFee();
+    }
+    mapTx.modify(it, update_descendant_state(nSize - it->GetSizeWithDescendants(), nFees - it->GetModFeesWithDescendants(),
+                                             (int64_t)setDescendants.size() - (int64_t)it->GetCountWithDescendants()));
+}
+
+bool CTxMemPool::addUnchecked(const uint256& hash, const CTxMemPoolEntry &entry, bool fCurrentEstimate, const CCoinsViewCache *pcoins)
+{
+    LOCK(cs);
+    setEntries setAncestors;
+    uint64_t nNoLimit = std::numeric_limits<uint64_t>::max();
+    std::string dummy;
+    CalculateMemPoolAncestors(entry, setAncestors, nNoLimit, nNoLimit, nNoLimit, nNoLimit, dummy);
+    return addUnchecked(hash, entry, setAncestors, fCurrentEstimate, pcoins);
+}
+
+bool CTxMemPool::addUnchecked(const uint256& hash, const CTxMemPoolEntry &entry, const setEntries& setAncestors, bool fCurrentEstimate, const CCoinsViewCache *pcoins)
 {
     // Add to memory pool without checking anything.
     // Used by main.cpp AcceptToMemoryPool(), which DOES do
     // all the appropriate checks.
     LOCK(cs);
-    mapTx[hash] = entry;
-    const CTransaction& tx = mapTx[hash].GetTx();
-    for (unsigned int i = 0; i < tx.vin.size(); i++)
+    txiter newit = mapTx.insert(entry).first;
+    mapLinks.insert(std::make_pair(newit, TxLinks()));
+
+    // Apply an earlier PrioritiseTransaction call for this transaction
+    std::map<uint256, std::pair<double, CAmount> >::const_iterator pos = mapDeltas.find(hash);
+    if (pos != mapDeltas.end() && pos->second.second)
+        mapTx.modify(newit, update_fee_delta(pos->second.second));
+
+    const CTransaction& tx = newit->GetTx();
+    for (unsigned int i = 0; i < tx.vin.size(); i++) {
         mapNextTx[tx.vin[i].prevout] = CInPoint(&tx, i);
+        txiter piter = mapTx.find(tx.vin[i].prevout.hash);
+        if (piter != mapTx.end())
+            UpdateParent(newit, piter, true);
+    }
+    UpdateAncestorsOf(true, newit, setAncestors);
+    int64_t nSizeAncestors = 0;
+    CAmount nFeesAncestors = 0;
+    BOOST_FOREACH(const txiter& ancestorit, setAncestors) {
+        nSizeAncestors += ancestorit->GetTxSize();
+        nFeesAncestors += ancestorit->GetModifiedFee();
+    }
+    mapTx.modify(newit, update_ancestor_state(nSizeAncestors, nFeesAncestors, setAncestors.size()));
+
+    // When a block is disconnected its transactions return to the pool, possibly
+    // after transactions spending them. Link those up, and recompute the totals
+    // they affect.
+    bool fChildren = false;
+    for (std::map<COutPoint, CInPoint>::iterator it = mapNextTx.lower_bound(COutPoint(hash, 0));
+         it != mapNextTx.end() && it->first.hash == hash; it++) {
+        txiter childit = mapTx.find(it->second.ptx->GetHash());
+        assert(childit != mapTx.end());
+        UpdateChild(newit, childit, true);
+        UpdateParent(childit, newit, true);
+        fChildren = true;
+    }
+    if (fChildren) {
+        setEntries setDescendants;
+        CalculateDescendants(newit, setDescendants);
+        BOOST_FOREACH(const txiter& ancestorit, setAncestors)
+            RecalculateDescendantState(ancestorit);
+        RecalculateDescendantState(newit);
+        setDescendants.erase(newit);
+        BOOST_FOREACH(const txiter& descendantit, setDescendants)
+            RecalculateAncestorState(descendantit);
+    }
+
+    if (fAddrIndex) {
+        // Index the same scripts as the address index of the block chain: spent and created outputs
+        std::vector<uint160>& vAddrIds = mapTxAddrIds[hash];
+        if (pcoins) {
+            BOOST_FOREACH(const CTxIn& txin, tx.vin) {
+                const CCoins* coins = pcoins->AccessCoins(txin.prevout.hash);
+                if (coins && coins->IsAvailable(txin.prevout.n))
+                    ExtractAddrIds(coins->vout[txin.prevout.n].scriptPubKey, vAddrIds);
+            }
+        }
+        BOOST_FOREACH(const CTxOut& txout, tx.vout)
+            ExtractAddrIds(txout.scriptPubKey, vAddrIds);
+        BOOST_FOREACH(const uint160& addrid, vAddrIds)
+            setAddrTx.insert(std::make_pair(addrid, hash));
+        cachedInnerUsage += memusage::DynamicUsage(vAddrIds);
+    }
     nTransactionsUpdated++;
     totalTxSize += entry.GetTxSize();
+    cachedInnerUsage += entry.DynamicMemoryUsage();
     minerPolicyEstimator->processTransaction(entry, fCurrentEstimate);
 
+    NotifyEntryAdded(*newit);
     return true;
 }
 
+void CTxMemPool::removeUnchecked(txiter it)
+{
+    NotifyEntryRemoved(*it);
+    const uint256 hash = it->GetTx().GetHash();
+    BOOST_FOREACH(const CTxIn& txin, it->GetTx().vin)
+        mapNextTx.erase(txin.prevout);
+
+    if (fAddrIndex) {
+        std::map<uint256, std::vector<uint160> >::iterator itAddr = mapTxAddrIds.find(hash);
+        if (itAddr != mapTxAddrIds.end()) {
+            BOOST_FOREACH(const uint160& addrid, itAddr->second)
+                setAddrTx.erase(std::make_pair(addrid, hash));
+            cachedInnerUsage -= memusage::DynamicUsage(itAddr->second);
+            mapTxAddrIds.erase(itAddr);
+        }
+    }
+
+    totalTxSize -= it->GetTxSize();
+    cachedInnerUsage -= it->DynamicMemoryUsage();
+    cachedInnerUsage -= memusage::DynamicUsage(mapLinks[it].parents) + memusage::DynamicUsage(mapLinks[it].children);
+    mapLinks.erase(it);
+    mapTx.erase(it);
+    nTransactionsUpdated++;
+    minerPolicyEstimator->removeTx(hash);
+}
+
+void CTxMemPool::UpdateForRemoveFromMempool(const setEntries& entriesToRemove, bool fUpdateDescendants)
+{
+    // Descendants that stay in the pool lose these ancestors. When whole packages
+    // are removed, there are no such descendants.
+    if (fUpdateDescendants) {
+        BOOST_FOREACH(const txiter& removeit, entriesToRemove) {
+            setEntries setDescendants;
+            CalculateDescendants(removeit, setDescendants);
+            setDescendants.erase(removeit);
+            int64_t nModifySize = -(int64_t)removeit->GetTxSize();
+            CAmount nModifyFee = -removeit->GetModifiedFee();
+            BOOST_FOREACH(const txiter& descendantit, setDescendants)
+                mapTx.modify(descendantit, update_ancestor_state(nModifySize, nModifyFee, -1));
+        }
+    }
+    // The ancestors have to be found before any links are removed.
+    uint64_t nNoLimit = std::numeric_limits<uint64_t>::max();
+    BOOST_FOREACH(const txiter& removeit, entriesToRemove) {
+        setEntries setAncestors;
+        std::string dummy;
+        CalculateMemPoolAncestors(*removeit, setAncestors, nNoLimit, nNoLimit, nNoLimit, nNoLimit, dummy, false);
+        UpdateAncestorsOf(false, removeit, setAncestors);
+    }
+    BOOST_FOREACH(const txiter& removeit, entriesToRemove) {
+        BOOST_FOREACH(const txiter& childit, GetMemPoolChildren(removeit))
+            UpdateParent(childit, removeit, false);
+    }
+}
+
+void CTxMemPool::RemoveStaged(const setEntries& stage, bool fUpdateDescendants)
+{
+    UpdateForRemoveFromMempool(stage, fUpdateDescendants);
+    BOOST_FOREACH(const txiter& it, stage)
+        removeUnchecked(it);
+}
 
 void CTxMemPool::remove(const CTransaction &origTx, std::list<CTransaction>& removed, bool fRecursive)
 {
     // Remove transaction from memory pool
-    {
-        LOCK(cs);
-        std::deque<uint256> txToRemove;
-        txToRemove.push_back(origTx.GetHash());
-        if (fRecursive && !mapTx.count(origTx.GetHash())) {
-            // If recursively removing but origTx isn't in the mempool
-            // be sure to remove any children that are in the pool. This can
-            // happen during chain re-orgs if origTx isn't re-accepted into
-            // the mempool for any reason.
-            for (unsigned int i = 0; i < origTx.vout.size(); i++) {
-                std::map<COutPoint, CInPoint>::iterator it = mapNextTx.find(COutPoint(origTx.GetHash(), i));
-                if (it == mapNextTx.end())
-                    continue;
-                txToRemove.push_back(it->second.ptx->GetHash());
-            }
-        }
-        while (!txToRemove.empty())
-        {
-            uint256 hash = txToRemove.front();
-            txToRemove.pop_front();
-            if (!mapTx.count(hash))
+    LOCK(cs);
+    setEntries txToRemove;
+    txiter origit = mapTx.find(origTx.GetHash());
+    if (origit != mapTx.end()) {
+        txToRemove.insert(origit);
+    } else if (fRecursive) {
+        // If recursively removing but origTx isn't in the mempool
+        // be sure to remove any children that are in the pool. This can
+        // happen during chain re-orgs if origTx isn't re-accepted into
+        // the mempool for any reason.
+        for (unsigned int i = 0; i < origTx.vout.size(); i++) {
+            std::map<COutPoint, CInPoint>::iterator it = mapNextTx.find(COutPoint(origTx.GetHash(), i));
+            if (it == mapNextTx.end())
                 continue;
-            const CTransaction& tx = mapTx[hash].GetTx();
-            if (fRecursive) {
-                for (unsigned int i = 0; i < tx.vout.size(); i++) {
-                    std::map<COutPoint, CInPoint>::iterator it = mapNextTx.find(COutPoint(hash, i));
-                    if (it == mapNextTx.end())
-                        continue;
-                    txToRemove.push_back(it->second.ptx->GetHash());
-                }
-            }
-            BOOST_FOREACH(const CTxIn& txin, tx.vin)
-                mapNextTx.erase(txin.prevout);
-
-            removed.push_back(tx);
-            totalTxSize -= mapTx[hash].GetTxSize();
-            mapTx.erase(hash);
-            nTransactionsUpdated++;
-            minerPolicyEstimator->removeTx(hash);
+            txiter nextit = mapTx.find(it->second.ptx->GetHash());
+            assert(nextit != mapTx.end());
+            txToRemove.insert(nextit);
         }
     }
+    setEntries setAllRemoves;
+    if (fRecursive) {
+        BOOST_FOREACH(const txiter& it, txToRemove)
+            CalculateDescendants(it, setAllRemoves);
+    } else {
+        setAllRemoves.swap(txToRemove);
+    }
+    BOOST_FOREACH(const txiter& it, setAllRemoves)
+        removed.push_back(it->GetTx());
+    RemoveStaged(setAllRemoves, !fRecursive);
 }
 
 void CTxMemPool::removeCoinbaseSpends(const CCoinsViewCache *pcoins, unsigned int nMemPoolHeight)
@@ -158,10 +505,10 @@ void CTxMemPool::removeCoinbaseSpends(const CCoinsViewCache *pcoins, unsigned in
     // Remove transactions spending a coinbase which are now immature
     LOCK(cs);
     list<CTransaction> transactionsToRemove;
-    for (std::map<uint256, CTxMemPoolEntry>::const_iterator it = mapTx.begin(); it != mapTx.end(); it++) {
-        const CTransaction& tx = it->second.GetTx();
+    for (indexed_transaction_set::const_iterator it = mapTx.begin(); it != mapTx.end(); it++) {
+        const CTransaction& tx = it->GetTx();
         BOOST_FOREACH(const CTxIn& txin, tx.vin) {
-            std::map<uint256, CTxMemPoolEntry>::const_iterator it2 = mapTx.find(txin.prevout.hash);
+            indexed_transaction_set::const_iterator it2 = mapTx.find(txin.prevout.hash);
             if (it2 != mapTx.end())
                 continue;
             const CCoins *coins = pcoins->AccessCoins(txin.prevout.hash);
@@ -206,8 +553,9 @@ void CTxMemPool::removeForBlock(const std::vector<CTransaction>& vtx, unsigned i
     BOOST_FOREACH(const CTransaction& tx, vtx)
     {
         uint256 hash = tx.GetHash();
-        if (mapTx.count(hash))
-            entries.push_back(mapTx[hash]);
+        indexed_transaction_set::const_iterator i = mapTx.find(hash);
+        if (i != mapTx.end())
+            entries.push_back(*i);
     }
     BOOST_FOREACH(const CTransaction& tx, vtx)
     {
@@ -218,14 +566,25 @@ void CTxMemPool::removeForBlock(const std::vector<CTransaction>& vtx, unsigned i
     }
     // After the txs in the new block have been removed from the mempool, update policy estimates
     minerPolicyEstimator->processBlock(nBlockHeight, entries, fCurrentEstimate);
+    lastRollingFeeUpdate = GetTime();
+    blockSinceLastRollingFeeBump = true;
 }
 
 void CTxMemPool::clear()
 {
     LOCK(cs);
+    for (txiter it = mapTx.begin(); it != mapTx.end(); ++it)
+        NotifyEntryRemoved(*it);
+    mapLinks.clear();
     mapTx.clear();
     mapNextTx.clear();
+    setAddrTx.clear();
+    mapTxAddrIds.clear();
     totalTxSize = 0;
+    cachedInnerUsage = 0;
+    lastRollingFeeUpdate = GetTime();
+    blockSinceLastRollingFeeBump = false;
+    rollingMinimumFeeRate = 0;
     ++nTransactionsUpdated;
 }
 
@@ -237,21 +596,23 @@ void CTxMemPool::check(const CCoinsViewCache *pcoins) const
     LogPrint("mempool", "Checking mempool with %u transactions and %u inputs\n", (unsigned int)mapTx.size(), (unsigned int)mapNextTx.size());
 
     uint64_t checkTotal = 0;
+    uint64_t innerUsage = 0;
 
     CCoinsViewCache mempoolDuplicate(const_cast<CCoinsViewCache*>(pcoins));
 
     LOCK(cs);
     list<const CTxMemPoolEntry*> waitingOnDependants;
-    for (std::map<uint256, CTxMemPoolEntry>::const_iterator it = mapTx.begin(); it != mapTx.end(); it++) {
+    for (indexed_transaction_set::const_iterator it = mapTx.begin(); it != mapTx.end(); it++) {
         unsigned int i = 0;
-        checkTotal += it->second.GetTxSize();
-        const CTransaction& tx = it->second.GetTx();
+        checkTotal += it->GetTxSize();
+        innerUsage += it->DynamicMemoryUsage();
+        const CTransaction& tx = it->GetTx();
         bool fDependsWait = false;
         BOOST_FOREACH(const CTxIn &txin, tx.vin) {
             // Check that every mempool transaction's inputs refer to available coins, or other mempool tx's.
-            std::map<uint256, CTxMemPoolEntry>::const_iterator it2 = mapTx.find(txin.prevout.hash);
+            indexed_transaction_set::const_iterator it2 = mapTx.find(txin.prevout.hash);
             if (it2 != mapTx.end()) {
-                const CTransaction& tx2 = it2->second.GetTx();
+                const CTransaction& tx2 = it2->GetTx();
                 assert(tx2.vout.size() > txin.prevout.n && !tx2.vout[txin.prevout.n].IsNull());
                 fDependsWait = true;
             } else {
@@ -266,7 +627,7 @@ void CTxMemPool::check(const CCoinsViewCache *pcoins) const
             i++;
         }
         if (fDependsWait)
-            waitingOnDependants.push_back(&it->second);
+            waitingOnDependants.push_back(&(*it));
         else {
             CValidationState state;
             assert(CheckInputs(tx, state, mempoolDuplicate, false, 0, false, NULL));
@@ -288,17 +649,74 @@ void CTxMemPool::check(const CCoinsViewCache *pcoins) const
             stepsSinceLastRemove = 0;
         }
     }
+    // Check the links between the entries, and the ancestor and descendant totals
+    assert(mapLinks.size() == mapTx.size());
+    for (std::map<txiter, TxLinks, CompareIteratorByHash>::const_iterator itLinks = mapLinks.begin(); itLinks != mapLinks.end(); itLinks++) {
+        txiter it = itLinks->first;
+        const uint256& hash = it->GetTx().GetHash();
+        const CTransaction& tx = it->GetTx();
+        std::set<uint256> setParents, setChildren;
+        BOOST_FOREACH(const CTxIn& txin, tx.vin) {
+            if (mapTx.count(txin.prevout.hash))
+                setParents.insert(txin.prevout.hash);
+        }
+        for (std::map<COutPoint, CInPoint>::const_iterator itNext = mapNextTx.lower_bound(COutPoint(hash, 0));
+             itNext != mapNextTx.end() && itNext->first.hash == hash; itNext++)
+            setChildren.insert(itNext->second.ptx->GetHash());
+        std::set<uint256> setLinkedParents, setLinkedChildren;
+        BOOST_FOREACH(const txiter& piter, itLinks->second.parents)
+            setLinkedParents.insert(piter->GetTx().GetHash());
+        BOOST_FOREACH(const txiter& childit, itLinks->second.children)
+            setLinkedChildren.insert(childit->GetTx().GetHash());
+        assert(setParents == setLinkedParents);
+        assert(setChildren == setLinkedChildren);
+        innerUsage += memusage::DynamicUsage(itLinks->second.parents) + memusage::DynamicUsage(itLinks->second.children);
+
+        // Walk the links both ways to recompute the totals
+        for (int nDirection = 0; nDirection < 2; nDirection++) {
+            setEntries setSeen, stage;
+            stage.insert(it);
+            uint64_t nSize = 0;
+            CAmount nFees = 0;
+            while (!stage.empty()) {
+                txiter stageit = *stage.begin();
+                stage.erase(stage.begin());
+                setSeen.insert(stageit);
+                nSize += stageit->GetTxSize();
+                nFees += stageit->GetModifiedFee();
+                const setEntries& setNext = nDirection == 0 ? GetMemPoolParents(stageit) : GetMemPoolChildren(stageit);
+                BOOST_FOREACH(const txiter& nextit, setNext) {
+                    if (!setSeen.count(nextit))
+                        stage.insert(nextit);
+                }
+            }
+            if (nDirection == 0) {
+                assert(it->GetCountWithAncestors() == setSeen.size());
+                assert(it->GetSizeWithAncestors() == nSize);
+                assert(it->GetModFeesWithAncestors() == nFees);
+            } else {
+                assert(it->GetCountWithDescendants() == setSeen.size());
+                assert(it->GetSizeWithDescendants() == nSize);
+                assert(it->GetModFeesWithDescendants() == nFees);
+            }
+        }
+    }
+
     for (std::map<COutPoint, CInPoint>::const_iterator it = mapNextTx.begin(); it != mapNextTx.end(); it++) {
         uint256 hash = it->second.ptx->GetHash();
-        map<uint256, CTxMemPoolEntry>::const_iterator it2 = mapTx.find(hash);
-        const CTransaction& tx = it2->second.GetTx();
+        indexed_transaction_set::const_iterator it2 = mapTx.find(hash);
         assert(it2 != mapTx.end());
+        const CTransaction& tx = it2->GetTx();
         assert(&tx == it->second.ptx);
         assert(tx.vin.size() > it->second.n);
         assert(it->first == it->second.ptx->vin[it->second.n].prevout);
     }
 
+    for (std::map<uint256, std::vector<uint160> >::const_iterator it = mapTxAddrIds.begin(); it != mapTxAddrIds.end(); it++)
+        innerUsage += memusage::DynamicUsage(it->second);
+
     assert(totalTxSize == checkTotal);
+    assert(innerUsage == cachedInnerUsage);
 }
 
 void CTxMemPool::queryHashes(vector<uint256>& vtxid)
@@ -307,16 +725,54 @@ void CTxMemPool::queryHashes(vector<uint256>& vtxid)
 
     LOCK(cs);
     vtxid.reserve(mapTx.size());
-    for (map<uint256, CTxMemPoolEntry>::iterator mi = mapTx.begin(); mi != mapTx.end(); ++mi)
-        vtxid.push_back((*mi).first);
+    for (indexed_transaction_set::iterator mi = mapTx.begin(); mi != mapTx.end(); ++mi)
+        vtxid.push_back(mi->GetTx().GetHash());
+}
+
+/** Orders mempool entries by the time they entered the pool */
+struct CompareTxMemPoolEntryByTime
+{
+    bool operator()(const CTxMemPoolEntry* a, const CTxMemPoolEntry* b) const
+    {
+        if (a->GetTime() != b->GetTime())
+            return a->GetTime() < b->GetTime();
+        return a->GetTx().GetHash() < b->GetTx().GetHash();
+    }
+};
+
+void CTxMemPool::queryAddrIndex(const std::vector<uint160>& vAddrIds, std::vector<CTransaction>& vtx) const
+{
+    LOCK(cs);
+    std::set<uint256> setTxid;
+    BOOST_FOREACH(const uint160& addrid, vAddrIds) {
+        std::set<std::pair<uint160, uint256> >::const_iterator it = setAddrTx.lower_bound(std::make_pair(addrid, uint256()));
+        for (; it != setAddrTx.end() && it->first == addrid; it++)
+            setTxid.insert(it->second);
+    }
+    std::vector<const CTxMemPoolEntry*> entries;
+    BOOST_FOREACH(const uint256& txid, setTxid) {
+        indexed_transaction_set::const_iterator mi = mapTx.find(txid);
+        if (mi != mapTx.end())
+            entries.push_back(&(*mi));
+    }
+    std::sort(entries.begin(), entries.end(), CompareTxMemPoolEntryByTime());
+    vtx.reserve(vtx.size() + entries.size());
+    BOOST_FOREACH(const CTxMemPoolEntry* entry, entries)
+        vtx.push_back(entry->GetTx());
+}
+
+bool CTxMemPool::isSpent(const COutPoint& outpoint) const
+{
+    LOCK(cs);
+    return mapNextTx.count(outpoint) != 0;
 }
 
 bool CTxMemPool::lookup(uint256 hash, CTransaction& result) const
 {
     LOCK(cs);
-    map<uint256, CTxMemPoolEntry>::const_iterator i = mapTx.find(hash);
+    indexed_transaction_set::const_iterator i = mapTx.find(hash);
     if (i == mapTx.end()) return false;
-    result = i->second.GetTx();
+    result = i->GetTx();
     return true;
 }
 
@@ -373,6 +829,22 @@ void CTxMemPool::PrioritiseTransaction(const uint256 hash, const string strHash,
         std::pair<double, CAmount> &deltas = mapDeltas[hash];
         deltas.first += dPriorityDelta;
         deltas.second += nFeeDelta;
+        txiter it = mapTx.find(hash);
+        if (it != mapTx.end()) {
+            mapTx.modify(it, update_fee_delta(deltas.second));
+            // The totals of the packages this transaction is in change along
+            setEntries setAncestors;
+            uint64_t nNoLimit = std::numeric_limits<uint64_t>::max();
+            std::string dummy;
+            CalculateMemPoolAncestors(*it, setAncestors, nNoLimit, nNoLimit, nNoLimit, nNoLimit, dummy, false);
+            BOOST_FOREACH(const txiter& ancestorit, setAncestors)
+                mapTx.modify(ancestorit, update_descendant_state(0, nFeeDelta, 0));
+            setEntries setDescendants;
+            CalculateDescendants(it, setDescendants);
+            setDescendants.erase(it);
+            BOOST_FOREACH(const txiter& descendantit, setDescendants)
+                mapTx.modify(descendantit, update_ancestor_state(0, nFeeDelta, 0));
+        }
     }
     LogPrintf("PrioritiseTransaction: %s priority += %f, fee += %d\n", strHash, dPriorityDelta, FormatMoney(nFeeDelta));
 }
@@ -394,6 +866,89 @@ void CTxMemPool::ClearPrioritisation(const uint256 hash)
     mapDeltas.erase(hash);
 }
 
+size_t CTxMemPool::DynamicMemoryUsage() const
+{
+    LOCK(cs);
+    // Estimate the overhead of mapTx to be 12 pointers + an allocation, as no exact formula for boost::multi_index_contained is implemented.
+    return memusage::MallocUsage(sizeof(CTxMemPoolEntry) + 12 * sizeof(void*)) * mapTx.size() +
+           memusage::DynamicUsage(mapNextTx) + memusage::DynamicUsage(mapDeltas) + memusage::DynamicUsage(mapLinks) +
+           memusage::DynamicUsage(setAddrTx) + memusage::DynamicUsage(mapTxAddrIds) + cachedInnerUsage;
+}
+
+void CTxMemPool::trackPackageRemoved(const CFeeRate& rate)
+{
+    AssertLockHeld(cs);
+    if (rate.GetFeePerK() > rollingMinimumFeeRate) {
+        rollingMinimumFeeRate = rate.GetFeePerK();
+        blockSinceLastRollingFeeBump = false;
+    }
+}
+
+void CTxMemPool::TrimToSize(size_t sizelimit)
+{
+    LOCK(cs);
+    unsigned int nTxnRemoved = 0;
+    CFeeRate maxFeeRateRemoved(0);
+    while (!mapTx.empty() && DynamicMemoryUsage() > sizelimit) {
+        indexed_transaction_set::index<descendant_score>::type::iterator it = mapTx.get<descendant_score>().begin();
+        // Transactions replacing the evicted ones have to pay the fee rate of the
+        // evicted package, plus the relay fee, so the pool can't be churned for free.
+        CFeeRate removed(it->GetModFeesWithDescendants(), it->GetSizeWithDescendants());
+        removed = CFeeRate(removed.GetFeePerK() + ::minRelayTxFee.GetFeePerK());
+        trackPackageRemoved(removed);
+        maxFeeRateRemoved = std::max(maxFeeRateRemoved, removed);
+
+        setEntries stage;
+        CalculateDescendants(mapTx.project<0>(it), stage);
+        nTxnRemoved += stage.size();
+        RemoveStaged(stage, false);
+    }
+    if (maxFeeRateRemoved > CFeeRate(0))
+        LogPrint("mempool", "Removed %u txn, rolling minimum fee bumped to %s\n", nTxnRemoved, maxFeeRateRemoved.ToString());
+}
+
+int CTxMemPool::Expire(int64_t time)
+{
+    LOCK(cs);
+    indexed_transaction_set::index<entry_time>::type::iterator it = mapTx.get<entry_time>().begin();
+    setEntries toremove;
+    while (it != mapTx.get<entry_time>().end() && it->GetTime() < time) {
+        toremove.insert(mapTx.project<0>(it));
+        it++;
+    }
+    setEntries stage;
+    BOOST_FOREACH(const txiter& removeit, toremove)
+        CalculateDescendants(removeit, stage);
+    RemoveStaged(stage, false);
+    return stage.size();
+}
+
+CFeeRate CTxMemPool::GetMinFee(size_t sizelimit) const
+{
+    LOCK(cs);
+    if (!blockSinceLastRollingFeeBump || rollingMinimumFeeRate == 0)
+        return CFeeRate((CAmount)rollingMinimumFeeRate);
+
+    int64_t nTime = GetTime();
+    if (nTime > lastRollingFeeUpdate + 10) {
+        double halflife = ROLLING_FEE_HALFLIFE;
+        size_t nUsage = DynamicMemoryUsage();
+        if (nUsage < sizelimit / 4)
+            halflife /= 4;
+        else if (nUsage < sizelimit / 2)
+            halflife /= 2;
+
+        rollingMinimumFeeRate = rollingMinimumFeeRate / pow(2.0, (nTime - lastRollingFeeUpdate) / halflife);
+        lastRollingFeeUpdate = nTime;
+
+        if (rollingMinimumFeeRate < ::minRelayTxFee.GetFeePerK() / 2) {
+            rollingMinimumFeeRate = 0;
+            return CFeeRate(0);
+        }
+    }
+    return std::max(CFeeRate((CAmount)rollingMinimumFeeRate), ::minRelayTxFee);
+}
+
 bool CTxMemPool::HasNoInputsOf(const CTransaction &tx) const
 {
     for (unsigned int i = 0; i < tx.vin.size(); i++)
@@ -416,6 +971,14 @@ bool CCoinsViewMemPool::GetCoins(const uint256 &txid, CCoins &coins) const {
     return (base->GetCoins(txid, coins) && !coins.IsPruned());
 }
 
+bool CCoinsViewMemPool::GetCoin(const COutPoint &outpoint, CCoins &coins, CTxOut &txout) const {
+    // As in GetCoins, a transaction in the mempool takes precedence.
+    CTransaction tx;
+    if (mempool.lookup(outpoint.hash, tx))
+        return CCoins(tx, MEMPOOL_HEIGHT).GetOutput(outpoint.n, coins, txout);
+    return base->GetCoin(outpoint, coins, txout);
+}
+
 bool CCoinsViewMemPool::HaveCoins(const uint256 &txid) const {
     return mempool.exists(txid) || base->HaveCoins(txid);
 }
@@ -7,12 +7,19 @@
 #define BITCOIN_TXMEMPOOL_H
 
 #include <list>
+#include <map>
+#include <set>
 
 #include "amount.h"
 #include "coins.h"
 #include "primitives/transaction.h"
 #include "sync.h"
 
+#include <boost/multi_index_container.hpp>
+#include <boost/multi_index/identity.hpp>
+#include <boost/multi_index/ordered_index.hpp>
+#include <boost/signals2/signal.hpp>
+
 class CAutoFile;
 
 inline double AllowFreeThreshold()
@@ -31,7 +38,9 @@ inline bool AllowFree(double dPriority)
 static const unsigned int MEMPOOL_HEIGHT = 0x7FFFFFFF;
 
 /**
- * CTxMemPool stores these:
+ * CTxMemPool stores these. Besides the transaction itself, an entry keeps the
+ * totals of its in-mempool ancestors and descendants, both including the entry
+ * itself. The fees in these totals include prioritisation (see GetModifiedFee).
  */
 class CTxMemPoolEntry
 {
@@ -40,10 +49,21 @@ private:
     CAmount nFee; //! Cached to avoid expensive parent-transaction lookups
     size_t nTxSize; //! ... and avoid recomputing tx size
     size_t nModSize; //! ... and modified size for priority
+    size_t nUsageSize; //! ... and total memory usage
     int64_t nTime; //! Local time when entering the mempool
     double dPriority; //! Priority when entering the mempool
     unsigned int nHeight; //! Chain height when entering the mempool
     bool hadNoDependencies; //! Not dependent on any other txs when it entered the mempool
+    bool fInputsVerified; //! Scripts known to be valid under the mandatory flags
+    unsigned int nSigOps; //! Legacy and P2SH sigop count, if fInputsVerified
+    CAmount nFeeDelta; //! Fee delta from PrioritiseTransaction
+
+    uint64_t nCountWithAncestors; //! Number of in-mempool ancestors, plus one
+    uint64_t nSizeWithAncestors; //! ... and their total size
+    CAmount nModFeesWithAncestors; //! ... and their total modified fees
+    uint64_t nCountWithDescendants; //! Number of in-mempool descendants, plus one
+    uint64_t nSizeWithDescendants; //! ... and their total size
+    CAmount nModFeesWithDescendants; //! ... and their total modified fees
 
 public:
     CTxMemPoolEntry(const CTransaction& _tx, const CAmount& _nFee,
@@ -58,8 +78,124 @@ public:
     int64_t GetTime() const { return nTime; }
     unsigned int GetHeight() const { return nHeight; }
     bool WasClearAtEntry() const { return hadNoDependencies; }
+    size_t DynamicMemoryUsage() const { return nUsageSize; }
+
+    /**
+     * Whether the scripts were verified, and the sigops counted. Both only depend on
+     * the outputs being spent, so they stay valid for as long as the entry exists.
+     */
+    bool InputsVerified() const { return fInputsVerified; }
+    unsigned int GetSigOpCount() const { return nSigOps; }
+    void SetInputsVerified(unsigned int nSigOpsIn) { fInputsVerified = true; nSigOps = nSigOpsIn; }
+
+    //! The fee including the delta applied by PrioritiseTransaction
+    CAmount GetModifiedFee() const { return nFee + nFeeDelta; }
+    void UpdateFeeDelta(CAmount nNewFeeDelta);
+    //! Adjust the totals for a change in the set of ancestors or descendants, or in their fees
+    void UpdateAncestorState(int64_t nModifySize, CAmount nModifyFee, int64_t nModifyCount);
+    void UpdateDescendantState(int64_t nModifySize, CAmount nModifyFee, int64_t nModifyCount);
+
+    uint64_t GetCountWithAncestors() const { return nCountWithAncestors; }
+    uint64_t GetSizeWithAncestors() const { return nSizeWithAncestors; }
+    CAmount GetModFeesWithAncestors() const { return nModFeesWithAncestors; }
+    uint64_t GetCountWithDescendants() const { return nCountWithDescendants; }
+    uint64_t GetSizeWithDescendants() const { return nSizeWithDescendants; }
+    CAmount GetModFeesWithDescendants() const { return nModFeesWithDescendants; }
+};
+
+// Helpers for modifying CTxMemPool::mapTx, which is a boost multi_index.
+struct update_descendant_state
+{
+    update_descendant_state(int64_t _modifySize, CAmount _modifyFee, int64_t _modifyCount) :
+        modifySize(_modifySize), modifyFee(_modifyFee), modifyCount(_modifyCount)
+    {}
+
+    void operator() (CTxMemPoolEntry &e)
+        { e.UpdateDescendantState(modifySize, modifyFee, modifyCount); }
+
+    private:
+        int64_t modifySize;
+        CAmount modifyFee;
+        int64_t modifyCount;
+};
+
+struct update_ancestor_state
+{
+    update_ancestor_state(int64_t _modifySize, CAmount _modifyFee, int64_t _modifyCount) :
+        modifySize(_modifySize), modifyFee(_modifyFee), modifyCount(_modifyCount)
+    {}
+
+    void operator() (CTxMemPoolEntry &e)
+        { e.UpdateAncestorState(modifySize, modifyFee, modifyCount); }
+
+    private:
+        int64_t modifySize;
+        CAmount modifyFee;
+        int64_t modifyCount;
+};
+
+struct update_fee_delta
+{
+    update_fee_delta(CAmount _feeDelta) : feeDelta(_feeDelta) { }
+
+    void operator() (CTxMemPoolEntry &e) { e.UpdateFeeDelta(feeDelta); }
+
+private:
+    CAmount feeDelta;
+};
+
+struct set_inputs_verified
+{
+    set_inputs_verified(unsigned int _nSigOps) : nSigOps(_nSigOps) { }
+
+    void operator() (CTxMemPoolEntry &e) { e.SetInputsVerified(nSigOps); }
+
+private:
+    unsigned int nSigOps;
+};
+
+// extracts a CTxMemPoolEntry's transaction hash
+struct mempoolentry_txid
+{
+    typedef uint256 result_type;
+    result_type operator() (const CTxMemPoolEntry &entry) const
+    {
+        return entry.GetTx().GetHash();
+    }
+};
+
+/**
+ * Sort an entry by the higher of its own fee rate and the fee rate of it together
+ * with its descendants, lowest first. Ties are broken by time, newest first.
+ */
+class CompareTxMemPoolEntryByDescendantScore
+{
+public:
+    bool operator()(const CTxMemPoolEntry& a, const CTxMemPoolEntry& b) const;
+};
+
+/** Sort entries by the time they entered the pool, oldest first */
+class CompareTxMemPoolEntryByEntryTime
+{
+public:
+    bool operator()(const CTxMemPoolEntry& a, const CTxMemPoolEntry& b) const
+    {
+        return a.GetTime() < b.GetTime();
+    }
+};
+
+/** Sort entries by the fee rate of them together with their ancestors, highest first */
+class CompareTxMemPoolEntryByAncestorFee
+{
+public:
+    bool operator()(const CTxMemPoolEntry& a, const CTxMemPoolEntry& b) const;
 };
 
+// Multi_index tag names
+struct descendant_score {};
+struct entry_time {};
+struct ancestor_score {};
+
 class CBlockPolicyEstimator;
 
 /** An inpoint - a combination of a transaction and an index n into its vin */
@@ -84,22 +220,120 @@ public:
  * are added to the pool: if a new transaction double-spends
  * an input of a transaction in the pool, it is dropped,
  * as are non-standard transactions.
+ *
+ * mapTx is a boost::multi_index that sorts the entries on several criteria:
+ *
+ * - transaction hash
+ * - descendant score, used to evict transactions when the pool is full
+ *   (see CompareTxMemPoolEntryByDescendantScore)
+ * - time in the mempool, used to expire old transactions
+ * - ancestor score, used to select transactions for blocks
+ *   (see CompareTxMemPoolEntryByAncestorFee)
+ *
+ * The orderings that depend on the fees and sizes of other transactions are
+ * updated through mapTx.modify whenever those change, so readers can take the
+ * entries in order without sorting the pool themselves.
+ *
+ * The pool links every transaction to its in-mempool parents and children,
+ * and keeps the ancestor and descendant totals of every entry up to date as
+ * transactions are added, removed and prioritised. The cost of that is
+ * proportional to the size of the packages involved, which AcceptToMemoryPool
+ * bounds with the -limitancestor* and -limitdescendant* options.
+ *
+ * The pool is kept below a memory limit by TrimToSize, which evicts the
+ * packages with the lowest descendant score first. After an
+ * eviction, GetMinFee requires new transactions to pay more than the evicted
+ * ones did; this requirement decays once blocks come in.
  */
 class CTxMemPool
 {
+public:
+    typedef boost::multi_index_container<
+        CTxMemPoolEntry,
+        boost::multi_index::indexed_by<
+            // sorted by txid
+            boost::multi_index::ordered_unique<mempoolentry_txid>,
+            // sorted by fee rate, for eviction
+            boost::multi_index::ordered_non_unique<
+                boost::multi_index::tag<descendant_score>,
+                boost::multi_index::identity<CTxMemPoolEntry>,
+                CompareTxMemPoolEntryByDescendantScore
+            >,
+            // sorted by entry time, for expiry
+            boost::multi_index::ordered_non_unique<
+                boost::multi_index::tag<entry_time>,
+                boost::multi_index::identity<CTxMemPoolEntry>,
+                CompareTxMemPoolEntryByEntryTime
+            >,
+            // sorted by package fee rate, for mining
+            boost::multi_index::ordered_non_unique<
+                boost::multi_index::tag<ancestor_score>,
+                boost::multi_index::identity<CTxMemPoolEntry>,
+                CompareTxMemPoolEntryByAncestorFee
+            >
+        >
+    > indexed_transaction_set;
+
+    typedef indexed_transaction_set::nth_index<0>::type::iterator txiter;
+    struct CompareIteratorByHash {
+        bool operator()(const txiter& a, const txiter& b) const
+        {
+            return a->GetTx().GetHash() < b->GetTx().GetHash();
+        }
+    };
+    typedef std::set<txiter, CompareIteratorByHash> setEntries;
+
+    //! Half-life of the minimum fee rate raised by evictions, in seconds
+    static const int ROLLING_FEE_HALFLIFE = 60 * 60 * 12;
+
 private:
     bool fSanityCheck; //! Normally false, true if -checkmempool or -regtest
     unsigned int nTransactionsUpdated;
     CBlockPolicyEstimator* minerPolicyEstimator;
 
     uint64_t totalTxSize; //! sum of all mempool tx' byte sizes
+    uint64_t cachedInnerUsage; //! sum of the dynamic memory usage of what the entries and links own, but not of the containers
+
+    mutable int64_t lastRollingFeeUpdate;
+    mutable bool blockSinceLastRollingFeeBump;
+    mutable double rollingMinimumFeeRate; //! minimum fee rate in satoshis per kB to get into the pool, raised by evictions
+
+    bool fAddrIndex; //! Whether transactions are indexed by the addresses of their inputs and outputs
+    std::set<std::pair<uint160, uint256> > setAddrTx; //! (address identifier, txid) pairs, if fAddrIndex
+    std::map<uint256, std::vector<uint160> > mapTxAddrIds; //! address identifiers of each transaction, if fAddrIndex
+
+    struct TxLinks {
+        setEntries parents;
+        setEntries children;
+    };
+    std::map<txiter, TxLinks, CompareIteratorByHash> mapLinks;
+
+    void UpdateParent(txiter entry, txiter parent, bool add);
+    void UpdateChild(txiter entry, txiter child, bool add);
+    /** Add or remove an entry to or from the descendant totals of its ancestors, and the child links of its parents */
+    void UpdateAncestorsOf(bool add, txiter it, const setEntries& setAncestors);
+    /** Recompute the totals of entries whose ancestors or descendants changed in a way the incremental updates don't cover */
+    void RecalculateAncestorState(txiter it);
+    void RecalculateDescendantState(txiter it);
+    /** Update the state of the remaining entries for the removal of a set of entries, before they are removed */
+    void UpdateForRemoveFromMempool(const setEntries& entriesToRemove, bool fUpdateDescendants);
+    /** Remove a set of entries, updating the state of the remaining ones */
+    void RemoveStaged(const setEntries& stage, bool fUpdateDescendants);
+    void removeUnchecked(txiter it);
+    /** Raise the minimum fee rate for entering the pool after a package was evicted at the given rate */
+    void trackPackageRemoved(const CFeeRate& rate);
 
 public:
     mutable CCriticalSection cs;
-    std::map<uint256, CTxMemPoolEntry> mapTx;
+    indexed_transaction_set mapTx;
     std::map<COutPoint, CInPoint> mapNextTx;
     std::map<uint256, std::pair<double, CAmount> > mapDeltas;
 
+    /** Notifies listeners of an entry added to the pool, with cs held */
+    boost::signals2::signal<void (const CTxMemPoolEntry&)> NotifyEntryAdded;
+    /** Notifies listeners of an entry about to be removed from the pool, with cs held */
+    boost::signals2::signal<void (const CTxMemPoolEntry&)> NotifyEntryRemoved;
+
     CTxMemPool(const CFeeRate& _minRelayFee);
     ~CTxMemPool();
 
@@ -111,8 +345,15 @@ public:
      */
     void check(const CCoinsViewCache *pcoins) const;
     void setSanityCheck(bool _fSanityCheck) { fSanityCheck = _fSanityCheck; }
+    void setAddrIndex(bool _fAddrIndex);
 
-    bool addUnchecked(const uint256& hash, const CTxMemPoolEntry &entry, bool fCurrentEstimate = true);
+    /**
+     * Add to memory pool without checking anything. If the address index is enabled,
+     * the scripts of the spent outputs are taken from pcoins, if provided.
+     */
+    bool addUnchecked(const uint256& hash, const CTxMemPoolEntry &entry, bool fCurrentEstimate = true, const CCoinsViewCache *pcoins = NULL);
+    /** Add to memory pool, given the in-mempool ancestors of the entry as found by CalculateMemPoolAncestors */
+    bool addUnchecked(const uint256& hash, const CTxMemPoolEntry &entry, const setEntries& setAncestors, bool fCurrentEstimate = true, const CCoinsViewCache *pcoins = NULL);
     void remove(const CTransaction &tx, std::list<CTransaction>& removed, bool fRecursive = false);
     void removeCoinbaseSpends(const CCoinsViewCache *pcoins, unsigned int nMemPoolHeight);
     void removeConflicts(const CTransaction &tx, std::list<CTransaction>& removed);
@@ -120,7 +361,29 @@ public:
                         std::list<CTransaction>& conflicts, bool fCurrentEstimate = true);
     void clear();
     void queryHashes(std::vector<uint256>& vtxid);
+    /** Get the transactions associated with any of the address identifiers, in the order they entered the pool */
+    void queryAddrIndex(const std::vector<uint160>& vAddrIds, std::vector<CTransaction>& vtx) const;
+    /** Whether an output is spent by a transaction in the pool */
+    bool isSpent(const COutPoint& outpoint) const;
     void pruneSpent(const uint256& hash, CCoins &coins);
+
+    /**
+     * Find all in-mempool ancestors of an entry, and check them against the package limits:
+     * the entry and its ancestors must number at most limitAncestorCount and measure at most
+     * limitAncestorSize bytes, and none of the ancestors may end up with more than
+     * limitDescendantCount descendants or limitDescendantSize bytes of them (both including
+     * itself). If fSearchForParents, the parents are looked up through the inputs of the
+     * entry, which need not be in the pool; otherwise the entry must be in the pool.
+     * Returns false, with a reason in errString, if a limit is exceeded.
+     */
+    bool CalculateMemPoolAncestors(const CTxMemPoolEntry& entry, setEntries& setAncestors,
+                                   uint64_t limitAncestorCount, uint64_t limitAncestorSize,
+                                   uint64_t limitDescendantCount, uint64_t limitDescendantSize,
+                                   std::string& errString, bool fSearchForParents = true);
+    /** Add an entry and all its in-mempool descendants to setDescendants */
+    void CalculateDescendants(txiter it, setEntries& setDescendants);
+    const setEntries& GetMemPoolParents(txiter it) const;
+    const setEntries& GetMemPoolChildren(txiter it) const;
     unsigned int GetTransactionsUpdated() const;
     void AddTransactionsUpdated(unsigned int n);
     /**
@@ -129,6 +392,23 @@ public:
      */
     bool HasNoInputsOf(const CTransaction& tx) const;
 
+    /**
+     * Evict the packages with the lowest descendant score until the dynamic memory
+     * usage of the pool is at most sizelimit bytes.
+     */
+    void TrimToSize(size_t sizelimit);
+
+    /** Remove the transactions that entered the pool before time, and their descendants. Returns the number removed. */
+    int Expire(int64_t time);
+
+    /**
+     * The minimum fee rate a transaction must pay to enter the pool, given its size
+     * limit. Zero until the pool was trimmed; after that the rate decays with a
+     * half-life of ROLLING_FEE_HALFLIFE, shorter if the pool is far below its limit,
+     * once a block has come in since the last eviction.
+     */
+    CFeeRate GetMinFee(size_t sizelimit) const;
+
     /** Affect CreateNewBlock prioritisation of transactions */
     void PrioritiseTransaction(const uint256 hash, const std::string strHash, double dPriorityDelta, const CAmount& nFeeDelta);
     void ApplyDeltas(const uint256 hash, double &dPriorityDelta, CAmount &nFeeDelta);
@@ -153,6 +433,8 @@ public:
 
     bool lookup(uint256 hash, CTransaction& result) const;
 
+    size_t DynamicMemoryUsage() const;
+
     /** Estimate fee rate needed to get into the next nBlocks */
     CFeeRate estimateFee(int nBlocks) const;
 
@@ -176,6 +458,7 @@ protected:
 public:
     CCoinsViewMemPool(CCoinsView *baseIn, CTxMemPool &mempoolIn);
     bool GetCoins(const uint256 &txid, CCoins &coins) const;
+    bool GetCoin(const COutPoint &outpoint, CCoins &coins, CTxOut &txout) const;
     bool HaveCoins(const uint256 &txid) const;
 };
 